@@ -15,14 +15,313 @@
 
 #include <vec3.h>
 #include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include <Macros.h>
 #include <stdio.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define DW_SIMD_SSE
+#include <xmmintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DW_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
 #define CAMERA_SPEED 0.05f
 #define CAMERA_SENSITIVITY 0.02f
 #define CAMERA_ROLL 0.0
 
+#define MEMBER_TRANSIENT 1 // Runtime-only state, skipped by hash() and serialize().
+#define MEMBER_RANGE     2 // m_min and m_max bound the value.
+#define MEMBER_HOT       4 // Touched every frame.
+#define MEMBER_COLD      8 // Rarely touched, e.g. editor or load-time data.
+#define MEMBER_BASE      16 // A base class subobject, declared with REFLECT_BASE.
+
+// Flags of a struct member that also apply to everything inside it.
+#define MEMBER_INHERITED_FLAGS (MEMBER_TRANSIENT | MEMBER_HOT | MEMBER_COLD)
+
+#define REFLECT_HASH_SEED 14695981039346656037ull
+
+struct MemberAttributes
+{
+    uint32_t m_flags = 0;
+    float    m_min = 0.0f;
+    float    m_max = 0.0f;
+    int      m_bits = 0; // Quantization bits, 0 to store at full precision.
+};
+
+struct MemberTransient
+{
+    void apply(MemberAttributes& attributes) const { attributes.m_flags |= MEMBER_TRANSIENT; }
+};
+
+struct MemberHot
+{
+    void apply(MemberAttributes& attributes) const { attributes.m_flags |= MEMBER_HOT; }
+};
+
+struct MemberCold
+{
+    void apply(MemberAttributes& attributes) const { attributes.m_flags |= MEMBER_COLD; }
+};
+
+struct MemberBase
+{
+    void apply(MemberAttributes& attributes) const { attributes.m_flags |= MEMBER_BASE; }
+};
+
+struct MemberRange
+{
+    float m_min;
+    float m_max;
+    
+    MemberRange(float min, float max) : m_min(min), m_max(max) {}
+    
+    void apply(MemberAttributes& attributes) const
+    {
+        attributes.m_flags |= MEMBER_RANGE;
+        attributes.m_min = m_min;
+        attributes.m_max = m_max;
+    }
+};
+
+// Only meaningful together with a range, which the quantized values are spread over.
+struct MemberQuantize
+{
+    int m_bits;
+    
+    MemberQuantize(int bits) : m_bits(bits) {}
+    
+    void apply(MemberAttributes& attributes) const { attributes.m_bits = m_bits; }
+};
+
+inline MemberAttributes member_attributes()
+{
+    return MemberAttributes();
+}
+
+template <typename Attribute, typename... Rest>
+MemberAttributes member_attributes(const Attribute& attribute, const Rest&... rest)
+{
+    MemberAttributes attributes = member_attributes(rest...);
+    attribute.apply(attributes);
+    return attributes;
+}
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    
+    return hash;
+}
+
+// Number of bits needed to store every value in [0, max_value].
+inline int bits_required(uint32_t max_value)
+{
+    int bits = 0;
+    
+    while (bits < 32 && (max_value >> bits) != 0)
+        bits++;
+    
+    return bits;
+}
+
+// Packs values of arbitrary bit width LSB first, without byte alignment between them.
+struct BitWriter
+{
+    std::vector<uint8_t> m_data;
+    uint64_t m_scratch = 0;
+    int      m_scratch_bits = 0;
+    size_t   m_num_bits = 0;
+    
+    void write(uint32_t value, int bits)
+    {
+        assert(bits >= 0 && bits <= 32);
+        
+        m_scratch |= ((uint64_t)value & ((1ull << bits) - 1)) << m_scratch_bits;
+        m_scratch_bits += bits;
+        m_num_bits += bits;
+        
+        while (m_scratch_bits >= 8)
+        {
+            m_data.push_back((uint8_t)m_scratch);
+            m_scratch >>= 8;
+            m_scratch_bits -= 8;
+        }
+    }
+    
+    void write_bytes(const void* data, size_t size)
+    {
+        const uint8_t* bytes = (const uint8_t*)data;
+        
+        for (size_t i = 0; i < size; i++)
+            write(bytes[i], 8);
+    }
+    
+    // Pads the last partial byte with zeros. Call before sending m_data.
+    void flush()
+    {
+        if (m_scratch_bits > 0)
+        {
+            m_data.push_back((uint8_t)m_scratch);
+            m_num_bits += 8 - m_scratch_bits;
+        }
+        
+        m_scratch = 0;
+        m_scratch_bits = 0;
+    }
+    
+    void clear()
+    {
+        m_data.clear();
+        m_scratch = 0;
+        m_scratch_bits = 0;
+        m_num_bits = 0;
+    }
+};
+
+// Reads what a BitWriter wrote. Reading past the end returns zeros and clears ok().
+struct BitReader
+{
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_bit = 0;
+    bool   m_overflow = false;
+    
+    BitReader(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+    
+    uint32_t read(int bits)
+    {
+        assert(bits >= 0 && bits <= 32);
+        
+        if (m_bit + bits > m_size * 8)
+        {
+            m_overflow = true;
+            m_bit = m_size * 8;
+            return 0;
+        }
+        
+        uint32_t value = 0;
+        int done = 0;
+        
+        while (done < bits)
+        {
+            int offset = (int)(m_bit & 7);
+            int count = glm::min(8 - offset, bits - done);
+            uint32_t chunk = (m_data[m_bit >> 3] >> offset) & ((1u << count) - 1);
+            
+            value |= chunk << done;
+            done += count;
+            m_bit += count;
+        }
+        
+        return value;
+    }
+    
+    void read_bytes(void* data, size_t size)
+    {
+        uint8_t* bytes = (uint8_t*)data;
+        
+        for (size_t i = 0; i < size; i++)
+            bytes[i] = (uint8_t)read(8);
+    }
+    
+    bool ok() const
+    {
+        return !m_overflow;
+    }
+};
+
+// Floats with a range and a bit count are quantized uniformly over the range, anything else is sent as is.
+// Integer bounds of a MEMBER_RANGE attribute: the whole numbers inside [m_min, m_max], clamped to the int
+// range. The span is computed in 64 bits, since max - min overflows int for wide ranges.
+inline void int_range(const MemberAttributes& attributes, int64_t& min, int64_t& max)
+{
+    double lo = ceil((double)attributes.m_min);
+    double hi = floor((double)attributes.m_max);
+    
+    // Written so that NaN bounds fall back to the full range.
+    min = lo > (double)INT_MIN ? (lo < (double)INT_MAX ? (int64_t)lo : INT_MAX) : INT_MIN;
+    max = hi < (double)INT_MAX ? (hi > (double)INT_MIN ? (int64_t)hi : INT_MIN) : INT_MAX;
+    
+    if (max < min)
+        max = min;
+}
+
+inline bool quantized(const MemberAttributes& attributes)
+{
+    return (attributes.m_flags & MEMBER_RANGE) && attributes.m_bits > 0 && attributes.m_max > attributes.m_min &&
+           std::isfinite(attributes.m_min) && std::isfinite(attributes.m_max);
+}
+
+inline void write_float_bits(BitWriter& writer, float value, const MemberAttributes& attributes)
+{
+    if (quantized(attributes))
+    {
+        int bits = glm::min(attributes.m_bits, 32);
+        uint32_t max_q = (uint32_t)((1ull << bits) - 1);
+        double t = ((double)value - attributes.m_min) / ((double)attributes.m_max - attributes.m_min);
+        
+        // NaN fails both comparisons and is sent as the minimum.
+        t = t > 0.0 ? (t < 1.0 ? t : 1.0) : 0.0;
+        
+        writer.write((uint32_t)(t * max_q + 0.5), bits);
+    }
+    else
+        writer.write_bytes(&value, sizeof(float));
+}
+
+inline float read_float_bits(BitReader& reader, const MemberAttributes& attributes)
+{
+    if (quantized(attributes))
+    {
+        int bits = glm::min(attributes.m_bits, 32);
+        uint32_t max_q = (uint32_t)((1ull << bits) - 1);
+        double t = (double)reader.read(bits) / max_q;
+        float value = (float)(attributes.m_min + t * ((double)attributes.m_max - attributes.m_min));
+        
+        return glm::clamp(value, attributes.m_min, attributes.m_max);
+    }
+    
+    float value;
+    reader.read_bytes(&value, sizeof(float));
+    
+    return value;
+}
+
+struct TypeDescriptor_Struct;
+struct TypeDescriptor_Enum;
+
 struct TypeDescriptor
 {
     const char* m_name;
@@ -30,22 +329,92 @@ struct TypeDescriptor
     
     TypeDescriptor(const char* name, size_t size) : m_name(name), m_size(size) {}
     virtual void gui(void* obj, const char* name) = 0;
+    
+    virtual TypeDescriptor_Struct* as_struct()
+    {
+        return nullptr;
+    }
+    
+    virtual TypeDescriptor_Enum* as_enum()
+    {
+        return nullptr;
+    }
+    
+    // Called for struct members, so types that can use the member's attributes (e.g. a range) may override it.
+    virtual void member_gui(void* obj, const char* name, const MemberAttributes& attributes)
+    {
+        gui(obj, name);
+    }
+    
+    // Plain types hash and serialize their bytes. Structs visit their members instead and skip those with
+    // any of the exclude flags, so padding and transient caches never affect the result.
+    virtual uint64_t hash(const void* obj, uint64_t seed = REFLECT_HASH_SEED, uint32_t exclude = MEMBER_TRANSIENT)
+    {
+        return fnv1a(obj, m_size, seed);
+    }
+    
+    virtual void serialize(const void* obj, std::vector<uint8_t>& out, uint32_t exclude = MEMBER_TRANSIENT)
+    {
+        const uint8_t* bytes = (const uint8_t*)obj;
+        out.insert(out.end(), bytes, bytes + m_size);
+    }
+    
+    // Excluded members keep their current value. Returns false if the data ends early.
+    virtual bool deserialize(void* obj, const uint8_t*& data, const uint8_t* end, uint32_t exclude = MEMBER_TRANSIENT)
+    {
+        if ((size_t)(end - data) < m_size)
+            return false;
+        
+        memcpy(obj, data, m_size);
+        data += m_size;
+        
+        return true;
+    }
+    
+    // Bit-packed encoding for replication. attributes are those of the member being written, so a type can
+    // use its range and precision; types without a compact encoding write their bytes.
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT)
+    {
+        writer.write_bytes(obj, m_size);
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT)
+    {
+        reader.read_bytes(obj, m_size);
+    }
+    
+    // Looks up a direct child by name for property paths. name is not null terminated.
+    virtual bool find_member(const char* name, size_t length, size_t& offset, TypeDescriptor*& type)
+    {
+        return false;
+    }
 };
 
 struct TypeDescriptor_Struct : public TypeDescriptor
 {
     struct Member
     {
-        const char*     m_name;
-        size_t          m_offset;
-        TypeDescriptor* m_type;
+        const char*      m_name;
+        size_t           m_offset;
+        TypeDescriptor*  m_type;
+        MemberAttributes m_attributes;
         
-        Member(const char* name, size_t offset, TypeDescriptor* type) : m_name(name), m_offset(offset), m_type(type)
+        Member(const char* name, size_t offset, TypeDescriptor* type, const MemberAttributes& attributes = MemberAttributes()) : m_name(name), m_offset(offset), m_type(type), m_attributes(attributes)
         {
             
         }
     };
     
+    // A primitive reached through any depth of nested members and base classes, with its offset from the
+    // start of the outermost struct.
+    struct FlatMember
+    {
+        std::string      m_path;
+        size_t           m_offset;
+        TypeDescriptor*  m_type;
+        MemberAttributes m_attributes; // The leaf's own, plus the inherited flags of every enclosing member.
+    };
+    
     int m_num_members;
     Member* m_members;
     
@@ -60,15 +429,184 @@ struct TypeDescriptor_Struct : public TypeDescriptor
         m_num_members = num_members;
     }
     
+    virtual TypeDescriptor_Struct* as_struct() override
+    {
+        return this;
+    }
+    
+    // Built on first use rather than in init(), since nested types may be initialized later during static
+    // initialization.
+    const std::vector<FlatMember>& flat_members()
+    {
+        if (!m_flattened.load(std::memory_order_acquire))
+        {
+            std::lock_guard<std::mutex> lock(m_flatten_mutex);
+            
+            if (!m_flattened.load(std::memory_order_relaxed))
+            {
+                flatten(this, 0, "", 0, std::vector<std::string>(), m_flat_members);
+                m_flattened.store(true, std::memory_order_release);
+            }
+        }
+        
+        return m_flat_members;
+    }
+    
     virtual void gui(void* obj, const char* name) override
     {
         char* char_obj = (char*)obj;
+        const std::vector<FlatMember>& members = flat_members();
         
         ImGui::Text("%s", name);
         ImGui::Spacing();
         
+        for (size_t i = 0; i < members.size(); i++)
+            members[i].m_type->member_gui(char_obj + members[i].m_offset, members[i].m_path.c_str(), members[i].m_attributes);
+    }
+    
+    virtual uint64_t hash(const void* obj, uint64_t seed = REFLECT_HASH_SEED, uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        const std::vector<FlatMember>& members = flat_members();
+        
+        for (size_t i = 0; i < members.size(); i++)
+        {
+            if (!(members[i].m_attributes.m_flags & exclude))
+                seed = members[i].m_type->hash((const char*)obj + members[i].m_offset, seed, exclude);
+        }
+        
+        return seed;
+    }
+    
+    virtual void serialize(const void* obj, std::vector<uint8_t>& out, uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        const std::vector<FlatMember>& members = flat_members();
+        
+        for (size_t i = 0; i < members.size(); i++)
+        {
+            if (!(members[i].m_attributes.m_flags & exclude))
+                members[i].m_type->serialize((const char*)obj + members[i].m_offset, out, exclude);
+        }
+    }
+    
+    virtual bool deserialize(void* obj, const uint8_t*& data, const uint8_t* end, uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        const std::vector<FlatMember>& members = flat_members();
+        
+        for (size_t i = 0; i < members.size(); i++)
+        {
+            if (!(members[i].m_attributes.m_flags & exclude) &&
+                !members[i].m_type->deserialize((char*)obj + members[i].m_offset, data, end, exclude))
+                return false;
+        }
+        
+        return true;
+    }
+    
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        const std::vector<FlatMember>& members = flat_members();
+        
+        for (size_t i = 0; i < members.size(); i++)
+        {
+            if (!(members[i].m_attributes.m_flags & exclude))
+                members[i].m_type->write_bits((const char*)obj + members[i].m_offset, writer, members[i].m_attributes, exclude);
+        }
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        const std::vector<FlatMember>& members = flat_members();
+        
+        for (size_t i = 0; i < members.size(); i++)
+        {
+            if (!(members[i].m_attributes.m_flags & exclude))
+                members[i].m_type->read_bits((char*)obj + members[i].m_offset, reader, members[i].m_attributes, exclude);
+        }
+    }
+    
+    // Members of base classes are found by their own name. As in C++, a member of the struct itself hides
+    // base members of the same name; between bases, the first declared wins.
+    virtual bool find_member(const char* name, size_t length, size_t& offset, TypeDescriptor*& type) override
+    {
+        for (int i = 0; i < m_num_members; i++)
+        {
+            if (!(m_members[i].m_attributes.m_flags & MEMBER_BASE) && strncmp(m_members[i].m_name, name, length) == 0 && m_members[i].m_name[length] == '\0')
+            {
+                offset = m_members[i].m_offset;
+                type = m_members[i].m_type;
+                return true;
+            }
+        }
+        
         for (int i = 0; i < m_num_members; i++)
-            m_members[i].m_type->gui(char_obj + m_members[i].m_offset, m_members[i].m_name);
+        {
+            if ((m_members[i].m_attributes.m_flags & MEMBER_BASE) && m_members[i].m_type->find_member(name, length, offset, type))
+            {
+                offset += m_members[i].m_offset;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+private:
+    std::vector<FlatMember> m_flat_members;
+    std::atomic<bool> m_flattened { false };
+    std::mutex m_flatten_mutex;
+    
+    // Names the members of a struct are reachable by without a path segment: its own and its bases'.
+    static void visible_names(TypeDescriptor_Struct* type, std::vector<std::string>& names)
+    {
+        for (int i = 0; i < type->m_num_members; i++)
+        {
+            if (type->m_members[i].m_attributes.m_flags & MEMBER_BASE)
+                visible_names(type->m_members[i].m_type->as_struct(), names);
+            else
+                names.push_back(type->m_members[i].m_name);
+        }
+    }
+    
+    // hidden holds the names a more derived struct already declares, whose members are left out so that
+    // every path appears once and resolves to what find_member() returns.
+    static void flatten(TypeDescriptor_Struct* type, size_t offset, const std::string& prefix, uint32_t flags, const std::vector<std::string>& hidden, std::vector<FlatMember>& out)
+    {
+        std::vector<std::string> base_hidden = hidden;
+        
+        for (int i = 0; i < type->m_num_members; i++)
+        {
+            if (!(type->m_members[i].m_attributes.m_flags & MEMBER_BASE))
+                base_hidden.push_back(type->m_members[i].m_name);
+        }
+        
+        for (int i = 0; i < type->m_num_members; i++)
+        {
+            const Member& member = type->m_members[i];
+            TypeDescriptor_Struct* nested = member.m_type->as_struct();
+            uint32_t member_flags = flags | (member.m_attributes.m_flags & MEMBER_INHERITED_FLAGS);
+            
+            if (member.m_attributes.m_flags & MEMBER_BASE)
+            {
+                // A base class adds no path segment, its members are named as if declared in the derived type.
+                flatten(nested, offset + member.m_offset, prefix, member_flags, base_hidden, out);
+                visible_names(nested, base_hidden);
+            }
+            else if (std::find(hidden.begin(), hidden.end(), member.m_name) != hidden.end())
+                continue;
+            else if (nested)
+                flatten(nested, offset + member.m_offset, prefix + member.m_name + ".", member_flags, std::vector<std::string>(), out);
+            else
+            {
+                FlatMember flat;
+                flat.m_path = prefix + member.m_name;
+                flat.m_offset = offset + member.m_offset;
+                flat.m_type = member.m_type;
+                flat.m_attributes = member.m_attributes;
+                flat.m_attributes.m_flags |= member_flags;
+                
+                out.push_back(flat);
+            }
+        }
     }
 };
 
@@ -90,6 +628,11 @@ struct TypeDescriptor_Enum : public TypeDescriptor
 
     }
     
+    virtual TypeDescriptor_Enum* as_enum() override
+    {
+        return this;
+    }
+    
     int current_value_index(int value)
     {
         for (int i = 0; i < m_num_constants; i++)
@@ -117,6 +660,18 @@ struct TypeDescriptor_Enum : public TypeDescriptor
         }
     }
     
+    // Sends the index of the constant, so only as many bits as the constant count needs.
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        writer.write(current_value_index(*(const int*)obj), bits_required(m_num_constants - 1));
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        uint32_t index = reader.read(bits_required(m_num_constants - 1));
+        *(int*)obj = m_constants[index < m_num_constants ? index : 0].m_value;
+    }
+    
     int       m_num_constants;
     Constant* m_constants;
 };
@@ -183,14 +738,52 @@ struct TypeDescriptor_Int : TypeDescriptor
     {
         ImGui::InputInt(name, (int*)obj);
     }
-};
-
-template <>
-TypeDescriptor* get_primitive_descriptor<int>()
-{
-    static TypeDescriptor_Int typeDesc;
-    return &typeDesc;
-}
+    
+    virtual void member_gui(void* obj, const char* name, const MemberAttributes& attributes) override
+    {
+        if (attributes.m_flags & MEMBER_RANGE)
+            ImGui::SliderInt(name, (int*)obj, (int)attributes.m_min, (int)attributes.m_max);
+        else
+            gui(obj, name);
+    }
+    
+    // Ranged ints are sent as an offset from the minimum with just enough bits for the range.
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        int value = *(const int*)obj;
+        
+        if (attributes.m_flags & MEMBER_RANGE)
+        {
+            int64_t min, max;
+            int_range(attributes, min, max);
+            
+            writer.write((uint32_t)(std::max(min, std::min((int64_t)value, max)) - min), bits_required((uint32_t)(max - min)));
+        }
+        else
+            writer.write((uint32_t)value, 32);
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        if (attributes.m_flags & MEMBER_RANGE)
+        {
+            int64_t min, max;
+            int_range(attributes, min, max);
+            
+            // The field can hold more than the range, so corrupt input is clamped back into it.
+            *(int*)obj = (int)std::min(min + (int64_t)reader.read(bits_required((uint32_t)(max - min))), max);
+        }
+        else
+            *(int*)obj = (int)reader.read(32);
+    }
+};
+
+template <>
+TypeDescriptor* get_primitive_descriptor<int>()
+{
+    static TypeDescriptor_Int typeDesc;
+    return &typeDesc;
+}
 
 struct TypeDescriptor_Bool : TypeDescriptor
 {
@@ -203,6 +796,16 @@ struct TypeDescriptor_Bool : TypeDescriptor
     {
         ImGui::Checkbox(name, (bool*)obj);
     }
+    
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        writer.write(*(const bool*)obj ? 1 : 0, 1);
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        *(bool*)obj = reader.read(1) != 0;
+    }
 };
 
 template <>
@@ -223,6 +826,24 @@ struct TypeDescriptor_Float : TypeDescriptor
     {
         ImGui::InputFloat(name, (float*)obj);
     }
+    
+    virtual void member_gui(void* obj, const char* name, const MemberAttributes& attributes) override
+    {
+        if (attributes.m_flags & MEMBER_RANGE)
+            ImGui::SliderFloat(name, (float*)obj, attributes.m_min, attributes.m_max);
+        else
+            gui(obj, name);
+    }
+    
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        write_float_bits(writer, *(const float*)obj, attributes);
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        *(float*)obj = read_float_bits(reader, attributes);
+    }
 };
 
 template <>
@@ -245,7 +866,18 @@ TypeDescriptor* get_primitive_descriptor<float>()
                                 Reflection.init(members, sizeof(members)/sizeof(TypeDescriptor_Struct::Member)); \
                             }
 
-#define REFLECT_MEMBER(MEMBER) { #MEMBER, offsetof(T, MEMBER), TypeResolver::get<decltype(MEMBER)>() },
+// Optional attributes follow the member name, e.g. REFLECT_MEMBER(speed, MemberRange(0.0f, 10.0f), MemberHot()).
+#define REFLECT_MEMBER(MEMBER, ...) { #MEMBER, offsetof(T, MEMBER), TypeResolver::get<decltype(MEMBER)>(), member_attributes(__VA_ARGS__) },
+
+// Reflects a base class of T, which must itself be reflected. Its members are inherited by name.
+#define REFLECT_BASE(BASE) { #BASE, base_offset<T, BASE>(), TypeResolver::get<BASE>(), member_attributes(MemberBase()) },
+
+template <typename Derived, typename Base>
+size_t base_offset()
+{
+    // Any non-null address works, the cast only applies the offset of Base within Derived.
+    return (size_t)((uintptr_t)static_cast<Base*>((Derived*)0x1000) - 0x1000);
+}
 
 #define DECLARE_ENUM_TYPE_DESC(TYPE) struct TypeDescriptor_##TYPE : TypeDescriptor_Enum   \
 {                                                    \
@@ -267,824 +899,6025 @@ m_constants = &constants[0];                          \
 m_num_constants = sizeof(constants)/sizeof(Constant); \
 }
 
-namespace dd
+// Resolves x/y/z/w or r/g/b/a to a float component of a vector with the given number of components.
+inline bool find_vector_component(const char* name, size_t length, int count, size_t& offset, TypeDescriptor*& type)
 {
-    struct DW_ALIGNED(16) CameraUniforms
+    if (length != 1)
+        return false;
+    
+    // Identical literals are not guaranteed to share storage, so each set is named once.
+    static const char* const xyzw = "xyzw";
+    static const char* const rgba = "rgba";
+    
+    const char* position = name[0] ? strchr(xyzw, name[0]) : nullptr;
+    const char* color = name[0] ? strchr(rgba, name[0]) : nullptr;
+    int component = position ? (int)(position - xyzw) : color ? (int)(color - rgba) : count;
+    
+    if (component >= count)
+        return false;
+    
+    offset = sizeof(float) * component;
+    type = TypeResolver::get<float>();
+    
+    return true;
+}
+
+struct TypeDescriptor_Vec3 : TypeDescriptor
+{
+    TypeDescriptor_Vec3() : TypeDescriptor{"vec3", sizeof(glm::vec3)}
     {
-        glm::mat4 view_proj;
-    };
+        
+    }
     
-    struct VertexWorld
+    virtual void gui(void* obj, const char* name) override
     {
-        glm::vec3 position;
-        glm::vec2 uv;
-        glm::vec3 color;
-    };
+        ImGui::InputFloat3(name, (float*)obj);
+    }
     
-    struct DrawCommand
+    virtual bool find_member(const char* name, size_t length, size_t& offset, TypeDescriptor*& type) override
     {
-        int type;
-        int vertices;
-    };
+        return find_vector_component(name, length, 3, offset, type);
+    }
     
-#define MAX_VERTICES 100000
+    // The member's range and precision apply to each component.
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        for (int i = 0; i < 3; i++)
+            write_float_bits(writer, ((const float*)obj)[i], attributes);
+    }
     
-    const glm::vec4 kFrustumCorners[] = {
-        glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f),
-        glm::vec4(-1.0f, 1.0f, 1.0f, 1.0f),
-        glm::vec4(1.0f, 1.0f, 1.0f, 1.0f),
-        glm::vec4(1.0f, -1.0f, 1.0f, 1.0f),
-        glm::vec4(-1.0f, -1.0f, -1.0f, 1.0f),
-        glm::vec4(-1.0f, 1.0f, -1.0f, 1.0f),
-        glm::vec4(1.0f, 1.0f, -1.0f, 1.0f),
-        glm::vec4(1.0f, -1.0f, -1.0f, 1.0f)
-    };
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        for (int i = 0; i < 3; i++)
+            ((float*)obj)[i] = read_float_bits(reader, attributes);
+    }
+};
+
+template <>
+TypeDescriptor* get_primitive_descriptor<glm::vec3>()
+{
+    static TypeDescriptor_Vec3 typeDesc;
+    return &typeDesc;
+}
+
+struct TypeDescriptor_Vec4 : TypeDescriptor
+{
+    TypeDescriptor_Vec4() : TypeDescriptor{"vec4", sizeof(glm::vec4)}
+    {
+        
+    }
     
-    class Renderer
+    virtual void gui(void* obj, const char* name) override
+    {
+        ImGui::InputFloat4(name, (float*)obj);
+    }
+    
+    virtual bool find_member(const char* name, size_t length, size_t& offset, TypeDescriptor*& type) override
+    {
+        return find_vector_component(name, length, 4, offset, type);
+    }
+    
+    // The member's range and precision apply to each component.
+    virtual void write_bits(const void* obj, BitWriter& writer, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        for (int i = 0; i < 4; i++)
+            write_float_bits(writer, ((const float*)obj)[i], attributes);
+    }
+    
+    virtual void read_bits(void* obj, BitReader& reader, const MemberAttributes& attributes = MemberAttributes(), uint32_t exclude = MEMBER_TRANSIENT) override
+    {
+        for (int i = 0; i < 4; i++)
+            ((float*)obj)[i] = read_float_bits(reader, attributes);
+    }
+};
+
+template <>
+TypeDescriptor* get_primitive_descriptor<glm::vec4>()
+{
+    static TypeDescriptor_Vec4 typeDesc;
+    return &typeDesc;
+}
+
+struct TypeDescriptor_Mat4 : TypeDescriptor
+{
+    TypeDescriptor_Mat4() : TypeDescriptor{"mat4", sizeof(glm::mat4)}
     {
-    private:
-        CameraUniforms m_uniforms;
-        VertexArray* m_line_vao;
-        VertexBuffer* m_line_vbo;
-        InputLayout* m_line_il;
-        Shader* m_line_vs;
-        Shader* m_line_fs;
-        ShaderProgram* m_line_program;
-        UniformBuffer* m_ubo;
-        std::vector<VertexWorld> m_world_vertices;
-        std::vector<DrawCommand> m_draw_commands;
-        RenderDevice* m_device;
-        RasterizerState* m_rs;
-        DepthStencilState* m_ds;
         
-    public:
-        Renderer()
+    }
+    
+    virtual void gui(void* obj, const char* name) override
+    {
+        glm::mat4& m = *(glm::mat4*)obj;
+        
+        ImGui::Text("%s", name);
+        
+        for (int i = 0; i < 4; i++)
         {
-            m_world_vertices.resize(MAX_VERTICES);
-            m_world_vertices.clear();
-            
-            m_draw_commands.resize(MAX_VERTICES);
-            m_draw_commands.clear();
+            ImGui::PushID(i);
+            ImGui::InputFloat4("", &m[i][0]);
+            ImGui::PopID();
         }
+    }
+};
+
+template <>
+TypeDescriptor* get_primitive_descriptor<glm::mat4>()
+{
+    static TypeDescriptor_Mat4 typeDesc;
+    return &typeDesc;
+}
+
+// A property path such as "transform.pos.x", resolved once against the reflection tree so that animation
+// and script bindings can read and write the property every frame without any string work. Reflected
+// members are stored by value, so the offsets along the path collapse into one.
+struct PropertyAccessor
+{
+    size_t          m_offset = 0;
+    TypeDescriptor* m_type = nullptr;
+    
+    // Returns an invalid accessor if any part of the path does not name a member of its parent.
+    static PropertyAccessor compile(TypeDescriptor* root, const char* path)
+    {
+        TypeDescriptor* type = root;
+        size_t offset = 0;
         
-        bool init(RenderDevice* _device)
+        while (true)
         {
-            m_device = _device;
-            
-            std::string vs_str;
-            Utility::ReadText("shader/debug_draw_vs.glsl", vs_str);
-            
-            std::string fs_str;
-            Utility::ReadText("shader/debug_draw_fs.glsl", fs_str);
-            
-            m_line_vs = m_device->create_shader(vs_str.c_str(), ShaderType::VERTEX);
-            m_line_fs = m_device->create_shader(fs_str.c_str(), ShaderType::FRAGMENT);
-            
-            if (!m_line_vs || !m_line_fs)
-            {
-                LOG_FATAL("Failed to create Shaders");
-                return false;
-            }
-            
-            Shader* shaders[] = { m_line_vs, m_line_fs };
-            m_line_program = m_device->create_shader_program(shaders, 2);
-            
-            BufferCreateDesc bc;
-            InputLayoutCreateDesc ilcd;
-            VertexArrayCreateDesc vcd;
-            
-            DW_ZERO_MEMORY(bc);
-            bc.data = nullptr;
-            bc.data_type = DataType::FLOAT;
-            bc.size = sizeof(VertexWorld) * MAX_VERTICES;
-            bc.usage_type = BufferUsageType::DYNAMIC;
-            
-            m_line_vbo = m_device->create_vertex_buffer(bc);
-            
-            InputElement elements[] =
-            {
-                { 3, DataType::FLOAT, false, 0, "POSITION" },
-                { 2, DataType::FLOAT, false, sizeof(float) * 3, "TEXCOORD" },
-                { 3, DataType::FLOAT, false, sizeof(float) * 5, "COLOR" }
-            };
-            
-            DW_ZERO_MEMORY(ilcd);
-            ilcd.elements = elements;
-            ilcd.num_elements = 3;
-            ilcd.vertex_size = sizeof(float) * 8;
-            
-            m_line_il = m_device->create_input_layout(ilcd);
-            
-            DW_ZERO_MEMORY(vcd);
-            vcd.index_buffer = nullptr;
-            vcd.vertex_buffer = m_line_vbo;
-            vcd.layout = m_line_il;
-            
-            m_line_vao = m_device->create_vertex_array(vcd);
-            
-            if (!m_line_vao || !m_line_vbo)
-            {
-                LOG_FATAL("Failed to create Vertex Buffers/Arrays");
-                return false;
-            }
-            
-            RasterizerStateCreateDesc rs_desc;
-            DW_ZERO_MEMORY(rs_desc);
-            rs_desc.cull_mode = CullMode::NONE;
-            rs_desc.fill_mode = FillMode::SOLID;
-            rs_desc.front_winding_ccw = true;
-            rs_desc.multisample = true;
-            rs_desc.scissor = false;
-            
-            m_rs = m_device->create_rasterizer_state(rs_desc);
-            
-            DepthStencilStateCreateDesc ds_desc;
-            DW_ZERO_MEMORY(ds_desc);
-            ds_desc.depth_mask = true;
-            ds_desc.enable_depth_test = true;
-            ds_desc.enable_stencil_test = false;
-            ds_desc.depth_cmp_func = ComparisonFunction::LESS_EQUAL;
+            const char* end = strchr(path, '.');
+            size_t length = end ? end - path : strlen(path);
+            size_t member_offset;
             
-            m_ds = m_device->create_depth_stencil_state(ds_desc);
+            if (length == 0 || !type->find_member(path, length, member_offset, type))
+                return PropertyAccessor();
             
-            BufferCreateDesc uboDesc;
-            DW_ZERO_MEMORY(uboDesc);
-            uboDesc.data = nullptr;
-            uboDesc.data_type = DataType::FLOAT;
-            uboDesc.size = sizeof(CameraUniforms);
-            uboDesc.usage_type = BufferUsageType::DYNAMIC;
+            offset += member_offset;
             
-            m_ubo = m_device->create_uniform_buffer(uboDesc);
+            if (!end)
+                break;
             
-            return true;
+            path = end + 1;
         }
         
-        void shutdown()
-        {
-            m_device->destroy(m_ubo);
-            m_device->destroy(m_line_program);
-            m_device->destroy(m_line_vs);
-            m_device->destroy(m_line_fs);
-            m_device->destroy(m_line_vbo);
-            m_device->destroy(m_line_vao);
-            m_device->destroy(m_ds);
-            m_device->destroy(m_rs);
-        }
+        PropertyAccessor accessor;
+        accessor.m_offset = offset;
+        accessor.m_type = type;
         
-        void capsule(const float& _height, const float& _radius, const glm::vec3& _pos, const glm::vec3& _c)
-        {
-            // Draw four lines
-            line(glm::vec3(_pos.x, _pos.y + _radius, _pos.z-_radius), glm::vec3(_pos.x, _height - _radius, _pos.z-_radius), _c);
-            line(glm::vec3(_pos.x, _pos.y + _radius, _pos.z+_radius), glm::vec3(_pos.x, _height - _radius, _pos.z+_radius), _c);
-            line(glm::vec3(_pos.x-_radius, _pos.y + _radius, _pos.z), glm::vec3(_pos.x-_radius, _height - _radius, _pos.z), _c);
-            line(glm::vec3(_pos.x+_radius, _pos.y + _radius, _pos.z), glm::vec3(_pos.x+_radius, _height - _radius, _pos.z), _c);
-            
-            glm::vec3 verts[10];
-            
-            int idx = 0;
-            
-            for (int i = 0; i <= 180; i += 20)
-            {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = glm::vec3(_pos.x + cos(degInRad)*_radius, _height - _radius + sin(degInRad)*_radius, _pos.z);
-            }
+        return accessor;
+    }
+    
+    template <typename T>
+    static PropertyAccessor compile(const char* path)
+    {
+        return compile(TypeResolver::get<T>(), path);
+    }
+    
+    bool valid() const
+    {
+        return m_type != nullptr;
+    }
+    
+    void* get(void* obj) const
+    {
+        return (char*)obj + m_offset;
+    }
+    
+    template <typename T>
+    T& get(void* obj) const
+    {
+        assert(m_type == TypeResolver::get<T>());
+        return *(T*)((char*)obj + m_offset);
+    }
+    
+    template <typename T>
+    void set(void* obj, const T& value) const
+    {
+        get<T>(obj) = value;
+    }
+};
+
+#define FILTER_BLOCK_SIZE 1024
+#define FILTER_BLOCK_WORDS (FILTER_BLOCK_SIZE / 64)
+#define FILTER_MAX_STACK 16
+#define FILTER_MAX_COLUMNS 16
+
+enum FilterOp
+{
+    FILTER_OP_COMPARE,
+    FILTER_OP_AND,
+    FILTER_OP_OR,
+    FILTER_OP_NOT
+};
+
+enum FilterType
+{
+    FILTER_TYPE_FLOAT,
+    FILTER_TYPE_INT, // Also used for enums.
+    FILTER_TYPE_BOOL
+};
+
+enum FilterCompare
+{
+    FILTER_COMPARE_LT,
+    FILTER_COMPARE_LE,
+    FILTER_COMPARE_GT,
+    FILTER_COMPARE_GE,
+    FILTER_COMPARE_EQ,
+    FILTER_COMPARE_NE
+};
+
+struct FilterInstruction
+{
+    uint8_t  op;
+    uint8_t  type;
+    uint8_t  compare;
+    uint8_t  column;
+    
+    union
+    {
+        float   f;
+        int32_t i;
+    } value;
+};
+
+inline size_t count_selected(const std::vector<uint64_t>& selection)
+{
+    size_t count = 0;
+    
+    for (size_t i = 0; i < selection.size(); i++)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        count += __builtin_popcountll(selection[i]);
+#else
+        uint64_t x = selection[i] - ((selection[i] >> 1) & 0x5555555555555555ull);
+        x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+        count += (((x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full) * 0x0101010101010101ull) >> 56;
+#endif
+    }
+    
+    return count;
+}
+
+// A predicate such as "b > 10.0 && vsync" over the members of a reflected type, compiled once into postfix
+// bytecode over member offsets. Evaluation runs one instruction at a time over blocks of objects, so every
+// comparison is a tight loop over a single column that compares four values per SSE instruction, and the
+// boolean operators combine the resulting bitmaps a word at a time. Bit i of the selection is set when
+// object i matches.
+//
+// Grammar: or := and ("||" and)*, and := unary ("&&" unary)*, unary := "!" unary | "(" or ")" | compare,
+// compare := path [("<" | "<=" | ">" | ">=" | "==" | "!=") literal]. Paths are property paths to float,
+// int, bool or enum members; a bare path must be a bool. Literals are numbers, true/false or enum constants.
+class FilterQuery
+{
+public:
+    std::vector<FilterInstruction> m_code;
+    std::vector<PropertyAccessor> m_columns; // Distinct members read by the query, indexed by FilterInstruction::column.
+    std::string m_error;                     // Set when compilation fails.
+    
+    static FilterQuery compile(TypeDescriptor* type, const char* expression)
+    {
+        FilterQuery query;
+        Parser parser = { &query, type, expression, 0, 0 };
+        
+        if (parser.parse_or())
+        {
+            parser.skip_space();
+            
+            if (*parser.m_cursor != '\0')
+                parser.fail("Unexpected input");
+        }
+        
+        if (!query.m_error.empty())
+        {
+            query.m_code.clear();
+            query.m_columns.clear();
+        }
+        
+        return query;
+    }
+    
+    template <typename T>
+    static FilterQuery compile(const char* expression)
+    {
+        return compile(TypeResolver::get<T>(), expression);
+    }
+    
+    bool valid() const
+    {
+        return !m_code.empty();
+    }
+    
+    // Objects stored as an array of structs, stride bytes apart.
+    void evaluate(const void* objects, size_t stride, size_t count, std::vector<uint64_t>& selection) const
+    {
+        const uint8_t* columns[FILTER_MAX_COLUMNS];
+        size_t strides[FILTER_MAX_COLUMNS];
+        
+        for (size_t i = 0; i < m_columns.size(); i++)
+        {
+            columns[i] = (const uint8_t*)objects + m_columns[i].m_offset;
+            strides[i] = stride;
+        }
+        
+        run(columns, strides, count, selection);
+    }
+    
+    // Objects stored as a struct of arrays: columns[i] is a dense array holding the member m_columns[i] of
+    // every object. Dense columns are compared in place instead of being gathered first.
+    void evaluate_columns(const void* const* columns, size_t count, std::vector<uint64_t>& selection) const
+    {
+        size_t strides[FILTER_MAX_COLUMNS];
+        
+        for (size_t i = 0; i < m_columns.size(); i++)
+            strides[i] = m_columns[i].m_type->m_size;
+        
+        run((const uint8_t* const*)columns, strides, count, selection);
+    }
+    
+private:
+    struct Parser
+    {
+        FilterQuery*    m_query;
+        TypeDescriptor* m_type;
+        const char*     m_cursor;
+        int             m_depth;     // Bitmaps on the evaluation stack after the code emitted so far.
+        int             m_max_depth;
+        
+        bool fail(const char* message)
+        {
+            if (m_query->m_error.empty())
+                m_query->m_error = std::string(message) + " at \"" + m_cursor + "\"";
+            
+            return false;
+        }
+        
+        void skip_space()
+        {
+            while (*m_cursor == ' ' || *m_cursor == '\t')
+                m_cursor++;
+        }
+        
+        bool accept(const char* token)
+        {
+            skip_space();
             
-            line_strip(&verts[0], 10, _c);
+            size_t length = strlen(token);
             
-            idx = 0;
+            if (strncmp(m_cursor, token, length) != 0)
+                return false;
             
-            for (int i = 0; i <= 180; i += 20)
-            {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = glm::vec3(_pos.x, _height - _radius + sin(degInRad)*_radius, _pos.z + cos(degInRad)*_radius);
-            }
+            m_cursor += length;
             
-            line_strip(&verts[0], 10, _c);
+            return true;
+        }
+        
+        void emit(FilterOp op)
+        {
+            FilterInstruction in;
+            memset(&in, 0, sizeof(in));
+            in.op = (uint8_t)op;
             
-            idx = 0;
+            m_query->m_code.push_back(in);
+            m_depth--;
+        }
+        
+        bool parse_or()
+        {
+            if (!parse_and())
+                return false;
             
-            for (int i = 180; i <= 360; i += 20)
+            while (accept("||"))
             {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = glm::vec3(_pos.x + cos(degInRad)*_radius, _radius + sin(degInRad)*_radius, _pos.z);
+                if (!parse_and())
+                    return false;
+                
+                emit(FILTER_OP_OR);
             }
             
-            line_strip(&verts[0], 10, _c);
+            return true;
+        }
+        
+        bool parse_and()
+        {
+            if (!parse_unary())
+                return false;
             
-            idx = 0;
+            while (accept("&&"))
+            {
+                if (!parse_unary())
+                    return false;
+                
+                emit(FILTER_OP_AND);
+            }
             
-            for (int i = 180; i <= 360; i += 20)
+            return true;
+        }
+        
+        bool parse_unary()
+        {
+            if (accept("!"))
             {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = glm::vec3(_pos.x, _radius + sin(degInRad)*_radius, _pos.z + cos(degInRad)*_radius);
+                if (!parse_unary())
+                    return false;
+                
+                emit(FILTER_OP_NOT);
+                m_depth++;
+                
+                return true;
             }
             
-            line_strip(&verts[0], 10, _c);
+            if (accept("("))
+            {
+                if (!parse_or())
+                    return false;
+                
+                return accept(")") ? true : fail("Expected )");
+            }
             
-            circle_xz(_radius, glm::vec3(_pos.x, _height - _radius, _pos.z), _c);
-            circle_xz(_radius, glm::vec3(_pos.x, _radius, _pos.z), _c);
+            return parse_compare();
         }
         
-        void aabb(const glm::vec3& _min, const glm::vec3& _max, const glm::vec3& _pos, const glm::vec3& _c)
+        std::string parse_word(bool allow_dots)
         {
-            glm::vec3 min = _pos + _min;
-            glm::vec3 max = _pos + _max;
+            skip_space();
             
-            line(min,                            glm::vec3(max.x, min.y, min.z), _c);
-            line(glm::vec3(max.x, min.y, min.z), glm::vec3(max.x, min.y, max.z), _c);
-            line(glm::vec3(max.x, min.y, max.z), glm::vec3(min.x, min.y, max.z), _c);
-            line(glm::vec3(min.x, min.y, max.z), min, _c);
+            const char* begin = m_cursor;
             
-            line(glm::vec3(min.x, max.y, min.z), glm::vec3(max.x, max.y, min.z), _c);
-            line(glm::vec3(max.x, max.y, min.z), max, _c);
-            line(max,                            glm::vec3(min.x, max.y, max.z), _c);
-            line(glm::vec3(min.x, max.y, max.z), glm::vec3(min.x, max.y, min.z), _c);
+            while (isalnum((unsigned char)*m_cursor) || *m_cursor == '_' || (allow_dots && *m_cursor == '.'))
+                m_cursor++;
             
-            line(min,                            glm::vec3(min.x, max.y, min.z), _c);
-            line(glm::vec3(max.x, min.y, min.z), glm::vec3(max.x, max.y, min.z), _c);
-            line(glm::vec3(max.x, min.y, max.z), max, _c);
-            line(glm::vec3(min.x, min.y, max.z), glm::vec3(min.x, max.y, max.z), _c);
+            return std::string(begin, m_cursor);
         }
         
-        void obb(const glm::vec3& _min, const glm::vec3& _max, const glm::mat4& _model, const glm::vec3& _c)
+        bool parse_compare()
         {
-            glm::vec3 verts[8];
-            glm::vec3 size = _max - _min;
-            int idx = 0;
+            const char* path_begin = m_cursor;
+            std::string path = parse_word(true);
             
-            for (float x = _min.x; x <= _max.x; x += size.x)
+            if (path.empty())
+                return fail("Expected a member path");
+            
+            PropertyAccessor accessor = PropertyAccessor::compile(m_type, path.c_str());
+            
+            if (!accessor.valid())
             {
-                for (float y = _min.y; y <= _max.y; y += size.y)
-                {
-                    for (float z = _min.z; z <= _max.z; z += size.z)
-                    {
-                        glm::vec4 v = _model * glm::vec4(x, y, z, 1.0f);
-                        verts[idx++] = glm::vec3(v.x, v.y, v.z);
-                    }
-                }
+                m_cursor = path_begin;
+                return fail("Unknown member");
             }
             
-            line(verts[0], verts[1], _c);
-            line(verts[1], verts[5], _c);
-            line(verts[5], verts[4], _c);
-            line(verts[4], verts[0], _c);
-            
-            line(verts[2], verts[3], _c);
-            line(verts[3], verts[7], _c);
-            line(verts[7], verts[6], _c);
-            line(verts[6], verts[2], _c);
+            FilterInstruction in;
+            memset(&in, 0, sizeof(in));
+            in.op = FILTER_OP_COMPARE;
             
-            line(verts[2], verts[0], _c);
-            line(verts[6], verts[4], _c);
-            line(verts[3], verts[1], _c);
-            line(verts[7], verts[5], _c);
-        }
-        
-        void grid(const float& _x, const float& _z, const float& _y_level, const float& spacing, const glm::vec3& _c)
-        {
-            int offset_x = floor((_x * spacing)/2.0f);
-            int offset_z = floor((_z * spacing )/2.0f);
+            TypeDescriptor_Enum* enum_type = accessor.m_type->as_enum();
             
-            for (int x = -offset_x; x <= offset_x; x += spacing)
+            if (accessor.m_type == TypeResolver::get<float>())
+                in.type = FILTER_TYPE_FLOAT;
+            else if (accessor.m_type == TypeResolver::get<int>() || (enum_type && accessor.m_type->m_size == sizeof(int32_t)))
+                in.type = FILTER_TYPE_INT;
+            else if (accessor.m_type == TypeResolver::get<bool>())
+                in.type = FILTER_TYPE_BOOL;
+            else
             {
-                line(glm::vec3(x, _y_level, -offset_z), glm::vec3(x, _y_level, offset_z), _c);
+                m_cursor = path_begin;
+                return fail("Member type cannot be filtered");
             }
             
-            for (int z = -offset_z; z <= offset_z; z += spacing)
+            // Two character operators first, so "<=" is not read as "<".
+            static const char* operators[] = { "<=", ">=", "==", "!=", "<", ">" };
+            static const FilterCompare compares[] = { FILTER_COMPARE_LE, FILTER_COMPARE_GE, FILTER_COMPARE_EQ, FILTER_COMPARE_NE, FILTER_COMPARE_LT, FILTER_COMPARE_GT };
+            int op = -1;
+            
+            for (int i = 0; i < 6 && op < 0; i++)
             {
-                line(glm::vec3(-offset_x, _y_level, z), glm::vec3(offset_x, _y_level, z), _c);
+                if (accept(operators[i]))
+                    op = i;
             }
-        }
-        
-        void line(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& c)
-        {
-            VertexWorld vw0, vw1;
-            vw0.position = v0;
-            vw0.color = c;
             
-            vw1.position = v1;
-            vw1.color = c;
+            if (op < 0)
+            {
+                if (in.type != FILTER_TYPE_BOOL)
+                    return fail("Expected a comparison");
+                
+                in.compare = FILTER_COMPARE_EQ;
+                in.value.i = 1;
+            }
+            else
+            {
+                in.compare = (uint8_t)compares[op];
+                
+                if (!parse_literal(in, enum_type))
+                    return false;
+            }
             
-            m_world_vertices.push_back(vw0);
-            m_world_vertices.push_back(vw1);
+            if (!add_column(accessor, in))
+                return false;
             
-            DrawCommand cmd;
-            cmd.type = PrimitiveType::LINES;
-            cmd.vertices = 2;
+            m_query->m_code.push_back(in);
+            m_max_depth = glm::max(m_max_depth, ++m_depth);
             
-            m_draw_commands.push_back(cmd);
+            return m_depth <= FILTER_MAX_STACK ? true : fail("Expression is nested too deeply");
         }
         
-        void line_strip(glm::vec3* v, const int& count, const glm::vec3& c)
+        bool parse_literal(FilterInstruction& in, TypeDescriptor_Enum* enum_type)
         {
-            for (int i = 0; i < count; i++)
+            skip_space();
+            
+            if (in.type == FILTER_TYPE_BOOL)
             {
-                VertexWorld vert;
-                vert.position = v[i];
-                vert.color = c;
+                if (in.compare != FILTER_COMPARE_EQ && in.compare != FILTER_COMPARE_NE)
+                    return fail("Bools can only be compared with == or !=");
                 
-                m_world_vertices.push_back(vert);
+                if (accept("true"))
+                    in.value.i = 1;
+                else if (accept("false"))
+                    in.value.i = 0;
+                else
+                    return fail("Expected true or false");
+                
+                return true;
             }
             
-            DrawCommand cmd;
-            cmd.type = PrimitiveType::LINE_STRIP;
-            cmd.vertices = count;
+            if (enum_type && (isalpha((unsigned char)*m_cursor) || *m_cursor == '_'))
+            {
+                const char* name_begin = m_cursor;
+                std::string name = parse_word(false);
+                
+                for (int i = 0; i < enum_type->m_num_constants; i++)
+                {
+                    if (name == enum_type->m_constants[i].m_name)
+                    {
+                        in.value.i = enum_type->m_constants[i].m_value;
+                        return true;
+                    }
+                }
+                
+                m_cursor = name_begin;
+                return fail("Unknown enum constant");
+            }
             
-            m_draw_commands.push_back(cmd);
-        }
-        
-        void circle_xy(float radius, const glm::vec3& pos, const glm::vec3& c)
-        {
-            glm::vec3 verts[19];
+            char* end;
+            double value = strtod(m_cursor, &end);
             
-            int idx = 0;
+            if (end == m_cursor)
+                return fail("Expected a number");
             
-            for (int i=0; i <= 360; i+= 20)
+            // Out of range conversions are undefined, so reject them before casting.
+            if (in.type == FILTER_TYPE_FLOAT)
             {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = pos + glm::vec3(cos(degInRad)*radius,sin(degInRad)*radius, 0.0f);
+                if (fabs(value) > FLT_MAX)
+                    return fail("Number out of range");
+                
+                in.value.f = (float)value;
             }
+            else if (value != floor(value))
+                return fail("Expected an integer");
+            else if (value < (double)INT32_MIN || value > (double)INT32_MAX)
+                return fail("Integer out of range");
+            else
+                in.value.i = (int32_t)value;
             
-            line_strip(&verts[0], 19, c);
+            m_cursor = end;
+            
+            return true;
         }
         
-        void circle_xz(float radius, const glm::vec3& pos, const glm::vec3& c)
+        bool add_column(const PropertyAccessor& accessor, FilterInstruction& in)
         {
-            glm::vec3 verts[19];
-            
-            int idx = 0;
+            std::vector<PropertyAccessor>& columns = m_query->m_columns;
             
-            for (int i=0; i <= 360; i+= 20)
+            for (size_t i = 0; i < columns.size(); i++)
             {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = pos + glm::vec3(cos(degInRad)*radius, 0.0f, sin(degInRad)*radius);
+                if (columns[i].m_offset == accessor.m_offset && columns[i].m_type == accessor.m_type)
+                {
+                    in.column = (uint8_t)i;
+                    return true;
+                }
             }
             
-            line_strip(&verts[0], 19, c);
+            if (columns.size() == FILTER_MAX_COLUMNS)
+                return fail("Too many members");
+            
+            in.column = (uint8_t)columns.size();
+            columns.push_back(accessor);
+            
+            return true;
         }
+    };
+    
+    void run(const uint8_t* const* columns, const size_t* strides, size_t count, std::vector<uint64_t>& selection) const
+    {
+        selection.assign((count + 63) / 64, 0);
         
-        void circle_yz(float radius, const glm::vec3& pos, const glm::vec3& c)
+        if (!valid())
+            return;
+        
+        uint64_t stack[FILTER_MAX_STACK][FILTER_BLOCK_WORDS];
+        uint32_t gathered[FILTER_BLOCK_SIZE];
+        
+        for (size_t first = 0; first < count; first += FILTER_BLOCK_SIZE)
         {
-            glm::vec3 verts[19];
-            
-            int idx = 0;
+            size_t n = glm::min((size_t)FILTER_BLOCK_SIZE, count - first);
+            size_t words = (n + 63) / 64;
+            int top = 0;
             
-            for (int i=0; i <= 360; i+= 20)
+            for (size_t pc = 0; pc < m_code.size(); pc++)
             {
-                float degInRad = glm::radians((float)i);
-                verts[idx++] = pos + glm::vec3(0.0f, cos(degInRad)*radius, sin(degInRad)*radius);
+                const FilterInstruction& in = m_code[pc];
+                
+                switch (in.op)
+                {
+                    case FILTER_OP_COMPARE:
+                    {
+                        size_t stride = strides[in.column];
+                        size_t size = m_columns[in.column].m_type->m_size;
+                        const uint8_t* ptr = columns[in.column] + first * stride;
+                        
+                        // Strided members are copied into a dense block, so the kernels only ever see packed values.
+                        if (stride != size)
+                        {
+                            gather(ptr, stride, size, n, (uint8_t*)gathered);
+                            ptr = (const uint8_t*)gathered;
+                        }
+                        
+                        compare(in, ptr, n, stack[top++]);
+                        break;
+                    }
+                    case FILTER_OP_AND:
+                    {
+                        top--;
+                        
+                        for (size_t w = 0; w < words; w++)
+                            stack[top - 1][w] &= stack[top][w];
+                        
+                        break;
+                    }
+                    case FILTER_OP_OR:
+                    {
+                        top--;
+                        
+                        for (size_t w = 0; w < words; w++)
+                            stack[top - 1][w] |= stack[top][w];
+                        
+                        break;
+                    }
+                    case FILTER_OP_NOT:
+                    {
+                        for (size_t w = 0; w < words; w++)
+                            stack[top - 1][w] = ~stack[top - 1][w];
+                        
+                        // Bits past the last object must stay clear.
+                        if (n & 63)
+                            stack[top - 1][words - 1] &= (1ull << (n & 63)) - 1;
+                        
+                        break;
+                    }
+                }
             }
             
-            line_strip(&verts[0], 19, c);
+            memcpy(&selection[first / 64], stack[0], words * sizeof(uint64_t));
         }
-        
-        void sphere(const float& radius, const glm::vec3& pos, const glm::vec3& c)
+    }
+    
+    // Members are 4 byte floats, ints and enums or 1 byte bools.
+    static void gather(const uint8_t* src, size_t stride, size_t size, size_t count, uint8_t* dst)
+    {
+        if (size == sizeof(uint32_t))
         {
-            circle_xy(radius, pos, c);
-            circle_xz(radius, pos, c);
-            circle_yz(radius, pos, c);
+            for (size_t i = 0; i < count; i++)
+                memcpy(dst + i * sizeof(uint32_t), src + i * stride, sizeof(uint32_t));
         }
-        
-        void frustum(const glm::mat4& proj, const glm::mat4& view, const glm::vec3& c)
+        else
         {
-            glm::mat4 inverse = glm::inverse(proj * view);
-            glm::vec3 corners[8];
-            
-            for (int i = 0; i < 8; i++)
+            for (size_t i = 0; i < count; i++)
+                dst[i] = src[i * stride];
+        }
+    }
+    
+    static void compare(const FilterInstruction& in, const uint8_t* ptr, size_t count, uint64_t* bits)
+    {
+        memset(bits, 0, FILTER_BLOCK_WORDS * sizeof(uint64_t));
+        
+        if (in.type == FILTER_TYPE_FLOAT)
+        {
+            switch (in.compare)
             {
-                glm::vec4 v = inverse * kFrustumCorners[i];
-                v = v/v.w;
-                corners[i] = glm::vec3(v.x, v.y, v.z);
+                case FILTER_COMPARE_LT: compare_floats<CompareLt>(ptr, count, in.value.f, bits); break;
+                case FILTER_COMPARE_LE: compare_floats<CompareLe>(ptr, count, in.value.f, bits); break;
+                case FILTER_COMPARE_GT: compare_floats<CompareGt>(ptr, count, in.value.f, bits); break;
+                case FILTER_COMPARE_GE: compare_floats<CompareGe>(ptr, count, in.value.f, bits); break;
+                case FILTER_COMPARE_EQ: compare_floats<CompareEq>(ptr, count, in.value.f, bits); break;
+                case FILTER_COMPARE_NE: compare_floats<CompareNe>(ptr, count, in.value.f, bits); break;
             }
-            
-            glm::vec3 far[5] = {
-                corners[0],
-                corners[1],
-                corners[2],
-                corners[3],
-                corners[0]
-            };
-            
-            line_strip(&far[0], 5, c);
-            
-            glm::vec3 near[5] = {
-                corners[4],
-                corners[5],
-                corners[6],
-                corners[7],
-                corners[4]
-            };
-            
-            line_strip(&near[0], 5, c);
-            
-            line(corners[0], corners[4], c);
-            line(corners[1], corners[5], c);
-            line(corners[2], corners[6], c);
-            line(corners[3], corners[7], c);
         }
-        
-        void render(Framebuffer* fbo, int width, int height, const glm::mat4& view_proj)
+        else if (in.type == FILTER_TYPE_INT)
         {
-            m_uniforms.view_proj = view_proj;
-            
-            void* ptr = m_device->map_buffer(m_line_vbo, BufferMapType::WRITE);
-            
-            if (m_world_vertices.size() > MAX_VERTICES)
-                std::cout << "Vertices are above limit" << std::endl;
-            else
-                memcpy(ptr, &m_world_vertices[0], sizeof(VertexWorld) * m_world_vertices.size());
-            
-            m_device->unmap_buffer(m_line_vbo);
-            
-            ptr = m_device->map_buffer(m_ubo, BufferMapType::WRITE);
-            memcpy(ptr, &m_uniforms, sizeof(CameraUniforms));
-            m_device->unmap_buffer(m_ubo);
-            
-            m_device->bind_rasterizer_state(m_rs);
-            m_device->bind_depth_stencil_state(m_ds);
-            m_device->bind_framebuffer(fbo);
-            m_device->set_viewport(width, height, 0, 0);
-            m_device->bind_shader_program(m_line_program);
-            m_device->bind_uniform_buffer(m_ubo, ShaderType::VERTEX, 0);
-            m_device->bind_vertex_array(m_line_vao);
-            
-            int v = 0;
-            
-            for (int i = 0; i < m_draw_commands.size(); i++)
+            // Integer compares are exact, so the inclusive ones are the negated strict ones.
+            switch (in.compare)
             {
-                DrawCommand& cmd = m_draw_commands[i];
-                m_device->set_primitive_type(cmd.type);
-                m_device->draw(v, cmd.vertices);
-                v += cmd.vertices;
+                case FILTER_COMPARE_LT: compare_ints<CompareLt>(ptr, count, in.value.i, false, bits); break;
+                case FILTER_COMPARE_LE: compare_ints<CompareGt>(ptr, count, in.value.i, true, bits); break;
+                case FILTER_COMPARE_GT: compare_ints<CompareGt>(ptr, count, in.value.i, false, bits); break;
+                case FILTER_COMPARE_GE: compare_ints<CompareLt>(ptr, count, in.value.i, true, bits); break;
+                case FILTER_COMPARE_EQ: compare_ints<CompareEq>(ptr, count, in.value.i, false, bits); break;
+                case FILTER_COMPARE_NE: compare_ints<CompareEq>(ptr, count, in.value.i, true, bits); break;
             }
-            
-            m_draw_commands.clear();
-            m_world_vertices.clear();
         }
+        else
+            compare_bools(ptr, count, (in.value.i != 0) == (in.compare == FILTER_COMPARE_EQ), bits);
+    }
+    
+#if defined(DW_SIMD_SSE2)
+    struct CompareLt
+    {
+        static __m128 simd(__m128 a, __m128 b) { return _mm_cmplt_ps(a, b); }
+        static __m128i simd(__m128i a, __m128i b) { return _mm_cmplt_epi32(a, b); }
+        template <typename T> static bool scalar(T a, T b) { return a < b; }
+    };
+    
+    struct CompareLe
+    {
+        static __m128 simd(__m128 a, __m128 b) { return _mm_cmple_ps(a, b); }
+        template <typename T> static bool scalar(T a, T b) { return a <= b; }
+    };
+    
+    struct CompareGt
+    {
+        static __m128 simd(__m128 a, __m128 b) { return _mm_cmpgt_ps(a, b); }
+        static __m128i simd(__m128i a, __m128i b) { return _mm_cmpgt_epi32(a, b); }
+        template <typename T> static bool scalar(T a, T b) { return a > b; }
+    };
+    
+    struct CompareGe
+    {
+        static __m128 simd(__m128 a, __m128 b) { return _mm_cmpge_ps(a, b); }
+        template <typename T> static bool scalar(T a, T b) { return a >= b; }
+    };
+    
+    struct CompareEq
+    {
+        static __m128 simd(__m128 a, __m128 b) { return _mm_cmpeq_ps(a, b); }
+        static __m128i simd(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+        template <typename T> static bool scalar(T a, T b) { return a == b; }
+    };
+    
+    struct CompareNe
+    {
+        static __m128 simd(__m128 a, __m128 b) { return _mm_cmpneq_ps(a, b); }
+        template <typename T> static bool scalar(T a, T b) { return a != b; }
     };
+#else
+    struct CompareLt { template <typename T> static bool scalar(T a, T b) { return a < b; } };
+    struct CompareLe { template <typename T> static bool scalar(T a, T b) { return a <= b; } };
+    struct CompareGt { template <typename T> static bool scalar(T a, T b) { return a > b; } };
+    struct CompareGe { template <typename T> static bool scalar(T a, T b) { return a >= b; } };
+    struct CompareEq { template <typename T> static bool scalar(T a, T b) { return a == b; } };
+    struct CompareNe { template <typename T> static bool scalar(T a, T b) { return a != b; } };
+#endif
+    
+    // Groups of four never straddle a bitmap word, since 64 is a multiple of four.
+    template <typename Compare>
+    static void compare_floats(const uint8_t* ptr, size_t count, float value, uint64_t* bits)
+    {
+        const float* values = (const float*)ptr;
+        size_t i = 0;
+        
+#if defined(DW_SIMD_SSE2)
+        __m128 v = _mm_set1_ps(value);
+        
+        for (; i + 4 <= count; i += 4)
+            bits[i >> 6] |= (uint64_t)_mm_movemask_ps(Compare::simd(_mm_loadu_ps(values + i), v)) << (i & 63);
+#endif
+        
+        for (; i < count; i++)
+        {
+            if (Compare::scalar(values[i], value))
+                bits[i >> 6] |= 1ull << (i & 63);
+        }
+    }
+    
+    template <typename Compare>
+    static void compare_ints(const uint8_t* ptr, size_t count, int32_t value, bool negate, uint64_t* bits)
+    {
+        const int32_t* values = (const int32_t*)ptr;
+        size_t i = 0;
+        
+#if defined(DW_SIMD_SSE2)
+        __m128i v = _mm_set1_epi32(value);
+        int flip = negate ? 0xF : 0;
+        
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(values + i));
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(Compare::simd(x, v))) ^ flip;
+            
+            bits[i >> 6] |= (uint64_t)mask << (i & 63);
+        }
+#endif
+        
+        for (; i < count; i++)
+        {
+            if (Compare::scalar(values[i], value) != negate)
+                bits[i >> 6] |= 1ull << (i & 63);
+        }
+    }
+    
+    // Bools are compared sixteen at a time, which also never straddles a word.
+    static void compare_bools(const uint8_t* ptr, size_t count, bool value, uint64_t* bits)
+    {
+        size_t i = 0;
+        
+#if defined(DW_SIMD_SSE2)
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(ptr + i));
+            int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128()));
+            int mask = value ? ~zero & 0xFFFF : zero;
+            
+            bits[i >> 6] |= (uint64_t)mask << (i & 63);
+        }
+#endif
+        
+        for (; i < count; i++)
+        {
+            if ((ptr[i] != 0) == value)
+                bits[i >> 6] |= 1ull << (i & 63);
+        }
+    }
+};
+
+// std140 base alignment and size of the types allowed in uniform blocks. Types without a specialization
+// fail to compile when used through REFLECT_UNIFORM.
+template <typename T>
+struct Std140;
+
+template <> struct Std140<float>     { static const size_t alignment = 4;  static const size_t size = 4;  };
+template <> struct Std140<int32_t>   { static const size_t alignment = 4;  static const size_t size = 4;  };
+template <> struct Std140<uint32_t>  { static const size_t alignment = 4;  static const size_t size = 4;  };
+template <> struct Std140<glm::vec2> { static const size_t alignment = 8;  static const size_t size = 8;  };
+template <> struct Std140<glm::vec3> { static const size_t alignment = 16; static const size_t size = 12; };
+template <> struct Std140<glm::vec4> { static const size_t alignment = 16; static const size_t size = 16; };
+template <> struct Std140<glm::mat4> { static const size_t alignment = 16; static const size_t size = 64; };
+
+struct Std140Member
+{
+    const char*     m_name;
+    size_t          m_offset;
+    size_t          m_alignment;
+    size_t          m_size;
+    TypeDescriptor* (*m_type)();
+};
+
+constexpr size_t std140_align(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
 }
 
-struct TerrainVertex
+// True if every member sits exactly where std140 places it after the previous one and the struct is
+// padded to a multiple of 16 bytes, as uniform blocks are.
+constexpr bool std140_valid(const Std140Member* members, size_t count, size_t size, size_t i = 0, size_t end = 0)
 {
-    glm::vec2 pos;
+    return i == count ? size == std140_align(end, 16)
+                      : members[i].m_offset == std140_align(end, members[i].m_alignment) &&
+                        std140_valid(members, count, size, i + 1, members[i].m_offset + members[i].m_size);
+}
+
+// Uniform structs are reflected like any other struct but each member also carries its std140 layout,
+// which is checked against the C++ layout when the reflection is compiled.
+#define BEGIN_DECLARE_UNIFORMS(TYPE) TypeDescriptor_Struct TYPE::Reflection{ #TYPE, sizeof(TYPE), TYPE::init_reflection }; \
+                                     void TYPE::init_reflection()                                                          \
+                                     {                                                                                     \
+                                         using T = TYPE;                                                                   \
+                                         static constexpr Std140Member layout[] = {
+
+#define REFLECT_UNIFORM(MEMBER) { #MEMBER, offsetof(T, MEMBER), Std140<decltype(T::MEMBER)>::alignment, Std140<decltype(T::MEMBER)>::size, &TypeResolver::get<decltype(T::MEMBER)> },
+
+#define END_DECLARE_UNIFORMS()  };                                                                                                  \
+                                static_assert(std140_valid(layout, sizeof(layout)/sizeof(Std140Member), sizeof(T)), "Uniform struct does not match std140"); \
+                                static std::vector<TypeDescriptor_Struct::Member> members;                                          \
+                                for (int i = 0; i < sizeof(layout)/sizeof(Std140Member); i++)                                      \
+                                    members.push_back(TypeDescriptor_Struct::Member(layout[i].m_name, layout[i].m_offset, layout[i].m_type())); \
+                                Reflection.init(&members[0], (int)members.size());                                                 \
+                            }
+
+// The device interface does not promise that a WRITE map keeps the bytes that are not written, since a
+// backend may map with invalidate. Devices that do keep them declare kPreservesMappedContents = true.
+template <typename Device, typename = void>
+struct PreservesMappedContents : std::false_type {};
+
+template <typename Device>
+struct PreservesMappedContents<Device, typename std::enable_if<Device::kPreservesMappedContents>::type> : std::true_type {};
+
+// Keeps a shadow copy of a reflected uniform struct and skips the map entirely when no member changed
+// since the last upload. Otherwise it writes only the span of changed members on devices that preserve
+// mapped contents, and the whole block everywhere else.
+template <typename T>
+struct UniformUploader
+{
+    T      m_shadow;
+    size_t m_dirty_begin = 0;
+    size_t m_dirty_end = sizeof(T);
+    size_t m_bytes_uploaded = 0;
+    int    m_num_uploads = 0;
+    int    m_num_skipped = 0;
+    
+    UniformUploader()
+    {
+        memset((void*)&m_shadow, 0, sizeof(T));
+    }
+    
+    // Compares every reflected member against the shadow copy.
+    void set(const T& value)
+    {
+        const TypeDescriptor_Struct& desc = T::Reflection;
+        
+        for (int i = 0; i < desc.m_num_members; i++)
+        {
+            const TypeDescriptor_Struct::Member& member = desc.m_members[i];
+            
+            write(member.m_offset, (const char*)&value + member.m_offset, member.m_type->m_size);
+        }
+    }
+    
+    template <typename M>
+    void set(M T::*member, const M& value)
+    {
+        write((const char*)&(m_shadow.*member) - (const char*)&m_shadow, &value, sizeof(M));
+    }
+    
+    void write(size_t offset, const void* data, size_t size)
+    {
+        char* dst = (char*)&m_shadow + offset;
+        
+        if (memcmp(dst, data, size) == 0)
+            return;
+        
+        memcpy(dst, data, size);
+        m_dirty_begin = glm::min(m_dirty_begin, offset);
+        m_dirty_end = glm::max(m_dirty_end, offset + size);
+    }
+    
+    bool dirty() const
+    {
+        return m_dirty_begin < m_dirty_end;
+    }
+    
+    template <typename Device>
+    void upload(Device* device, UniformBuffer* ubo)
+    {
+        if (!dirty())
+        {
+            m_num_skipped++;
+            return;
+        }
+        
+        size_t begin = PreservesMappedContents<Device>::value ? m_dirty_begin : 0;
+        size_t end = PreservesMappedContents<Device>::value ? m_dirty_end : sizeof(T);
+        
+        char* ptr = (char*)device->map_buffer(ubo, BufferMapType::WRITE);
+        memcpy(ptr + begin, (const char*)&m_shadow + begin, end - begin);
+        device->unmap_buffer(ubo);
+        
+        m_bytes_uploaded += end - begin;
+        m_num_uploads++;
+        m_dirty_begin = sizeof(T);
+        m_dirty_end = 0;
+    }
 };
 
-struct DW_ALIGNED(16) TerrainUniforms
+#define PROFILER_MAX_THREADS 16
+#define PROFILER_RING_SIZE 4096
+
+// One completed scope. Names must be string literals or otherwise outlive the profiler.
+struct ProfileEvent
 {
-    glm::mat4 view_proj;
-    glm::vec4 rect;
-    glm::vec4 scale;
+    const char* name;
+    uint64_t    start; // Nanoseconds since the profiler was created.
+    uint64_t    end;
+    uint32_t    depth;
 };
 
-struct Terrain
+// Ring slot of a ProfileEvent. The owning thread may overwrite a slot while a reader copies it, so the
+// fields are atomics accessed with relaxed ordering and torn copies are detected through head instead.
+struct ProfileSlot
 {
-    VertexArray* m_vao;
-    IndexBuffer* m_ibo;
-    VertexBuffer* m_vbo;
-    InputLayout* m_il;
-    Shader* m_vs;
-    Shader* m_fs;
-    ShaderProgram* m_program;
-    UniformBuffer* m_ubo;
-    RenderDevice* m_device;
-    RasterizerState* m_rs;
-    DepthStencilState* m_ds;
-    TerrainVertex* m_vertices;
-    TerrainUniforms m_uniforms;
-    std::vector<uint32_t> m_indices;
-    Texture2D* m_height_map;
-	SamplerState* m_sampler;
+    std::atomic<const char*> name;
+    std::atomic<uint64_t>    start;
+    std::atomic<uint64_t>    end;
+    std::atomic<uint32_t>    depth;
+};
 
-    Terrain(float x, float z, float distance, RenderDevice* device)
+// Events of one thread. Only the owning thread writes and it publishes each event by bumping head, so
+// recording never locks. Readers copy the newest events and drop those the writer may have reused
+// while they were copying.
+struct ProfileRing
+{
+    ProfileSlot           events[PROFILER_RING_SIZE];
+    std::atomic<uint64_t> head;
+    uint32_t              thread;
+    uint32_t              depth;
+};
+
+class Profiler
+{
+public:
+    static Profiler& get()
     {
-        m_device = device;
+        static Profiler profiler;
+        return profiler;
+    }
+    
+    uint64_t now() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+    }
+    
+    // Ring of the calling thread, or null when every ring is taken and the thread is not recorded.
+    ProfileRing* ring()
+    {
+        static thread_local int t_index = -1;
         
-        float x_half = x/2.0f * distance;
-        float z_half = z/2.0f * distance;
+        if (t_index == -1)
+        {
+            t_index = m_num_threads.fetch_add(1);
+            
+            if (t_index < PROFILER_MAX_THREADS)
+                m_rings[t_index].thread = t_index;
+        }
+        
+        return t_index < PROFILER_MAX_THREADS ? &m_rings[t_index] : nullptr;
+    }
+    
+    void record(ProfileRing* ring, const char* name, uint64_t start, uint64_t end, uint32_t depth)
+    {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        ProfileSlot& slot = ring->events[head & (PROFILER_RING_SIZE - 1)];
+        
+        // Pairs with the fence in copy_events(): a reader whose relaxed loads see any of the stores below
+        // also sees this head, and so drops the slot as reused.
+        std::atomic_thread_fence(std::memory_order_release);
+        
+        slot.name.store(name, std::memory_order_relaxed);
+        slot.start.store(start, std::memory_order_relaxed);
+        slot.end.store(end, std::memory_order_relaxed);
+        slot.depth.store(depth, std::memory_order_relaxed);
+        
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+    
+    int num_threads() const
+    {
+        return glm::min(m_num_threads.load(), PROFILER_MAX_THREADS);
+    }
+    
+    // Copies the events still held for a thread, oldest first.
+    void copy_events(int thread, std::vector<ProfileEvent>& events) const
+    {
+        const ProfileRing& ring = m_rings[thread];
+        uint64_t head = ring.head.load(std::memory_order_acquire);
+        uint64_t first = head > PROFILER_RING_SIZE ? head - PROFILER_RING_SIZE : 0;
         
-        int idx = 0;
-        m_vertices = new TerrainVertex[(x + 1) * (z + 1)];
+        events.resize(head - first);
         
-        for (int z = -z_half; z <= z_half; z += distance)
+        for (uint64_t i = first; i < head; i++)
         {
-            for (int x = -x_half; x <= x_half; x += distance)
-            {
-                m_vertices[idx].pos = glm::vec2(x, z);
-                idx++;
-            }
+            const ProfileSlot& slot = ring.events[i & (PROFILER_RING_SIZE - 1)];
+            ProfileEvent& event = events[i - first];
+            
+            event.name = slot.name.load(std::memory_order_relaxed);
+            event.start = slot.start.load(std::memory_order_relaxed);
+            event.end = slot.end.load(std::memory_order_relaxed);
+            event.depth = slot.depth.load(std::memory_order_relaxed);
         }
         
-        // 0 1 2
-        // 3 4 5
-        // 6 7 8
+        // Keeps the loads above from being ordered after the head load below, as in a seqlock read.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        
+        // The slot of event i is reused by event i + PROFILER_RING_SIZE, and the writer may be filling the
+        // slot of the event after the last one it published.
+        uint64_t last = ring.head.load(std::memory_order_relaxed);
+        uint64_t reused = last + 1 > first + PROFILER_RING_SIZE ? last + 1 - first - PROFILER_RING_SIZE : 0;
+        
+        events.erase(events.begin(), events.begin() + glm::min(reused, (uint64_t)events.size()));
+    }
+    
+    // Writes every recorded scope in the Chrome trace event format, viewable in chrome://tracing or Perfetto.
+    bool export_chrome_trace(const char* path) const
+    {
+        FILE* filePtr = fopen(path, "w");
+        
+        if (!filePtr)
+            return false;
+        
+        std::vector<ProfileEvent> events;
+        bool first = true;
         
-        for (int i = 0; i < z; i++)
+        fprintf(filePtr, "{\"traceEvents\":[\n");
+        
+        for (int thread = 0; thread < num_threads(); thread++)
         {
-            for (int j = 0; j < x; j++)
+            copy_events(thread, events);
+            
+            for (int i = 0; i < events.size(); i++)
             {
-                m_indices.push_back((x + 1) * i + j);
-                m_indices.push_back((x + 1) * (i + 1) + j);
-                m_indices.push_back((x + 1) * i + (j + 1));
-                
-                m_indices.push_back((x + 1) * i + j + 1);
-                m_indices.push_back((x + 1) * (i + 1) + j);
-                m_indices.push_back((x + 1) * (i + 1) + (j + 1));
+                fprintf(filePtr, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}", first ? "" : ",\n",
+                        events[i].name, events[i].start / 1000.0, (events[i].end - events[i].start) / 1000.0, thread);
+                first = false;
             }
         }
         
-        std::string vs_str;
-        Utility::ReadText("shader/terrain_vs.glsl", vs_str);
+        fprintf(filePtr, "\n]}\n");
         
-        std::string fs_str;
-        Utility::ReadText("shader/terrain_fs.glsl", fs_str);
+        return fclose(filePtr) == 0;
+    }
+    
+    // Shows the calling thread's newest finished top level scope with everything nested in it, and a
+    // button that exports the trace.
+    void gui(const char* trace_path)
+    {
+        ImGui::Begin("Profiler");
         
-        m_vs = m_device->create_shader(vs_str.c_str(), ShaderType::VERTEX);
-        m_fs = m_device->create_shader(fs_str.c_str(), ShaderType::FRAGMENT);
+        ProfileRing* current = ring();
         
-        if (!m_vs || !m_fs)
+        if (current)
+            copy_events(current->thread, m_events);
+        else
+            m_events.clear();
+        
+        int top = (int)m_events.size() - 1;
+        
+        while (top >= 0 && m_events[top].depth != 0)
+            top--;
+        
+        if (top >= 0)
         {
-            LOG_FATAL("Failed to create Shaders");
-            return;
+            const ProfileEvent& frame = m_events[top];
+            m_frame.clear();
+            
+            for (int i = 0; i <= top; i++)
+            {
+                if (m_events[i].start >= frame.start && m_events[i].end <= frame.end)
+                    m_frame.push_back(m_events[i]);
+            }
+            
+            // Events are recorded as scopes close, so parents come after their children until sorted.
+            std::sort(m_frame.begin(), m_frame.end(), [](const ProfileEvent& a, const ProfileEvent& b) {
+                return a.start < b.start || (a.start == b.start && a.depth < b.depth);
+            });
+            
+            for (int i = 0; i < m_frame.size(); i++)
+                ImGui::Text("%*s%s: %.3f ms", 2 * m_frame[i].depth, "", m_frame[i].name, (m_frame[i].end - m_frame[i].start) / 1000000.0);
+        }
+        
+        ImGui::Separator();
+        ImGui::Text("Threads: %d", num_threads());
+        
+        if (ImGui::Button("Export Chrome Trace"))
+        {
+            if (!export_chrome_trace(trace_path))
+                LOG_ERROR("Failed to write trace");
+        }
+        
+        ImGui::End();
+    }
+    
+private:
+    Profiler() : m_epoch(std::chrono::steady_clock::now()), m_num_threads(0)
+    {
+    }
+    
+    std::chrono::steady_clock::time_point m_epoch;
+    std::atomic<int> m_num_threads;
+    ProfileRing m_rings[PROFILER_MAX_THREADS];
+    std::vector<ProfileEvent> m_events;
+    std::vector<ProfileEvent> m_frame;
+};
+
+// Records the time between construction and destruction on the calling thread's ring.
+class ProfileScope
+{
+public:
+    ProfileScope(const char* name) : m_name(name), m_ring(Profiler::get().ring())
+    {
+        if (m_ring)
+        {
+            m_ring->depth++;
+            m_start = Profiler::get().now();
+        }
+    }
+    
+    ~ProfileScope()
+    {
+        if (m_ring)
+        {
+            m_ring->depth--;
+            Profiler::get().record(m_ring, m_name, m_start, Profiler::get().now(), m_ring->depth);
+        }
+    }
+    
+private:
+    const char* m_name;
+    ProfileRing* m_ring;
+    uint64_t m_start;
+};
+
+#define DW_PROFILE_CONCAT_IMPL(a, b) a##b
+#define DW_PROFILE_CONCAT(a, b) DW_PROFILE_CONCAT_IMPL(a, b)
+
+#if defined(DW_DISABLE_PROFILER)
+#define DW_PROFILE_SCOPE(name)
+#else
+#define DW_PROFILE_SCOPE(name) ProfileScope DW_PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#endif
+
+// RenderDevice stand-in that needs no graphics API. Buffer and texture contents are kept in memory and
+// every draw call is recorded, so the rendering code can be run and benchmarked on machines without a
+// GPU. Handles returned to the caller point at Resource records and must only be passed back in.
+class RecordingRenderDevice
+{
+public:
+    // Maps return the resource's own storage.
+    static const bool kPreservesMappedContents = true;
+    
+    struct Resource
+    {
+        std::vector<char> data;
+        int width = 0;  // Textures only.
+        int height = 0;
+        size_t texel_size = 0;
+    };
+    
+    // Besides the range, a draw remembers the states bound when it was issued.
+    struct DrawCall
+    {
+        int                primitive;
+        int                first;
+        int                count;
+        bool               indexed;
+        DepthStencilState* depth_stencil_state;
+        BlendState*        blend_state;
+        UniformBuffer*     uniform_buffer; // Vertex shader slot 0.
+    };
+    
+    std::vector<DrawCall> m_draw_calls;
+    size_t m_bytes_uploaded = 0;
+    uint32_t m_num_buffer_maps = 0;
+    uint32_t m_num_state_changes = 0;
+    uint32_t m_num_resources = 0;
+    
+    void reset()
+    {
+        m_draw_calls.clear();
+        m_bytes_uploaded = 0;
+        m_num_buffer_maps = 0;
+        m_num_state_changes = 0;
+    }
+    
+    Shader* create_shader(const char* source, int type)
+    {
+        return (Shader*)create_resource(nullptr, 0);
+    }
+    
+    ShaderProgram* create_shader_program(Shader** shaders, int count)
+    {
+        return (ShaderProgram*)create_resource(nullptr, 0);
+    }
+    
+    VertexBuffer* create_vertex_buffer(const BufferCreateDesc& desc)
+    {
+        return (VertexBuffer*)create_resource(desc.data, desc.size);
+    }
+    
+    IndexBuffer* create_index_buffer(const BufferCreateDesc& desc)
+    {
+        return (IndexBuffer*)create_resource(desc.data, desc.size);
+    }
+    
+    UniformBuffer* create_uniform_buffer(const BufferCreateDesc& desc)
+    {
+        return (UniformBuffer*)create_resource(desc.data, desc.size);
+    }
+    
+    InputLayout* create_input_layout(const InputLayoutCreateDesc& desc)
+    {
+        return (InputLayout*)create_resource(nullptr, 0);
+    }
+    
+    VertexArray* create_vertex_array(const VertexArrayCreateDesc& desc)
+    {
+        return (VertexArray*)create_resource(nullptr, 0);
+    }
+    
+    RasterizerState* create_rasterizer_state(const RasterizerStateCreateDesc& desc)
+    {
+        return (RasterizerState*)create_resource(nullptr, 0);
+    }
+    
+    DepthStencilState* create_depth_stencil_state(const DepthStencilStateCreateDesc& desc)
+    {
+        return (DepthStencilState*)create_resource(nullptr, 0);
+    }
+    
+    SamplerState* create_sampler_state(const SamplerStateCreateDesc& desc)
+    {
+        return (SamplerState*)create_resource(nullptr, 0);
+    }
+    
+    BlendState* create_blend_state(const BlendStateCreateDesc& desc)
+    {
+        return (BlendState*)create_resource(nullptr, 0);
+    }
+    
+    static size_t texel_size(int format)
+    {
+        switch (format)
+        {
+            case TextureFormat::R32G32B32A32_FLOAT: return 16;
+            case TextureFormat::R16G16B16A16_FLOAT: return 8;
+            case TextureFormat::R8G8B8A8_UNORM:     return 4;
+            case TextureFormat::R32_FLOAT:          return 4;
+            case TextureFormat::R16_FLOAT:          return 2;
+            default:                                assert(false); return 4;
+        }
+    }
+    
+    static size_t mip_size(const Resource* res, int mip_slice)
+    {
+        return (size_t)glm::max(res->width >> mip_slice, 1) * glm::max(res->height >> mip_slice, 1) * res->texel_size;
+    }
+    
+    // Storage holds the top level, which is all the initial data covers. Lower levels are only counted
+    // when set_texture_data() uploads them.
+    Texture2D* create_texture_2d(const Texture2DCreateDesc& desc)
+    {
+        size_t texel = texel_size(desc.format);
+        Resource* res = create_resource(desc.data, (size_t)desc.width * desc.height * texel);
+        
+        res->width = desc.width;
+        res->height = desc.height;
+        res->texel_size = texel;
+        
+        return (Texture2D*)res;
+    }
+    
+    void set_texture_data(Texture* texture, int mip_slice, int array_slice, void* data)
+    {
+        m_bytes_uploaded += mip_size((Resource*)texture, mip_slice);
+    }
+    
+    template <typename T>
+    void destroy(T* handle)
+    {
+        if (handle)
+        {
+            delete (Resource*)handle;
+            m_num_resources--;
+        }
+    }
+    
+    template <typename T>
+    void* map_buffer(T* buffer, int type)
+    {
+        Resource* res = (Resource*)buffer;
+        m_num_buffer_maps++;
+        return res->data.empty() ? nullptr : &res->data[0];
+    }
+    
+    // Mapping has no range, so the device cannot tell how much was written. Callers report their own
+    // upload sizes, see BasicRenderer::bytes_uploaded() and UniformUploader::m_bytes_uploaded.
+    template <typename T>
+    void unmap_buffer(T* buffer)
+    {
+        
+    }
+    
+    void bind_rasterizer_state(RasterizerState* state) { m_num_state_changes++; }
+    void bind_depth_stencil_state(DepthStencilState* state) { m_depth_stencil_state = state; m_num_state_changes++; }
+    void bind_blend_state(BlendState* state) { m_blend_state = state; m_num_state_changes++; }
+    void bind_framebuffer(Framebuffer* fbo) { m_num_state_changes++; }
+    void set_viewport(int width, int height, int x, int y) { m_num_state_changes++; }
+    void bind_shader_program(ShaderProgram* program) { m_num_state_changes++; }
+    void bind_uniform_buffer(UniformBuffer* buffer, int shader_type, int slot)
+    {
+        if (shader_type == ShaderType::VERTEX && slot == 0)
+            m_uniform_buffer = buffer;
+        
+        m_num_state_changes++;
+    }
+    
+    void bind_vertex_array(VertexArray* vao) { m_num_state_changes++; }
+    void bind_sampler_state(SamplerState* state, int shader_type, int slot) { m_num_state_changes++; }
+    void bind_texture(Texture* texture, int shader_type, int slot) { m_num_state_changes++; }
+    void clear_framebuffer(int target, float* color) {}
+    
+    void set_primitive_type(int primitive)
+    {
+        m_primitive = primitive;
+        m_num_state_changes++;
+    }
+    
+    void draw(int first, int count)
+    {
+        DrawCall call = { m_primitive, first, count, false, m_depth_stencil_state, m_blend_state, m_uniform_buffer };
+        m_draw_calls.push_back(call);
+    }
+    
+    void draw_indexed(int count)
+    {
+        DrawCall call = { m_primitive, 0, count, true, m_depth_stencil_state, m_blend_state, m_uniform_buffer };
+        m_draw_calls.push_back(call);
+    }
+    
+private:
+    Resource* create_resource(const void* data, size_t size)
+    {
+        Resource* res = new Resource();
+        res->data.resize(size);
+        
+        if (data && size > 0)
+        {
+            memcpy(&res->data[0], data, size);
+            m_bytes_uploaded += size;
+        }
+        
+        m_num_resources++;
+        
+        return res;
+    }
+    
+    int m_primitive = PrimitiveType::TRIANGLES;
+    DepthStencilState* m_depth_stencil_state = nullptr;
+    BlendState* m_blend_state = nullptr;
+    UniformBuffer* m_uniform_buffer = nullptr;
+};
+
+#define STATE_CACHE_MAX_SLOTS 16
+#define STATE_CACHE_MAX_SHADER_TYPES 6
+
+#define DW_FORWARD_DEVICE_CALL(NAME)                                                              \
+    template <typename... Args, typename D = Device>                                              \
+    auto NAME(Args&&... args) -> decltype(std::declval<D&>().NAME(std::forward<Args>(args)...))   \
+    {                                                                                             \
+        return m_device->NAME(std::forward<Args>(args)...);                                       \
+    }
+
+#define DW_FORWARD_DEVICE_CREATE(NAME)                                                            \
+    template <typename... Args, typename D = Device>                                              \
+    auto NAME(Args&&... args) -> decltype(std::declval<D&>().NAME(std::forward<Args>(args)...))   \
+    {                                                                                             \
+        invalidate();                                                                             \
+        return m_device->NAME(std::forward<Args>(args)...);                                       \
+    }
+
+// Sits in front of a device with the same interface and drops binds that match the state it last set,
+// counting issued and skipped calls. Every subsystem sharing the device has to go through the same
+// wrapper, and invalidate() must be called whenever something else touches the device, such as the
+// ImGui backend, since the cache can only know about state set through it. Creating resources may bind
+// them internally, so creation invalidates the cache as well.
+template <typename Device>
+class StateCachingDevice
+{
+public:
+    static const bool kPreservesMappedContents = PreservesMappedContents<Device>::value;
+    
+    uint32_t m_num_issued = 0;
+    uint32_t m_num_skipped = 0;
+    
+    StateCachingDevice(Device* device) : m_device(device)
+    {
+        invalidate();
+    }
+    
+    Device* device()
+    {
+        return m_device;
+    }
+    
+    void invalidate()
+    {
+        m_rasterizer_state.reset();
+        m_depth_stencil_state.reset();
+        m_blend_state.reset();
+        m_framebuffer.reset();
+        m_shader_program.reset();
+        m_vertex_array.reset();
+        m_viewport_valid = false;
+        m_primitive_valid = false;
+        
+        for (int i = 0; i < STATE_CACHE_MAX_SHADER_TYPES * STATE_CACHE_MAX_SLOTS; i++)
+        {
+            m_uniform_buffers[i].reset();
+            m_samplers[i].reset();
+            m_textures[i].reset();
+        }
+    }
+    
+    void reset_stats()
+    {
+        m_num_issued = 0;
+        m_num_skipped = 0;
+    }
+    
+    DW_FORWARD_DEVICE_CREATE(create_shader)
+    DW_FORWARD_DEVICE_CREATE(create_shader_program)
+    DW_FORWARD_DEVICE_CREATE(create_vertex_buffer)
+    DW_FORWARD_DEVICE_CREATE(create_index_buffer)
+    DW_FORWARD_DEVICE_CREATE(create_uniform_buffer)
+    DW_FORWARD_DEVICE_CREATE(create_input_layout)
+    DW_FORWARD_DEVICE_CREATE(create_vertex_array)
+    DW_FORWARD_DEVICE_CREATE(create_texture_2d)
+    DW_FORWARD_DEVICE_CREATE(create_sampler_state)
+    DW_FORWARD_DEVICE_CREATE(create_rasterizer_state)
+    DW_FORWARD_DEVICE_CREATE(create_depth_stencil_state)
+    DW_FORWARD_DEVICE_CREATE(create_blend_state)
+    DW_FORWARD_DEVICE_CREATE(set_texture_data)
+    
+    DW_FORWARD_DEVICE_CALL(map_buffer)
+    DW_FORWARD_DEVICE_CALL(unmap_buffer)
+    DW_FORWARD_DEVICE_CALL(clear_framebuffer)
+    DW_FORWARD_DEVICE_CALL(draw)
+    DW_FORWARD_DEVICE_CALL(draw_indexed)
+    DW_FORWARD_DEVICE_CALL(draw_indexed_base_vertex)
+    
+    // A new object may be created at the address of a destroyed one, so it must not stay cached.
+    template <typename T>
+    void destroy(T* handle)
+    {
+        if (handle)
+            forget(handle);
+        
+        m_device->destroy(handle);
+    }
+    
+    void bind_rasterizer_state(RasterizerState* state)
+    {
+        if (changed(m_rasterizer_state, state))
+            m_device->bind_rasterizer_state(state);
+    }
+    
+    void bind_depth_stencil_state(DepthStencilState* state)
+    {
+        if (changed(m_depth_stencil_state, state))
+            m_device->bind_depth_stencil_state(state);
+    }
+    
+    void bind_blend_state(BlendState* state)
+    {
+        if (changed(m_blend_state, state))
+            m_device->bind_blend_state(state);
+    }
+    
+    void bind_framebuffer(Framebuffer* fbo)
+    {
+        if (changed(m_framebuffer, fbo))
+            m_device->bind_framebuffer(fbo);
+    }
+    
+    void bind_shader_program(ShaderProgram* program)
+    {
+        if (changed(m_shader_program, program))
+            m_device->bind_shader_program(program);
+    }
+    
+    void bind_vertex_array(VertexArray* vao)
+    {
+        if (changed(m_vertex_array, vao))
+            m_device->bind_vertex_array(vao);
+    }
+    
+    void bind_uniform_buffer(UniformBuffer* buffer, int shader_type, int slot)
+    {
+        if (changed(m_uniform_buffers, shader_type, slot, buffer))
+            m_device->bind_uniform_buffer(buffer, shader_type, slot);
+    }
+    
+    void bind_sampler_state(SamplerState* state, int shader_type, int slot)
+    {
+        if (changed(m_samplers, shader_type, slot, state))
+            m_device->bind_sampler_state(state, shader_type, slot);
+    }
+    
+    void bind_texture(Texture* texture, int shader_type, int slot)
+    {
+        if (changed(m_textures, shader_type, slot, texture))
+            m_device->bind_texture(texture, shader_type, slot);
+    }
+    
+    void set_viewport(int width, int height, int x, int y)
+    {
+        int viewport[] = { width, height, x, y };
+        
+        if (m_viewport_valid && memcmp(viewport, m_viewport, sizeof(viewport)) == 0)
+        {
+            m_num_skipped++;
+            return;
+        }
+        
+        memcpy(m_viewport, viewport, sizeof(viewport));
+        m_viewport_valid = true;
+        m_num_issued++;
+        m_device->set_viewport(width, height, x, y);
+    }
+    
+    void set_primitive_type(int primitive)
+    {
+        if (m_primitive_valid && m_primitive == primitive)
+        {
+            m_num_skipped++;
+            return;
+        }
+        
+        m_primitive = primitive;
+        m_primitive_valid = true;
+        m_num_issued++;
+        m_device->set_primitive_type(primitive);
+    }
+    
+private:
+    // Null is a valid binding, so unknown state is tracked separately.
+    struct Binding
+    {
+        const void* object;
+        bool        valid;
+        
+        void reset()
+        {
+            object = nullptr;
+            valid = false;
+        }
+    };
+    
+    bool changed(Binding& binding, const void* object)
+    {
+        if (binding.valid && binding.object == object)
+        {
+            m_num_skipped++;
+            return false;
+        }
+        
+        binding.object = object;
+        binding.valid = true;
+        m_num_issued++;
+        
+        return true;
+    }
+    
+    // Slots outside the cached range are always issued.
+    bool changed(Binding* bindings, int shader_type, int slot, const void* object)
+    {
+        if (shader_type < 0 || shader_type >= STATE_CACHE_MAX_SHADER_TYPES || slot < 0 || slot >= STATE_CACHE_MAX_SLOTS)
+        {
+            m_num_issued++;
+            return true;
+        }
+        
+        return changed(bindings[shader_type * STATE_CACHE_MAX_SLOTS + slot], object);
+    }
+    
+    void forget(const void* object)
+    {
+        Binding* bindings[] = { &m_rasterizer_state, &m_depth_stencil_state, &m_blend_state, &m_framebuffer, &m_shader_program, &m_vertex_array };
+        
+        for (int i = 0; i < sizeof(bindings) / sizeof(Binding*); i++)
+        {
+            if (bindings[i]->object == object)
+                bindings[i]->reset();
+        }
+        
+        for (int i = 0; i < STATE_CACHE_MAX_SHADER_TYPES * STATE_CACHE_MAX_SLOTS; i++)
+        {
+            if (m_uniform_buffers[i].object == object)
+                m_uniform_buffers[i].reset();
+            
+            if (m_samplers[i].object == object)
+                m_samplers[i].reset();
+            
+            if (m_textures[i].object == object)
+                m_textures[i].reset();
+        }
+    }
+    
+    Device* m_device;
+    Binding m_rasterizer_state;
+    Binding m_depth_stencil_state;
+    Binding m_blend_state;
+    Binding m_framebuffer;
+    Binding m_shader_program;
+    Binding m_vertex_array;
+    Binding m_uniform_buffers[STATE_CACHE_MAX_SHADER_TYPES * STATE_CACHE_MAX_SLOTS];
+    Binding m_samplers[STATE_CACHE_MAX_SHADER_TYPES * STATE_CACHE_MAX_SLOTS];
+    Binding m_textures[STATE_CACHE_MAX_SHADER_TYPES * STATE_CACHE_MAX_SLOTS];
+    int m_viewport[4];
+    bool m_viewport_valid;
+    int m_primitive;
+    bool m_primitive_valid;
+};
+
+namespace dd
+{
+    struct CameraUniforms
+    {
+        glm::mat4 view_proj;
+        glm::vec4 tint; // Multiplied with the vertex color, alpha included.
+        
+        REFLECT()
+    };
+    
+    BEGIN_DECLARE_UNIFORMS(CameraUniforms)
+        REFLECT_UNIFORM(view_proj)
+        REFLECT_UNIFORM(tint)
+    END_DECLARE_UNIFORMS()
+    
+    struct VertexWorld
+    {
+        glm::vec3 position;
+        glm::vec2 uv;
+        glm::vec3 color;
+    };
+    
+    // Line vertices need neither uv nor float color, so contexts record this 16 byte format.
+    struct VertexLine
+    {
+        glm::vec3 position;
+        uint32_t  color;
+    };
+    
+    enum VertexFormat
+    {
+        VERTEX_FORMAT_COMPACT, // VertexLine is uploaded as-is.
+        VERTEX_FORMAT_FULL     // VertexLine is expanded to VertexWorld during upload.
+    };
+    
+    inline uint32_t pack_color(const glm::vec3& c)
+    {
+        uint32_t r = (uint32_t)(glm::clamp(c.x, 0.0f, 1.0f) * 255.0f + 0.5f);
+        uint32_t g = (uint32_t)(glm::clamp(c.y, 0.0f, 1.0f) * 255.0f + 0.5f);
+        uint32_t b = (uint32_t)(glm::clamp(c.z, 0.0f, 1.0f) * 255.0f + 0.5f);
+        
+        return r | (g << 8) | (b << 16) | (255u << 24);
+    }
+    
+    inline glm::vec3 unpack_color(uint32_t c)
+    {
+        return glm::vec3(c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF) / 255.0f;
+    }
+    
+    // Declared in draw order, so overlays end up on top of everything drawn before them.
+    enum DepthMode
+    {
+        DEPTH_MODE_TESTED,  // Hidden by whatever is in front, like any other geometry.
+        DEPTH_MODE_XRAY,    // Visible parts are drawn as usual, hidden parts faded in a second pass behind the scene.
+        DEPTH_MODE_OVERLAY  // Drawn without depth testing after all other shapes.
+    };
+    
+    // A draw state packs everything that needs a state change between commands. It forms the upper half of
+    // a command's sort key, so the field order below is also the order buckets are drawn in.
+#define DRAW_STATE_DEPTH_SHIFT 30
+#define DRAW_STATE_BLEND (1u << 29)
+#define DRAW_STATE_PRIMITIVE_MASK 0xFFu
+    
+    inline DepthMode draw_state_depth_mode(uint32_t state)
+    {
+        return (DepthMode)(state >> DRAW_STATE_DEPTH_SHIFT);
+    }
+    
+    struct DrawCommand
+    {
+        int type;
+        int vertices;
+        uint32_t state; // Depth mode and blending, without the primitive type.
+    };
+    
+    // A run of sorted commands that share a draw state and can be issued as one draw call.
+    struct DrawBatch
+    {
+        uint32_t state; // Includes the primitive type.
+        int first;
+        int count;
+    };
+    
+    // Stable LSD radix sort on the upper 32 bits of each key. The lower 32 bits hold the command index,
+    // which is already ascending, so commands with equal state keep their submission order. Bytes that are
+    // equal across all keys are skipped, which usually leaves a single pass over the primitive byte.
+    inline void radix_sort_keys(std::vector<uint64_t>& keys, std::vector<uint64_t>& scratch)
+    {
+        size_t n = keys.size();
+        
+        if (n < 2)
+            return;
+        
+        scratch.resize(n);
+        
+        size_t counts[4][256];
+        memset(counts, 0, sizeof(counts));
+        
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t state = (uint32_t)(keys[i] >> 32);
+            
+            counts[0][state & 0xFF]++;
+            counts[1][(state >> 8) & 0xFF]++;
+            counts[2][(state >> 16) & 0xFF]++;
+            counts[3][state >> 24]++;
+        }
+        
+        uint64_t* src = &keys[0];
+        uint64_t* dst = &scratch[0];
+        
+        for (int pass = 0; pass < 4; pass++)
+        {
+            int shift = 32 + pass * 8;
+            size_t* offsets = counts[pass];
+            
+            if (offsets[(src[0] >> shift) & 0xFF] == n)
+                continue;
+            
+            size_t offset = 0;
+            
+            for (int b = 0; b < 256; b++)
+            {
+                size_t count = offsets[b];
+                offsets[b] = offset;
+                offset += count;
+            }
+            
+            for (size_t i = 0; i < n; i++)
+                dst[offsets[(src[i] >> shift) & 0xFF]++] = src[i];
+            
+            std::swap(src, dst);
+        }
+        
+        if (src != &keys[0])
+            memcpy(&keys[0], src, sizeof(uint64_t) * n);
+    }
+    
+#define MAX_VERTICES 100000
+#define MAX_THREAD_CONTEXTS 16
+#define MAX_RETAINED_VERTICES 100000
+#define MIN_CIRCLE_SEGMENTS 6
+#define MAX_CIRCLE_SEGMENTS 36
+#define DEFAULT_CIRCLE_SEGMENTS 18
+#define XRAY_HIDDEN_ALPHA 0.3f
+    
+    const glm::vec4 kFrustumCorners[] = {
+        glm::vec4(-1.0f, -1.0f, 1.0f, 1.0f),
+        glm::vec4(-1.0f, 1.0f, 1.0f, 1.0f),
+        glm::vec4(1.0f, 1.0f, 1.0f, 1.0f),
+        glm::vec4(1.0f, -1.0f, 1.0f, 1.0f),
+        glm::vec4(-1.0f, -1.0f, -1.0f, 1.0f),
+        glm::vec4(-1.0f, 1.0f, -1.0f, 1.0f),
+        glm::vec4(1.0f, 1.0f, -1.0f, 1.0f),
+        glm::vec4(1.0f, -1.0f, -1.0f, 1.0f)
+    };
+    
+    struct Frustum
+    {
+        glm::vec4 planes[6];
+        
+        // Plane components stored as SoA so the batch test can splat one plane at a time.
+        float px[6];
+        float py[6];
+        float pz[6];
+        float pw[6];
+        
+        // Gribb-Hartmann plane extraction. glm matrices are column-major, so row i is (m[0][i], m[1][i], m[2][i], m[3][i]).
+        void extract(const glm::mat4& m)
+        {
+            glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+            glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+            glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+            glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+            
+            planes[0] = row3 + row0; // Left
+            planes[1] = row3 - row0; // Right
+            planes[2] = row3 + row1; // Bottom
+            planes[3] = row3 - row1; // Top
+            planes[4] = row3 + row2; // Near
+            planes[5] = row3 - row2; // Far
+            
+            for (int i = 0; i < 6; i++)
+            {
+                planes[i] = planes[i] / glm::length(glm::vec3(planes[i].x, planes[i].y, planes[i].z));
+                
+                px[i] = planes[i].x;
+                py[i] = planes[i].y;
+                pz[i] = planes[i].z;
+                pw[i] = planes[i].w;
+            }
+        }
+        
+        bool intersects_sphere(const glm::vec3& center, float radius) const
+        {
+            for (int i = 0; i < 6; i++)
+            {
+                if (px[i] * center.x + py[i] * center.y + pz[i] * center.z + pw[i] < -radius)
+                    return false;
+            }
+            
+            return true;
+        }
+        
+        bool intersects_aabb(const glm::vec3& min, const glm::vec3& max) const
+        {
+            glm::vec3 center = (min + max) * 0.5f;
+            glm::vec3 extents = (max - min) * 0.5f;
+            
+            for (int i = 0; i < 6; i++)
+            {
+                float d = px[i] * center.x + py[i] * center.y + pz[i] * center.z + pw[i];
+                float r = fabsf(px[i]) * extents.x + fabsf(py[i]) * extents.y + fabsf(pz[i]) * extents.z;
+                
+                if (d < -r)
+                    return false;
+            }
+            
+            return true;
+        }
+        
+        // Tests an array of spheres (xyz = center, w = radius) and writes one visibility flag per sphere.
+        // Four spheres are tested per iteration when SSE is available.
+        void intersects_spheres(const glm::vec4* spheres, int count, bool* visible) const
+        {
+            int i = 0;
+            
+#if defined(DW_SIMD_SSE)
+            for (; i + 4 <= count; i += 4)
+            {
+                __m128 x = _mm_loadu_ps(&spheres[i].x);
+                __m128 y = _mm_loadu_ps(&spheres[i + 1].x);
+                __m128 z = _mm_loadu_ps(&spheres[i + 2].x);
+                __m128 r = _mm_loadu_ps(&spheres[i + 3].x);
+                
+                // Rows in, columns out: x, y, z and r now each hold one component of all four spheres.
+                _MM_TRANSPOSE4_PS(x, y, z, r);
+                
+                __m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), r);
+                __m128 outside = _mm_setzero_ps();
+                
+                for (int p = 0; p < 6; p++)
+                {
+                    __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(px[p]), x),
+                                                     _mm_mul_ps(_mm_set1_ps(py[p]), y)),
+                                          _mm_add_ps(_mm_mul_ps(_mm_set1_ps(pz[p]), z),
+                                                     _mm_set1_ps(pw[p])));
+                    
+                    outside = _mm_or_ps(outside, _mm_cmplt_ps(d, neg_r));
+                }
+                
+                int mask = _mm_movemask_ps(outside);
+                
+                visible[i]     = (mask & 1) == 0;
+                visible[i + 1] = (mask & 2) == 0;
+                visible[i + 2] = (mask & 4) == 0;
+                visible[i + 3] = (mask & 8) == 0;
+            }
+#endif
+            
+            for (; i < count; i++)
+                visible[i] = intersects_sphere(glm::vec3(spheres[i].x, spheres[i].y, spheres[i].z), spheres[i].w);
+        }
+    };
+    
+    // Unit circle points for every supported segment count, built once so tessellation needs no trig.
+    struct CircleTables
+    {
+        glm::vec2 points[MAX_CIRCLE_SEGMENTS + 1][MAX_CIRCLE_SEGMENTS + 1];
+        
+        CircleTables()
+        {
+            for (int n = 1; n <= MAX_CIRCLE_SEGMENTS; n++)
+            {
+                for (int i = 0; i <= n; i++)
+                {
+                    float angle = glm::radians(360.0f * i / n);
+                    points[n][i] = glm::vec2(cosf(angle), sinf(angle));
+                }
+            }
+        }
+        
+        static const CircleTables& get()
+        {
+            static CircleTables tables;
+            return tables;
+        }
+    };
+    
+    // Picks circle segment counts from the projected radius so that the polygon never deviates from the
+    // true circle by more than max_error pixels.
+    struct Lod
+    {
+        glm::vec3 camera_pos;
+        float     pixels_per_unit; // Projected size in pixels of one world unit at a distance of one unit.
+        float     max_error;
+        
+        int circle_segments(const glm::vec3& center, float radius) const
+        {
+            float distance = glm::max(glm::length(center - camera_pos), 0.001f);
+            float projected = radius * pixels_per_unit / distance;
+            
+            if (projected <= max_error * 2.0f)
+                return MIN_CIRCLE_SEGMENTS;
+            
+            // A chord spanning angle a deviates from the arc by r * (1 - cos(a / 2)).
+            int segments = (int)ceilf(3.14159265f / acosf(1.0f - max_error / projected));
+            
+            // Capsules split circles in half, so keep the count even.
+            segments += segments & 1;
+            
+            return glm::clamp(segments, MIN_CIRCLE_SEGMENTS, MAX_CIRCLE_SEGMENTS);
+        }
+    };
+    
+    class Context
+    {
+    public:
+        std::vector<VertexLine> m_world_vertices;
+        std::vector<DrawCommand> m_draw_commands;
+        
+        // When set, aabb, obb, sphere and capsule reject shapes outside this frustum before emitting any vertices.
+        const Frustum* m_cull_frustum = nullptr;
+        
+        // When set, circles, spheres and capsules are tessellated based on their size on screen.
+        const Lod* m_lod = nullptr;
+        
+        // Draw state and alpha applied to shapes recorded from now on. clear() restores the defaults.
+        uint32_t m_state = 0;
+        uint32_t m_alpha = 255;
+        
+        void set_depth_mode(DepthMode mode)
+        {
+            m_state = (m_state & ~(3u << DRAW_STATE_DEPTH_SHIFT)) | ((uint32_t)mode << DRAW_STATE_DEPTH_SHIFT);
+        }
+        
+        // Shapes with an alpha below one are drawn blended, after the opaque shapes of their depth mode.
+        // Only the compact vertex format carries alpha to the shader, so the full format draws them opaque.
+        void set_alpha(float alpha)
+        {
+            m_alpha = (uint32_t)(glm::clamp(alpha, 0.0f, 1.0f) * 255.0f + 0.5f);
+            
+            if (m_alpha < 255)
+                m_state |= DRAW_STATE_BLEND;
+            else
+                m_state &= ~DRAW_STATE_BLEND;
+        }
+        
+        uint32_t color(const glm::vec3& c)
+        {
+            return (pack_color(c) & 0x00FFFFFF) | (m_alpha << 24);
+        }
+        
+        int circle_segments(const glm::vec3& center, float radius)
+        {
+            return m_lod ? m_lod->circle_segments(center, radius) : DEFAULT_CIRCLE_SEGMENTS;
+        }
+        
+        bool culled(const glm::vec3& min, const glm::vec3& max)
+        {
+            return m_cull_frustum && !m_cull_frustum->intersects_aabb(min, max);
+        }
+        
+        bool culled(const glm::vec3& center, float radius)
+        {
+            return m_cull_frustum && !m_cull_frustum->intersects_sphere(center, radius);
+        }
+        
+        void capsule(const float& _height, const float& _radius, const glm::vec3& _pos, const glm::vec3& _c)
+        {
+            if (culled(glm::vec3(_pos.x - _radius, glm::min(_pos.y, 0.0f), _pos.z - _radius),
+                       glm::vec3(_pos.x + _radius, glm::max(_height, _pos.y + _radius), _pos.z + _radius)))
+                return;
+            
+            // Draw four lines
+            line(glm::vec3(_pos.x, _pos.y + _radius, _pos.z-_radius), glm::vec3(_pos.x, _height - _radius, _pos.z-_radius), _c);
+            line(glm::vec3(_pos.x, _pos.y + _radius, _pos.z+_radius), glm::vec3(_pos.x, _height - _radius, _pos.z+_radius), _c);
+            line(glm::vec3(_pos.x-_radius, _pos.y + _radius, _pos.z), glm::vec3(_pos.x-_radius, _height - _radius, _pos.z), _c);
+            line(glm::vec3(_pos.x+_radius, _pos.y + _radius, _pos.z), glm::vec3(_pos.x+_radius, _height - _radius, _pos.z), _c);
+            
+            glm::vec3 top(_pos.x, _height - _radius, _pos.z);
+            glm::vec3 bottom(_pos.x, _radius, _pos.z);
+            glm::vec3 x_axis(1.0f, 0.0f, 0.0f);
+            glm::vec3 y_axis(0.0f, 1.0f, 0.0f);
+            glm::vec3 z_axis(0.0f, 0.0f, 1.0f);
+            
+            int segments = circle_segments((top + bottom) * 0.5f, _radius);
+            int half = segments / 2;
+            
+            arc(_radius, top, x_axis, y_axis, segments, 0, half, _c);
+            arc(_radius, top, z_axis, y_axis, segments, 0, half, _c);
+            arc(_radius, bottom, x_axis, y_axis, segments, half, half, _c);
+            arc(_radius, bottom, z_axis, y_axis, segments, half, half, _c);
+            
+            arc(_radius, top, x_axis, z_axis, segments, 0, segments, _c);
+            arc(_radius, bottom, x_axis, z_axis, segments, 0, segments, _c);
+        }
+        
+        void aabb(const glm::vec3& _min, const glm::vec3& _max, const glm::vec3& _pos, const glm::vec3& _c)
+        {
+            glm::vec3 min = _pos + _min;
+            glm::vec3 max = _pos + _max;
+            
+            if (culled(min, max))
+                return;
+            
+            line(min,                            glm::vec3(max.x, min.y, min.z), _c);
+            line(glm::vec3(max.x, min.y, min.z), glm::vec3(max.x, min.y, max.z), _c);
+            line(glm::vec3(max.x, min.y, max.z), glm::vec3(min.x, min.y, max.z), _c);
+            line(glm::vec3(min.x, min.y, max.z), min, _c);
+            
+            line(glm::vec3(min.x, max.y, min.z), glm::vec3(max.x, max.y, min.z), _c);
+            line(glm::vec3(max.x, max.y, min.z), max, _c);
+            line(max,                            glm::vec3(min.x, max.y, max.z), _c);
+            line(glm::vec3(min.x, max.y, max.z), glm::vec3(min.x, max.y, min.z), _c);
+            
+            line(min,                            glm::vec3(min.x, max.y, min.z), _c);
+            line(glm::vec3(max.x, min.y, min.z), glm::vec3(max.x, max.y, min.z), _c);
+            line(glm::vec3(max.x, min.y, max.z), max, _c);
+            line(glm::vec3(min.x, min.y, max.z), glm::vec3(min.x, max.y, max.z), _c);
+        }
+        
+        void obb(const glm::vec3& _min, const glm::vec3& _max, const glm::mat4& _model, const glm::vec3& _c)
+        {
+            glm::vec3 verts[8];
+            glm::vec3 size = _max - _min;
+            int idx = 0;
+            
+            if (m_cull_frustum)
+            {
+                glm::vec4 center = _model * glm::vec4((_min + _max) * 0.5f, 1.0f);
+                float scale = glm::max(glm::length(glm::vec3(_model[0])),
+                                       glm::max(glm::length(glm::vec3(_model[1])), glm::length(glm::vec3(_model[2]))));
+                
+                if (culled(glm::vec3(center.x, center.y, center.z), glm::length(size) * 0.5f * scale))
+                    return;
+            }
+            
+            for (float x = _min.x; x <= _max.x; x += size.x)
+            {
+                for (float y = _min.y; y <= _max.y; y += size.y)
+                {
+                    for (float z = _min.z; z <= _max.z; z += size.z)
+                    {
+                        glm::vec4 v = _model * glm::vec4(x, y, z, 1.0f);
+                        verts[idx++] = glm::vec3(v.x, v.y, v.z);
+                    }
+                }
+            }
+            
+            line(verts[0], verts[1], _c);
+            line(verts[1], verts[5], _c);
+            line(verts[5], verts[4], _c);
+            line(verts[4], verts[0], _c);
+            
+            line(verts[2], verts[3], _c);
+            line(verts[3], verts[7], _c);
+            line(verts[7], verts[6], _c);
+            line(verts[6], verts[2], _c);
+            
+            line(verts[2], verts[0], _c);
+            line(verts[6], verts[4], _c);
+            line(verts[3], verts[1], _c);
+            line(verts[7], verts[5], _c);
+        }
+        
+        void grid(const float& _x, const float& _z, const float& _y_level, const float& spacing, const glm::vec3& _c)
+        {
+            int offset_x = floor((_x * spacing)/2.0f);
+            int offset_z = floor((_z * spacing )/2.0f);
+            
+            for (int x = -offset_x; x <= offset_x; x += spacing)
+            {
+                line(glm::vec3(x, _y_level, -offset_z), glm::vec3(x, _y_level, offset_z), _c);
+            }
+            
+            for (int z = -offset_z; z <= offset_z; z += spacing)
+            {
+                line(glm::vec3(-offset_x, _y_level, z), glm::vec3(offset_x, _y_level, z), _c);
+            }
+        }
+        
+        void line(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& c)
+        {
+            VertexLine vw0, vw1;
+            vw0.position = v0;
+            vw0.color = color(c);
+            
+            vw1.position = v1;
+            vw1.color = vw0.color;
+            
+            m_world_vertices.push_back(vw0);
+            m_world_vertices.push_back(vw1);
+            
+            DrawCommand cmd;
+            cmd.type = PrimitiveType::LINES;
+            cmd.vertices = 2;
+            cmd.state = m_state;
+            
+            m_draw_commands.push_back(cmd);
+        }
+        
+        void line_strip(glm::vec3* v, const int& count, const glm::vec3& c)
+        {
+            uint32_t packed = color(c);
+            
+            for (int i = 0; i < count; i++)
+            {
+                VertexLine vert;
+                vert.position = v[i];
+                vert.color = packed;
+                
+                m_world_vertices.push_back(vert);
+            }
+            
+            DrawCommand cmd;
+            cmd.type = PrimitiveType::LINE_STRIP;
+            cmd.vertices = count;
+            cmd.state = m_state;
+            
+            m_draw_commands.push_back(cmd);
+        }
+        
+        void circle_xy(float radius, const glm::vec3& pos, const glm::vec3& c)
+        {
+            int segments = circle_segments(pos, radius);
+            arc(radius, pos, glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), segments, 0, segments, c);
+        }
+        
+        void circle_xz(float radius, const glm::vec3& pos, const glm::vec3& c)
+        {
+            int segments = circle_segments(pos, radius);
+            arc(radius, pos, glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), segments, 0, segments, c);
+        }
+        
+        void circle_yz(float radius, const glm::vec3& pos, const glm::vec3& c)
+        {
+            int segments = circle_segments(pos, radius);
+            arc(radius, pos, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), segments, 0, segments, c);
+        }
+        
+        // Emits count segments of a circle tessellated into the given number of segments, starting at
+        // segment first. u and v are the unit axes of the circle's plane.
+        void arc(float radius, const glm::vec3& pos, const glm::vec3& u, const glm::vec3& v, int segments, int first, int count, const glm::vec3& c)
+        {
+            const glm::vec2* points = CircleTables::get().points[segments];
+            glm::vec3 verts[MAX_CIRCLE_SEGMENTS + 1];
+            
+            for (int i = 0; i <= count; i++)
+            {
+                const glm::vec2& p = points[first + i];
+                verts[i] = pos + u * (p.x * radius) + v * (p.y * radius);
+            }
+            
+            line_strip(&verts[0], count + 1, c);
+        }
+        
+        void sphere(const float& radius, const glm::vec3& pos, const glm::vec3& c)
+        {
+            if (culled(pos, radius))
+                return;
+            
+            int segments = circle_segments(pos, radius);
+            
+            arc(radius, pos, glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), segments, 0, segments, c);
+            arc(radius, pos, glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), segments, 0, segments, c);
+            arc(radius, pos, glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), segments, 0, segments, c);
+        }
+        
+        // Batched version of sphere() for large numbers of shapes (xyz = center, w = radius). Culling is done
+        // four spheres at a time before any vertices are generated.
+        void spheres(const glm::vec4* spheres, int count, const glm::vec3& c)
+        {
+            const Frustum* frustum = m_cull_frustum;
+            bool visible[64];
+            
+            m_cull_frustum = nullptr;
+            
+            for (int i = 0; i < count; i += 64)
+            {
+                int batch = glm::min(count - i, 64);
+                
+                if (frustum)
+                    frustum->intersects_spheres(&spheres[i], batch, &visible[0]);
+                
+                for (int j = 0; j < batch; j++)
+                {
+                    if (!frustum || visible[j])
+                        sphere(spheres[i + j].w, glm::vec3(spheres[i + j].x, spheres[i + j].y, spheres[i + j].z), c);
+                }
+            }
+            
+            m_cull_frustum = frustum;
+        }
+        
+        void frustum(const glm::mat4& proj, const glm::mat4& view, const glm::vec3& c)
+        {
+            glm::mat4 inverse = glm::inverse(proj * view);
+            glm::vec3 corners[8];
+            
+            for (int i = 0; i < 8; i++)
+            {
+                glm::vec4 v = inverse * kFrustumCorners[i];
+                v = v/v.w;
+                corners[i] = glm::vec3(v.x, v.y, v.z);
+            }
+            
+            glm::vec3 far[5] = {
+                corners[0],
+                corners[1],
+                corners[2],
+                corners[3],
+                corners[0]
+            };
+            
+            line_strip(&far[0], 5, c);
+            
+            glm::vec3 near[5] = {
+                corners[4],
+                corners[5],
+                corners[6],
+                corners[7],
+                corners[4]
+            };
+            
+            line_strip(&near[0], 5, c);
+            
+            line(corners[0], corners[4], c);
+            line(corners[1], corners[5], c);
+            line(corners[2], corners[6], c);
+            line(corners[3], corners[7], c);
+        }
+        
+        void clear()
+        {
+            m_draw_commands.clear();
+            m_world_vertices.clear();
+            m_state = 0;
+            m_alpha = 255;
+        }
+    };
+    
+    // Shapes that outlive a single frame. A batch is either static (kept until removed) or expires
+    // after a number of frames and/or seconds, whichever runs out first.
+    struct RetainedBatch
+    {
+        Context  context;
+        uint32_t id;
+        int      frames;
+        float    seconds;
+        bool     is_static;
+    };
+    
+    // Templated on the device so the same pipeline can run on RenderDevice or RecordingRenderDevice.
+    template <typename Device>
+    class BasicRenderer : public Context
+    {
+    private:
+        CameraUniforms m_uniforms;
+        UniformUploader<CameraUniforms> m_uniform_uploader;
+        UniformUploader<CameraUniforms> m_hidden_uploader;
+        VertexArray* m_line_vao;
+        VertexBuffer* m_line_vbo;
+        InputLayout* m_line_il;
+        Shader* m_line_vs;
+        Shader* m_line_fs;
+        ShaderProgram* m_line_program;
+        UniformBuffer* m_ubo;
+        UniformBuffer* m_hidden_ubo;
+        Context m_thread_contexts[MAX_THREAD_CONTEXTS];
+        Frustum m_frustum;
+        Lod m_lod_params;
+        VertexArray* m_retained_vao;
+        VertexBuffer* m_retained_vbo;
+        std::vector<RetainedBatch*> m_retained;
+        RetainedBatch* m_recording = nullptr;
+        uint32_t m_next_retained_id = 1;
+        size_t m_num_retained_vertices = 0;
+        size_t m_bytes_uploaded = 0;
+        bool m_retained_dirty = false;
+        VertexFormat m_format;
+        size_t m_vertex_size;
+        Device* m_device;
+        RasterizerState* m_rs;
+        DepthStencilState* m_ds;
+        DepthStencilState* m_ds_no_write;
+        DepthStencilState* m_ds_hidden;
+        DepthStencilState* m_ds_overlay;
+        BlendState* m_bs_opaque;
+        BlendState* m_bs_alpha;
+        std::vector<DrawBatch> m_batches;
+        std::vector<DrawBatch> m_retained_batches;
+        std::vector<uint64_t> m_sort_keys;
+        std::vector<uint64_t> m_sort_scratch;
+        std::vector<const VertexLine*> m_sort_vertices;
+        std::vector<const DrawCommand*> m_sort_commands;
+        
+    public:
+        BasicRenderer()
+        {
+            m_world_vertices.resize(MAX_VERTICES);
+            m_world_vertices.clear();
+            
+            m_draw_commands.resize(MAX_VERTICES);
+            m_draw_commands.clear();
+        }
+        
+        bool init(Device* _device, VertexFormat format = VERTEX_FORMAT_COMPACT)
+        {
+            DW_PROFILE_SCOPE("dd::Renderer::init");
+            
+            m_device = _device;
+            m_format = format;
+            m_vertex_size = format == VERTEX_FORMAT_COMPACT ? sizeof(VertexLine) : sizeof(VertexWorld);
+            
+            std::string vs_str;
+            Utility::ReadText("shader/debug_draw_vs.glsl", vs_str);
+            
+            std::string fs_str;
+            Utility::ReadText("shader/debug_draw_fs.glsl", fs_str);
+            
+            m_line_vs = m_device->create_shader(vs_str.c_str(), ShaderType::VERTEX);
+            m_line_fs = m_device->create_shader(fs_str.c_str(), ShaderType::FRAGMENT);
+            
+            if (!m_line_vs || !m_line_fs)
+            {
+                LOG_FATAL("Failed to create Shaders");
+                return false;
+            }
+            
+            Shader* shaders[] = { m_line_vs, m_line_fs };
+            m_line_program = m_device->create_shader_program(shaders, 2);
+            
+            BufferCreateDesc bc;
+            InputLayoutCreateDesc ilcd;
+            VertexArrayCreateDesc vcd;
+            
+            DW_ZERO_MEMORY(bc);
+            bc.data = nullptr;
+            bc.data_type = DataType::FLOAT;
+            bc.size = m_vertex_size * MAX_VERTICES;
+            bc.usage_type = BufferUsageType::DYNAMIC;
+            
+            m_line_vbo = m_device->create_vertex_buffer(bc);
+            
+            InputElement elements[] =
+            {
+                { 3, DataType::FLOAT, false, 0, "POSITION" },
+                { 2, DataType::FLOAT, false, sizeof(float) * 3, "TEXCOORD" },
+                { 3, DataType::FLOAT, false, sizeof(float) * 5, "COLOR" }
+            };
+            
+            // The compact layout keeps the attribute order of the full one so the same shaders work. Lines
+            // have no uv and the shaders must not depend on it: TEXCOORD aliases the position instead of
+            // taking up space, so it reads position.xy here and zero in the full format.
+            InputElement compact_elements[] =
+            {
+                { 3, DataType::FLOAT, false, 0, "POSITION" },
+                { 2, DataType::FLOAT, false, 0, "TEXCOORD" },
+                { 4, DataType::UINT8, true, sizeof(float) * 3, "COLOR" }
+            };
+            
+            DW_ZERO_MEMORY(ilcd);
+            ilcd.elements = format == VERTEX_FORMAT_COMPACT ? compact_elements : elements;
+            ilcd.num_elements = 3;
+            ilcd.vertex_size = m_vertex_size;
+            
+            m_line_il = m_device->create_input_layout(ilcd);
+            
+            DW_ZERO_MEMORY(vcd);
+            vcd.index_buffer = nullptr;
+            vcd.vertex_buffer = m_line_vbo;
+            vcd.layout = m_line_il;
+            
+            m_line_vao = m_device->create_vertex_array(vcd);
+            
+            DW_ZERO_MEMORY(bc);
+            bc.data = nullptr;
+            bc.data_type = DataType::FLOAT;
+            bc.size = m_vertex_size * MAX_RETAINED_VERTICES;
+            bc.usage_type = BufferUsageType::DYNAMIC;
+            
+            m_retained_vbo = m_device->create_vertex_buffer(bc);
+            
+            vcd.vertex_buffer = m_retained_vbo;
+            
+            m_retained_vao = m_device->create_vertex_array(vcd);
+            
+            if (!m_line_vao || !m_line_vbo || !m_retained_vao || !m_retained_vbo)
+            {
+                LOG_FATAL("Failed to create Vertex Buffers/Arrays");
+                return false;
+            }
+            
+            RasterizerStateCreateDesc rs_desc;
+            DW_ZERO_MEMORY(rs_desc);
+            rs_desc.cull_mode = CullMode::NONE;
+            rs_desc.fill_mode = FillMode::SOLID;
+            rs_desc.front_winding_ccw = true;
+            rs_desc.multisample = true;
+            rs_desc.scissor = false;
+            
+            m_rs = m_device->create_rasterizer_state(rs_desc);
+            
+            DepthStencilStateCreateDesc ds_desc;
+            DW_ZERO_MEMORY(ds_desc);
+            ds_desc.depth_mask = true;
+            ds_desc.enable_depth_test = true;
+            ds_desc.enable_stencil_test = false;
+            ds_desc.depth_cmp_func = ComparisonFunction::LESS_EQUAL;
+            
+            m_ds = m_device->create_depth_stencil_state(ds_desc);
+            
+            ds_desc.depth_mask = false;
+            
+            m_ds_no_write = m_device->create_depth_stencil_state(ds_desc);
+            
+            ds_desc.depth_cmp_func = ComparisonFunction::GREATER;
+            
+            m_ds_hidden = m_device->create_depth_stencil_state(ds_desc);
+            
+            ds_desc.enable_depth_test = false;
+            ds_desc.depth_cmp_func = ComparisonFunction::ALWAYS;
+            
+            m_ds_overlay = m_device->create_depth_stencil_state(ds_desc);
+            
+            BlendStateCreateDesc bs_desc;
+            DW_ZERO_MEMORY(bs_desc);
+            bs_desc.enable = false;
+            
+            m_bs_opaque = m_device->create_blend_state(bs_desc);
+            
+            bs_desc.enable = true;
+            bs_desc.src_func = BlendFunc::SRC_ALPHA;
+            bs_desc.dst_func = BlendFunc::ONE_MINUS_SRC_ALPHA;
+            bs_desc.blend_op = BlendOp::ADD;
+            bs_desc.src_func_alpha = BlendFunc::ONE;
+            bs_desc.dst_func_alpha = BlendFunc::ONE_MINUS_SRC_ALPHA;
+            bs_desc.blend_op_alpha = BlendOp::ADD;
+            
+            m_bs_alpha = m_device->create_blend_state(bs_desc);
+            
+            BufferCreateDesc uboDesc;
+            DW_ZERO_MEMORY(uboDesc);
+            uboDesc.data = nullptr;
+            uboDesc.data_type = DataType::FLOAT;
+            uboDesc.size = sizeof(CameraUniforms);
+            uboDesc.usage_type = BufferUsageType::DYNAMIC;
+            
+            m_ubo = m_device->create_uniform_buffer(uboDesc);
+            m_hidden_ubo = m_device->create_uniform_buffer(uboDesc);
+            
+            return true;
+        }
+        
+        // Returns the recording context for a worker slot. Each slot must only be written to by one thread
+        // per frame, which keeps recording lock-free. Contexts are merged in slot order after the main
+        // context during render(), so the output is deterministic regardless of thread scheduling.
+        Context* context(int slot)
+        {
+            assert(slot >= 0 && slot < MAX_THREAD_CONTEXTS);
+            return &m_thread_contexts[slot];
+        }
+        
+        // Enables culling of shapes against the given view-projection for the main and all worker contexts.
+        // Must be called before shapes are recorded for the frame, and not while workers are recording.
+        void enable_culling(const glm::mat4& view_proj)
+        {
+            m_frustum.extract(view_proj);
+            m_cull_frustum = &m_frustum;
+            
+            for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                m_thread_contexts[i].m_cull_frustum = &m_frustum;
+        }
+        
+        void disable_culling()
+        {
+            m_cull_frustum = nullptr;
+            
+            for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                m_thread_contexts[i].m_cull_frustum = nullptr;
+        }
+        
+        // Enables screen-space error based tessellation of circles, spheres and capsules for the main and all
+        // worker contexts. Like enable_culling(), call it before recording and not while workers are recording.
+        void enable_lod(const glm::vec3& camera_pos, float fov_y, int viewport_height, float max_error = 0.5f)
+        {
+            m_lod_params.camera_pos = camera_pos;
+            m_lod_params.pixels_per_unit = viewport_height / (2.0f * tanf(fov_y * 0.5f));
+            m_lod_params.max_error = max_error;
+            m_lod = &m_lod_params;
+            
+            for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                m_thread_contexts[i].m_lod = &m_lod_params;
+        }
+        
+        void disable_lod()
+        {
+            m_lod = nullptr;
+            
+            for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                m_thread_contexts[i].m_lod = nullptr;
+        }
+        
+        // Starts recording a static batch. Shapes recorded into the returned context are uploaded once and
+        // drawn every frame until remove_retained() is called with the id returned by end_retained().
+        Context* begin_static()
+        {
+            return begin_retained(0, 0.0f, true);
+        }
+        
+        // Starts recording a batch that is drawn for the given number of frames or seconds. Pass 0 to
+        // leave either limit unused.
+        Context* begin_timed(int frames, float seconds)
+        {
+            return begin_retained(frames, seconds, false);
+        }
+        
+        uint32_t end_retained()
+        {
+            assert(m_recording);
+            
+            uint32_t id = m_recording->id;
+            
+            m_retained.push_back(m_recording);
+            m_num_retained_vertices += m_recording->context.m_world_vertices.size();
+            m_retained_dirty = true;
+            m_recording = nullptr;
+            
+            return id;
+        }
+        
+        void remove_retained(uint32_t id)
+        {
+            for (int i = 0; i < m_retained.size(); i++)
+            {
+                if (m_retained[i]->id == id)
+                {
+                    remove_retained_at(i);
+                    return;
+                }
+            }
+        }
+        
+        void shutdown()
+        {
+            for (int i = 0; i < m_retained.size(); i++)
+                delete m_retained[i];
+            
+            m_retained.clear();
+            delete m_recording;
+            
+            m_device->destroy(m_retained_vbo);
+            m_device->destroy(m_retained_vao);
+            m_device->destroy(m_ubo);
+            m_device->destroy(m_hidden_ubo);
+            m_device->destroy(m_line_program);
+            m_device->destroy(m_line_vs);
+            m_device->destroy(m_line_fs);
+            m_device->destroy(m_line_vbo);
+            m_device->destroy(m_line_vao);
+            m_device->destroy(m_bs_alpha);
+            m_device->destroy(m_bs_opaque);
+            m_device->destroy(m_ds_overlay);
+            m_device->destroy(m_ds_hidden);
+            m_device->destroy(m_ds_no_write);
+            m_device->destroy(m_ds);
+            m_device->destroy(m_rs);
+        }
+        
+        // Vertex and uniform bytes written by the last render(), counted from what was actually filled in
+        // rather than the size of the mapped buffers.
+        size_t bytes_uploaded() const
+        {
+            return m_bytes_uploaded;
+        }
+        
+        // delta is the frame time in seconds, used to expire timed batches.
+        void render(Framebuffer* fbo, int width, int height, const glm::mat4& view_proj, float delta = 0.0f)
+        {
+            DW_PROFILE_SCOPE("dd::Renderer::render");
+            
+            m_uniforms.view_proj = view_proj;
+            m_uniforms.tint = glm::vec4(1.0f);
+            m_bytes_uploaded = 0;
+            
+            upload_retained();
+            
+            size_t num_vertices = m_world_vertices.size();
+            
+            for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                num_vertices += m_thread_contexts[i].m_world_vertices.size();
+            
+            void* ptr = m_device->map_buffer(m_line_vbo, BufferMapType::WRITE);
+            
+            m_batches.clear();
+            
+            if (num_vertices > MAX_VERTICES)
+                std::cout << "Vertices are above limit" << std::endl;
+            else
+            {
+                Context* contexts[MAX_THREAD_CONTEXTS + 1];
+                contexts[0] = this;
+                
+                for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                    contexts[i + 1] = &m_thread_contexts[i];
+                
+                char* end = build_batches(&contexts[0], MAX_THREAD_CONTEXTS + 1, (char*)ptr, m_batches);
+                m_bytes_uploaded += end - (char*)ptr;
+            }
+            
+            m_device->unmap_buffer(m_line_vbo);
+            
+            size_t uniform_bytes = m_uniform_uploader.m_bytes_uploaded + m_hidden_uploader.m_bytes_uploaded;
+            
+            m_uniform_uploader.set(m_uniforms);
+            m_uniform_uploader.upload(m_device, m_ubo);
+            
+            m_uniforms.tint.w = XRAY_HIDDEN_ALPHA;
+            m_hidden_uploader.set(m_uniforms);
+            m_hidden_uploader.upload(m_device, m_hidden_ubo);
+            
+            m_bytes_uploaded += m_uniform_uploader.m_bytes_uploaded + m_hidden_uploader.m_bytes_uploaded - uniform_bytes;
+            
+            m_device->bind_rasterizer_state(m_rs);
+            m_device->bind_framebuffer(fbo);
+            m_device->set_viewport(width, height, 0, 0);
+            m_device->bind_shader_program(m_line_program);
+            m_device->bind_uniform_buffer(m_ubo, ShaderType::VERTEX, 0);
+            
+            submit_batches();
+            
+            clear();
+            
+            for (int i = 0; i < MAX_THREAD_CONTEXTS; i++)
+                m_thread_contexts[i].clear();
+            
+            age_retained(delta);
+        }
+        
+    private:
+        Context* begin_retained(int frames, float seconds, bool is_static)
+        {
+            assert(!m_recording);
+            
+            m_recording = new RetainedBatch();
+            m_recording->id = m_next_retained_id++;
+            m_recording->frames = frames;
+            m_recording->seconds = seconds;
+            m_recording->is_static = is_static;
+            
+            return &m_recording->context;
+        }
+        
+        void remove_retained_at(int idx)
+        {
+            m_num_retained_vertices -= m_retained[idx]->context.m_world_vertices.size();
+            delete m_retained[idx];
+            m_retained.erase(m_retained.begin() + idx);
+            m_retained_dirty = true;
+        }
+        
+        // Called after drawing, so a batch that lives for N frames is drawn exactly N times.
+        void age_retained(float delta)
+        {
+            for (int i = (int)m_retained.size() - 1; i >= 0; i--)
+            {
+                RetainedBatch* batch = m_retained[i];
+                
+                if (batch->is_static)
+                    continue;
+                
+                bool expired = false;
+                
+                if (batch->frames > 0)
+                    expired |= --batch->frames == 0;
+                
+                if (batch->seconds > 0.0f)
+                {
+                    batch->seconds -= delta;
+                    expired |= batch->seconds <= 0.0f;
+                }
+                
+                if (expired)
+                    remove_retained_at(i);
+            }
+        }
+        
+        // The retained buffer is only re-uploaded when batches were added or removed.
+        void upload_retained()
+        {
+            if (!m_retained_dirty)
+                return;
+            
+            m_retained_dirty = false;
+            m_retained_batches.clear();
+            
+            if (m_num_retained_vertices > MAX_RETAINED_VERTICES)
+            {
+                std::cout << "Retained vertices are above limit" << std::endl;
+                return;
+            }
+            
+            std::vector<Context*> contexts(m_retained.size());
+            
+            for (int i = 0; i < m_retained.size(); i++)
+                contexts[i] = &m_retained[i]->context;
+            
+            char* dst = (char*)m_device->map_buffer(m_retained_vbo, BufferMapType::WRITE);
+            
+            if (contexts.size() > 0)
+                m_bytes_uploaded += build_batches(&contexts[0], (int)contexts.size(), dst, m_retained_batches) - dst;
+            
+            m_device->unmap_buffer(m_retained_vbo);
+        }
+        
+        char* upload(const VertexLine* src, size_t count, char* dst)
+        {
+            if (count == 0)
+                return dst;
+            
+            if (m_format == VERTEX_FORMAT_COMPACT)
+                memcpy(dst, src, sizeof(VertexLine) * count);
+            else
+            {
+                VertexWorld* vw = (VertexWorld*)dst;
+                
+                for (size_t i = 0; i < count; i++)
+                {
+                    vw[i].position = src[i].position;
+                    vw[i].uv = glm::vec2(0.0f);
+                    vw[i].color = unpack_color(src[i].color);
+                }
+            }
+            
+            return dst + m_vertex_size * count;
+        }
+        
+        // Sorts the commands of all given contexts by draw state and writes their vertices to dst in sorted
+        // order. Consecutive list primitives with the same state end up adjacent in the buffer and are merged
+        // into one batch; strips still need a batch each. Returns the end of the written vertices.
+        char* build_batches(Context** contexts, int num_contexts, char* dst, std::vector<DrawBatch>& batches)
+        {
+            // VertexWorld has no alpha, so translucent shapes stay in the opaque buckets and write depth.
+            uint32_t state_mask = m_format == VERTEX_FORMAT_COMPACT ? ~0u : ~DRAW_STATE_BLEND;
+            
+            m_sort_keys.clear();
+            m_sort_vertices.clear();
+            m_sort_commands.clear();
+            
+            for (int i = 0; i < num_contexts; i++)
+            {
+                const Context* ctx = contexts[i];
+                const VertexLine* vertices = ctx->m_world_vertices.empty() ? nullptr : &ctx->m_world_vertices[0];
+                
+                for (int j = 0; j < ctx->m_draw_commands.size(); j++)
+                {
+                    const DrawCommand& cmd = ctx->m_draw_commands[j];
+                    uint32_t state = (cmd.state & state_mask) | (uint32_t)cmd.type;
+                    
+                    m_sort_keys.push_back(((uint64_t)state << 32) | m_sort_commands.size());
+                    m_sort_vertices.push_back(vertices);
+                    m_sort_commands.push_back(&cmd);
+                    
+                    vertices += cmd.vertices;
+                }
+            }
+            
+            radix_sort_keys(m_sort_keys, m_sort_scratch);
+            
+            // Vertices of consecutive sorted commands are often adjacent in their context too, so copies are
+            // deferred until the source range breaks.
+            const VertexLine* run_begin = nullptr;
+            const VertexLine* run_end = nullptr;
+            int v = 0;
+            
+            for (size_t i = 0; i < m_sort_keys.size(); i++)
+            {
+                uint32_t state = (uint32_t)(m_sort_keys[i] >> 32);
+                uint32_t idx = (uint32_t)m_sort_keys[i];
+                const DrawCommand& cmd = *m_sort_commands[idx];
+                const VertexLine* src = m_sort_vertices[idx];
+                
+                if (src != run_end)
+                {
+                    dst = upload(run_begin, run_end - run_begin, dst);
+                    run_begin = src;
+                }
+                
+                run_end = src + cmd.vertices;
+                
+                if (!batches.empty() && batches.back().state == state && is_list(cmd.type))
+                    batches.back().count += cmd.vertices;
+                else
+                {
+                    DrawBatch batch = { state, v, cmd.vertices };
+                    batches.push_back(batch);
+                }
+                
+                v += cmd.vertices;
+            }
+            
+            return upload(run_begin, run_end - run_begin, dst);
+        }
+        
+        static bool is_list(int primitive)
+        {
+            return primitive == PrimitiveType::LINES || primitive == PrimitiveType::POINTS || primitive == PrimitiveType::TRIANGLES;
+        }
+        
+        // Immediate and retained batches are merged by state, so each bucket is finished before the next one
+        // starts regardless of which buffer its shapes live in. X-ray buckets are drawn a second time with a
+        // depth test that only passes behind the scene, blended and faded through the hidden uniforms.
+        void submit_batches()
+        {
+            size_t i = 0;
+            size_t j = 0;
+            VertexArray* bound = nullptr;
+            
+            while (i < m_batches.size() || j < m_retained_batches.size())
+            {
+                uint32_t state;
+                
+                if (j == m_retained_batches.size() || (i < m_batches.size() && m_batches[i].state <= m_retained_batches[j].state))
+                    state = m_batches[i].state;
+                else
+                    state = m_retained_batches[j].state;
+                
+                size_t i_end = i;
+                size_t j_end = j;
+                
+                while (i_end < m_batches.size() && m_batches[i_end].state == state)
+                    i_end++;
+                
+                while (j_end < m_retained_batches.size() && m_retained_batches[j_end].state == state)
+                    j_end++;
+                
+                int passes = draw_state_depth_mode(state) == DEPTH_MODE_XRAY ? 2 : 1;
+                
+                for (int pass = 0; pass < passes; pass++)
+                {
+                    bind_draw_state(state, pass == 1);
+                    
+                    if (pass == 1)
+                        m_device->bind_uniform_buffer(m_hidden_ubo, ShaderType::VERTEX, 0);
+                    
+                    submit(m_line_vao, m_batches, i, i_end, bound);
+                    submit(m_retained_vao, m_retained_batches, j, j_end, bound);
+                }
+                
+                if (passes == 2)
+                    m_device->bind_uniform_buffer(m_ubo, ShaderType::VERTEX, 0);
+                
+                i = i_end;
+                j = j_end;
+            }
+        }
+        
+        void submit(VertexArray* vao, const std::vector<DrawBatch>& batches, size_t first, size_t last, VertexArray*& bound)
+        {
+            if (first == last)
+                return;
+            
+            if (bound != vao)
+            {
+                m_device->bind_vertex_array(vao);
+                bound = vao;
+            }
+            
+            for (size_t i = first; i < last; i++)
+                m_device->draw(batches[i].first, batches[i].count);
+        }
+        
+        void bind_draw_state(uint32_t state, bool hidden)
+        {
+            DepthMode mode = draw_state_depth_mode(state);
+            bool blend = (state & DRAW_STATE_BLEND) != 0 || hidden;
+            DepthStencilState* ds;
+            
+            if (mode == DEPTH_MODE_OVERLAY)
+                ds = m_ds_overlay;
+            else if (hidden)
+                ds = m_ds_hidden;
+            else
+                ds = blend ? m_ds_no_write : m_ds;
+            
+            m_device->bind_depth_stencil_state(ds);
+            m_device->bind_blend_state(blend ? m_bs_alpha : m_bs_opaque);
+            m_device->set_primitive_type(state & DRAW_STATE_PRIMITIVE_MASK);
+        }
+    };
+    
+    typedef BasicRenderer<RenderDevice> Renderer;
+}
+
+// Read-only memory mapping of a whole file. Pages are only read from disk when touched, and release()
+// hands them back to the OS so the resident set stays bounded while streaming.
+struct MappedFile
+{
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_fd = -1;
+#endif
+    
+    bool open(const char* path)
+    {
+#if defined(_WIN32)
+        m_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+        
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+        
+        LARGE_INTEGER size;
+        
+        if (!GetFileSizeEx(m_file, &size))
+        {
+            close();
+            return false;
+        }
+        
+        m_size = (size_t)size.QuadPart;
+        
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        
+        if (!m_mapping)
+        {
+            close();
+            return false;
+        }
+        
+        m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        m_fd = ::open(path, O_RDONLY);
+        
+        if (m_fd < 0)
+            return false;
+        
+        struct stat st;
+        
+        if (fstat(m_fd, &st) != 0)
+        {
+            close();
+            return false;
+        }
+        
+        m_size = (size_t)st.st_size;
+        
+        void* ptr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        m_data = ptr == MAP_FAILED ? nullptr : (const uint8_t*)ptr;
+#endif
+        if (!m_data)
+        {
+            close();
+            return false;
+        }
+        
+        return true;
+    }
+    
+    void close()
+    {
+#if defined(_WIN32)
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data)
+            munmap((void*)m_data, m_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        
+        m_fd = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+    
+    // Virtual memory page size, queried once.
+    static size_t page_size()
+    {
+        static const size_t size = []()
+        {
+#if defined(_WIN32)
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return (size_t)info.dwPageSize;
+#else
+            long size = sysconf(_SC_PAGESIZE);
+            return size > 0 ? (size_t)size : (size_t)4096;
+#endif
+        }();
+        
+        return size;
+    }
+    
+    // Only whole pages inside the range are released.
+    void release(size_t offset, size_t size)
+    {
+        size_t page = page_size();
+        size_t end = (offset + size) & ~(page - 1);
+        
+        offset = (offset + page - 1) & ~(page - 1);
+        
+        if (end <= offset)
+            return;
+        
+        size = end - offset;
+        
+#if defined(_WIN32)
+        VirtualUnlock((void*)(m_data + offset), size);
+#else
+        // glibc implements posix_madvise(POSIX_MADV_DONTNEED) as a no-op, madvise actually drops the pages.
+        madvise((void*)(m_data + offset), size, MADV_DONTNEED);
+#endif
+    }
+};
+
+#define HEIGHTMAP_MAGIC 0x54484d44 // "DMHT"
+#define HEIGHTMAP_VERSION 3
+#define HEIGHTMAP_MIN_ALIGNMENT 4096
+#define HEIGHTMAP_MAX_TILE_SIZE 4096
+#define HEIGHTMAP_OVERVIEW_SIZE 1024
+
+// Tiled heightmap file layout:
+//
+// HeightmapHeader
+// HeightmapTileEntry[tiles_x * tiles_z]
+// Overview:     overview_width * overview_height samples of the whole map, box filtered.
+// Tiles:        (tile_size + 1)^2 samples each, row-major. The extra row and column duplicate the first
+//               samples of the next tile (clamped at the map edge) so tiles can be filtered seamlessly.
+//               Stored as is or delta compressed, depending on compression.
+//
+// The overview and every uncompressed tile start at a boundary of the writer's page size, and at least
+// HEIGHTMAP_MIN_ALIGNMENT, so they can be released page-wise. A reader with larger pages still works but
+// releases less. Compressed tiles are packed back to back.
+struct HeightmapHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint32_t tiles_x;
+    uint32_t tiles_z;
+    uint32_t overview_width;
+    uint32_t overview_height;
+    uint32_t compression;
+    uint64_t overview_offset;
+};
+
+// min_height and max_height bound the tile's samples, so coarse nodes get exact bounds without
+// touching the tile data.
+struct HeightmapTileEntry
+{
+    uint64_t offset;
+    uint64_t size;
+    uint16_t min_height;
+    uint16_t max_height;
+    uint32_t reserved;
+};
+
+#define HEIGHTMAP_COMPRESSION_NONE 0
+#define HEIGHTMAP_COMPRESSION_DELTA 1
+#define HEIGHTMAP_BLOCK_SIZE 16
+
+// Delta compressed tiles store every row as its difference to the row above (zero above the first
+// row) in blocks of HEIGHTMAP_BLOCK_SIZE samples. A block is a mode byte, a little endian int16 base and
+// the block's differences minus the base packed at 0, 4, 8 or 16 bits. Smooth terrain lands mostly in
+// the 4 and 8 bit modes, and decoding a block is a widen and two adds.
+enum HeightmapBlockMode
+{
+    HEIGHTMAP_BLOCK_CONSTANT,
+    HEIGHTMAP_BLOCK_4BIT,
+    HEIGHTMAP_BLOCK_8BIT,
+    HEIGHTMAP_BLOCK_16BIT
+};
+
+static const int kHeightmapBlockPayload[] = { 0, 8, 16, 32 };
+
+// Appends the delta compressed form of a width x height tile to out.
+inline void encode_heightmap_tile(const uint16_t* samples, int width, int height, std::vector<uint8_t>& out)
+{
+    for (int z = 0; z < height; z++)
+    {
+        for (int x0 = 0; x0 < width; x0 += HEIGHTMAP_BLOCK_SIZE)
+        {
+            int count = glm::min(width - x0, HEIGHTMAP_BLOCK_SIZE);
+            int16_t residuals[HEIGHTMAP_BLOCK_SIZE];
+            uint16_t deltas[HEIGHTMAP_BLOCK_SIZE] = {};
+            int16_t base = INT16_MAX;
+            uint16_t range = 0;
+            
+            for (int i = 0; i < count; i++)
+            {
+                uint16_t above = z > 0 ? samples[(z - 1) * width + x0 + i] : 0;
+                residuals[i] = (int16_t)(uint16_t)(samples[z * width + x0 + i] - above);
+                base = glm::min(base, residuals[i]);
+            }
+            
+            // Padding past the end of the row decodes to the base and is dropped.
+            for (int i = 0; i < count; i++)
+            {
+                deltas[i] = (uint16_t)(residuals[i] - base);
+                range = glm::max(range, deltas[i]);
+            }
+            
+            uint8_t mode = HEIGHTMAP_BLOCK_16BIT;
+            
+            if (range == 0)
+                mode = HEIGHTMAP_BLOCK_CONSTANT;
+            else if (range < 16)
+                mode = HEIGHTMAP_BLOCK_4BIT;
+            else if (range < 256)
+                mode = HEIGHTMAP_BLOCK_8BIT;
+            
+            out.push_back(mode);
+            out.push_back((uint8_t)((uint16_t)base & 0xFF));
+            out.push_back((uint8_t)((uint16_t)base >> 8));
+            
+            for (int i = 0; i < HEIGHTMAP_BLOCK_SIZE; i++)
+            {
+                if (mode == HEIGHTMAP_BLOCK_4BIT && (i & 1))
+                    out.push_back((uint8_t)(deltas[i - 1] | (deltas[i] << 4)));
+                else if (mode == HEIGHTMAP_BLOCK_8BIT)
+                    out.push_back((uint8_t)deltas[i]);
+                else if (mode == HEIGHTMAP_BLOCK_16BIT)
+                {
+                    out.push_back((uint8_t)(deltas[i] & 0xFF));
+                    out.push_back((uint8_t)(deltas[i] >> 8));
+                }
+            }
+        }
+    }
+}
+
+inline void decode_heightmap_block(int mode, uint16_t base, const uint8_t* payload, const uint16_t* above, uint16_t* out)
+{
+#if defined(DW_SIMD_SSE2)
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = zero;
+    __m128i hi = zero;
+    
+    if (mode == HEIGHTMAP_BLOCK_4BIT)
+    {
+        __m128i packed = _mm_loadl_epi64((const __m128i*)payload);
+        __m128i mask = _mm_set1_epi8(0x0F);
+        __m128i bytes = _mm_unpacklo_epi8(_mm_and_si128(packed, mask), _mm_and_si128(_mm_srli_epi16(packed, 4), mask));
+        
+        lo = _mm_unpacklo_epi8(bytes, zero);
+        hi = _mm_unpackhi_epi8(bytes, zero);
+    }
+    else if (mode == HEIGHTMAP_BLOCK_8BIT)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)payload);
+        
+        lo = _mm_unpacklo_epi8(bytes, zero);
+        hi = _mm_unpackhi_epi8(bytes, zero);
+    }
+    else if (mode == HEIGHTMAP_BLOCK_16BIT)
+    {
+        lo = _mm_loadu_si128((const __m128i*)payload);
+        hi = _mm_loadu_si128((const __m128i*)(payload + 16));
+    }
+    
+    __m128i b = _mm_set1_epi16((short)base);
+    
+    _mm_storeu_si128((__m128i*)out, _mm_add_epi16(_mm_add_epi16(lo, b), _mm_loadu_si128((const __m128i*)above)));
+    _mm_storeu_si128((__m128i*)(out + 8), _mm_add_epi16(_mm_add_epi16(hi, b), _mm_loadu_si128((const __m128i*)(above + 8))));
+#else
+    for (int i = 0; i < HEIGHTMAP_BLOCK_SIZE; i++)
+    {
+        uint16_t delta = 0;
+        
+        if (mode == HEIGHTMAP_BLOCK_4BIT)
+            delta = (payload[i / 2] >> ((i & 1) * 4)) & 0x0F;
+        else if (mode == HEIGHTMAP_BLOCK_8BIT)
+            delta = payload[i];
+        else if (mode == HEIGHTMAP_BLOCK_16BIT)
+            delta = payload[2 * i] | (payload[2 * i + 1] << 8);
+        
+        out[i] = (uint16_t)(above[i] + base + delta);
+    }
+#endif
+}
+
+// Decodes a tile written by encode_heightmap_tile(). Returns false if the data is truncated or corrupt.
+inline bool decode_heightmap_tile(const uint8_t* data, size_t size, int width, int height, uint16_t* samples)
+{
+    const int stride = (width + HEIGHTMAP_BLOCK_SIZE - 1) / HEIGHTMAP_BLOCK_SIZE * HEIGHTMAP_BLOCK_SIZE;
+    const uint8_t* end = data + size;
+    
+    std::vector<uint16_t> rows(2 * stride, 0);
+    uint16_t* above = &rows[0];
+    uint16_t* row = &rows[stride];
+    
+    for (int z = 0; z < height; z++)
+    {
+        for (int x = 0; x < stride; x += HEIGHTMAP_BLOCK_SIZE)
+        {
+            if (end - data < 3 || data[0] > HEIGHTMAP_BLOCK_16BIT || end - data < 3 + kHeightmapBlockPayload[data[0]])
+                return false;
+            
+            decode_heightmap_block(data[0], data[1] | (data[2] << 8), data + 3, above + x, row + x);
+            data += 3 + kHeightmapBlockPayload[data[0]];
+        }
+        
+        memcpy(samples + z * width, row, sizeof(uint16_t) * width);
+        std::swap(above, row);
+    }
+    
+    return true;
+}
+
+struct TiledHeightmap
+{
+    MappedFile m_file;
+    const HeightmapHeader* m_header = nullptr;
+    const HeightmapTileEntry* m_tiles = nullptr;
+    
+    bool open(const char* path)
+    {
+        if (!m_file.open(path))
+            return false;
+        
+        m_header = (const HeightmapHeader*)m_file.m_data;
+        m_tiles = (const HeightmapTileEntry*)(m_file.m_data + sizeof(HeightmapHeader));
+        
+        if (!validate())
+        {
+            close();
+            return false;
+        }
+        
+        return true;
+    }
+    
+    // Checks every offset and size in the header and tile table against the file size, so a truncated or
+    // corrupt file is rejected here instead of faulting on a read past the mapping.
+    bool validate() const
+    {
+        const uint64_t file_size = m_file.m_size;
+        
+        if (file_size < sizeof(HeightmapHeader) || m_header->magic != HEIGHTMAP_MAGIC || m_header->version != HEIGHTMAP_VERSION)
+            return false;
+        
+        const HeightmapHeader& header = *m_header;
+        
+        if (header.width == 0 || header.height == 0 || header.tile_size == 0 || header.tile_size > HEIGHTMAP_MAX_TILE_SIZE)
+            return false;
+        
+        if (header.tiles_x != (header.width + (uint64_t)header.tile_size - 1) / header.tile_size ||
+            header.tiles_z != (header.height + (uint64_t)header.tile_size - 1) / header.tile_size)
+            return false;
+        
+        if (header.compression != HEIGHTMAP_COMPRESSION_NONE && header.compression != HEIGHTMAP_COMPRESSION_DELTA)
+            return false;
+        
+        uint64_t table_end = sizeof(HeightmapHeader) + sizeof(HeightmapTileEntry) * (uint64_t)header.tiles_x * header.tiles_z;
+        
+        if (table_end > file_size)
+            return false;
+        
+        if (header.overview_width == 0 || header.overview_height == 0 ||
+            header.overview_width > HEIGHTMAP_OVERVIEW_SIZE || header.overview_height > HEIGHTMAP_OVERVIEW_SIZE)
+            return false;
+        
+        uint64_t overview_size = sizeof(uint16_t) * (uint64_t)header.overview_width * header.overview_height;
+        
+        if (header.overview_offset < table_end || header.overview_offset % sizeof(uint16_t) != 0 ||
+            header.overview_offset > file_size || overview_size > file_size - header.overview_offset)
+            return false;
+        
+        uint64_t tile_bytes = sizeof(uint16_t) * (uint64_t)tile_samples() * tile_samples();
+        
+        for (uint64_t i = 0; i < (uint64_t)header.tiles_x * header.tiles_z; i++)
+        {
+            const HeightmapTileEntry& entry = m_tiles[i];
+            
+            if (entry.offset < table_end || entry.offset > file_size || entry.size > file_size - entry.offset)
+                return false;
+            
+            if (header.compression == HEIGHTMAP_COMPRESSION_NONE && (entry.size != tile_bytes || entry.offset % sizeof(uint16_t) != 0))
+                return false;
+        }
+        
+        return true;
+    }
+    
+    void close()
+    {
+        m_file.close();
+        m_header = nullptr;
+        m_tiles = nullptr;
+    }
+    
+    int tile_samples() const
+    {
+        return m_header->tile_size + 1;
+    }
+    
+    const uint16_t* overview() const
+    {
+        return (const uint16_t*)(m_file.m_data + m_header->overview_offset);
+    }
+    
+    // Copies or decodes a tile into tile_samples()^2 samples.
+    bool read_tile(int x, int z, uint16_t* samples) const
+    {
+        const HeightmapTileEntry& entry = m_tiles[z * m_header->tiles_x + x];
+        
+        if (m_header->compression == HEIGHTMAP_COMPRESSION_DELTA)
+            return decode_heightmap_tile(m_file.m_data + entry.offset, entry.size, tile_samples(), tile_samples(), samples);
+        
+        memcpy(samples, m_file.m_data + entry.offset, entry.size);
+        
+        return true;
+    }
+    
+    void release_tile(int x, int z)
+    {
+        const HeightmapTileEntry& entry = m_tiles[z * m_header->tiles_x + x];
+        m_file.release(entry.offset, entry.size);
+    }
+};
+
+inline uint64_t heightmap_alignment()
+{
+    return glm::max((uint64_t)HEIGHTMAP_MIN_ALIGNMENT, (uint64_t)MappedFile::page_size());
+}
+
+inline bool write_padding(FILE* file, uint64_t& offset)
+{
+    static const char zeros[HEIGHTMAP_MIN_ALIGNMENT] = {};
+    uint64_t alignment = heightmap_alignment();
+    uint64_t padding = (alignment - offset % alignment) % alignment;
+    
+    offset += padding;
+    
+    for (; padding > 0; padding -= glm::min(padding, (uint64_t)HEIGHTMAP_MIN_ALIGNMENT))
+    {
+        size_t size = (size_t)glm::min(padding, (uint64_t)HEIGHTMAP_MIN_ALIGNMENT);
+        
+        if (fwrite(zeros, 1, size, file) != size)
+            return false;
+    }
+    
+    return true;
+}
+
+// Converts a raw 16 bit heightmap into the tiled format read by TiledHeightmap. Returns false, and
+// removes the partial file, if any write fails.
+inline bool write_tiled_heightmap(const char* path, const uint16_t* samples, int width, int height, int tile_size, int compression = HEIGHTMAP_COMPRESSION_DELTA)
+{
+    FILE* filePtr = fopen(path, "wb");
+    
+    if (!filePtr)
+        return false;
+    
+    HeightmapHeader header;
+    DW_ZERO_MEMORY(header);
+    
+    int step = (glm::max(width, height) + HEIGHTMAP_OVERVIEW_SIZE - 1) / HEIGHTMAP_OVERVIEW_SIZE;
+    
+    header.magic = HEIGHTMAP_MAGIC;
+    header.version = HEIGHTMAP_VERSION;
+    header.width = width;
+    header.height = height;
+    header.tile_size = tile_size;
+    header.tiles_x = (width + tile_size - 1) / tile_size;
+    header.tiles_z = (height + tile_size - 1) / tile_size;
+    header.overview_width = (width + step - 1) / step;
+    header.overview_height = (height + step - 1) / step;
+    header.compression = compression;
+    
+    std::vector<HeightmapTileEntry> entries(header.tiles_x * header.tiles_z);
+    uint64_t offset = sizeof(HeightmapHeader) + sizeof(HeightmapTileEntry) * entries.size();
+    
+    offset += (heightmap_alignment() - offset % heightmap_alignment()) % heightmap_alignment();
+    header.overview_offset = offset;
+    
+    // The tile table is written again at the end, once the tile sizes are known.
+    memset(&entries[0], 0, sizeof(HeightmapTileEntry) * entries.size());
+    
+    bool ok = fwrite(&header, sizeof(HeightmapHeader), 1, filePtr) == 1 &&
+              fwrite(&entries[0], sizeof(HeightmapTileEntry), entries.size(), filePtr) == entries.size();
+    
+    offset = sizeof(HeightmapHeader) + sizeof(HeightmapTileEntry) * entries.size();
+    ok = ok && write_padding(filePtr, offset);
+    
+    std::vector<uint16_t> data(header.overview_width * header.overview_height);
+    
+    for (int z = 0; z < header.overview_height; z++)
+    {
+        for (int x = 0; x < header.overview_width; x++)
+        {
+            uint32_t sum = 0;
+            uint32_t count = 0;
+            
+            for (int sz = z * step; sz < glm::min((z + 1) * step, height); sz++)
+            {
+                for (int sx = x * step; sx < glm::min((x + 1) * step, width); sx++, count++)
+                    sum += samples[sz * width + sx];
+            }
+            
+            data[z * header.overview_width + x] = (uint16_t)(sum / count);
+        }
+    }
+    
+    ok = ok && fwrite(&data[0], sizeof(uint16_t), data.size(), filePtr) == data.size();
+    offset += sizeof(uint16_t) * data.size();
+    
+    data.resize((tile_size + 1) * (tile_size + 1));
+    std::vector<uint8_t> encoded;
+    
+    for (int tz = 0; ok && tz < header.tiles_z; tz++)
+    {
+        for (int tx = 0; ok && tx < header.tiles_x; tx++)
+        {
+            HeightmapTileEntry& entry = entries[tz * header.tiles_x + tx];
+            
+            entry.min_height = 0xFFFF;
+            entry.max_height = 0;
+            
+            for (int z = 0; z <= tile_size; z++)
+            {
+                int sz = glm::min(tz * tile_size + z, height - 1);
+                
+                for (int x = 0; x <= tile_size; x++)
+                {
+                    int sx = glm::min(tx * tile_size + x, width - 1);
+                    uint16_t sample = samples[sz * width + sx];
+                    
+                    data[z * (tile_size + 1) + x] = sample;
+                    entry.min_height = glm::min(entry.min_height, sample);
+                    entry.max_height = glm::max(entry.max_height, sample);
+                }
+            }
+            
+            if (compression == HEIGHTMAP_COMPRESSION_DELTA)
+            {
+                encoded.clear();
+                encode_heightmap_tile(&data[0], tile_size + 1, tile_size + 1, encoded);
+                
+                entry.offset = offset;
+                entry.size = encoded.size();
+                ok = fwrite(&encoded[0], 1, encoded.size(), filePtr) == encoded.size();
+            }
+            else
+            {
+                ok = write_padding(filePtr, offset);
+                
+                entry.offset = offset;
+                entry.size = sizeof(uint16_t) * data.size();
+                ok = ok && fwrite(&data[0], sizeof(uint16_t), data.size(), filePtr) == data.size();
+            }
+            
+            offset += entry.size;
+        }
+    }
+    
+    ok = ok && fseek(filePtr, sizeof(HeightmapHeader), SEEK_SET) == 0 &&
+         fwrite(&entries[0], sizeof(HeightmapTileEntry), entries.size(), filePtr) == entries.size();
+    ok = fclose(filePtr) == 0 && ok;
+    
+    if (!ok)
+        remove(path);
+    
+    return ok;
+}
+
+#if defined(DW_SIMD_SSE2)
+// SSE2 has no unsigned 16 bit min/max, so samples are biased into the signed range around them.
+inline __m128i bias_u16(__m128i v)
+{
+    return _mm_xor_si128(v, _mm_set1_epi16((short)0x8000));
+}
+
+// Packs the even 16 bit lanes of two biased vectors into one.
+inline __m128i pack_even_i16(__m128i a, __m128i b)
+{
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    return _mm_packs_epi32(a, b);
+}
+#endif
+
+// Four rays traced through a HeightPyramid together. Lanes past the packet's ray count start with a
+// negative t so they never hit anything.
+struct RayPacket
+{
+    alignas(16) float ox[4];
+    alignas(16) float oy[4];
+    alignas(16) float oz[4];
+    alignas(16) float dx[4];
+    alignas(16) float dy[4];
+    alignas(16) float dz[4];
+    alignas(16) float inv_x[4];
+    alignas(16) float inv_y[4];
+    alignas(16) float inv_z[4];
+    alignas(16) float t[4]; // Closest hit so far, or the maximum distance until there is one.
+    bool hit[4];
+    
+    void set(int i, const glm::vec3& origin, const glm::vec3& direction, float max_t)
+    {
+        ox[i] = origin.x;
+        oy[i] = origin.y;
+        oz[i] = origin.z;
+        dx[i] = direction.x;
+        dy[i] = direction.y;
+        dz[i] = direction.z;
+        
+        // Avoids 0 * inf in the slab tests for axis aligned rays.
+        inv_x[i] = 1.0f / (fabsf(direction.x) > 1e-20f ? direction.x : 1e-20f);
+        inv_y[i] = 1.0f / (fabsf(direction.y) > 1e-20f ? direction.y : 1e-20f);
+        inv_z[i] = 1.0f / (fabsf(direction.z) > 1e-20f ? direction.z : 1e-20f);
+        
+        t[i] = max_t;
+        hit[i] = false;
+    }
+    
+    // Bit i is set when ray i enters the box before its closest hit so far.
+    int intersect_box(float x0, float y0, float z0, float x1, float y1, float z1) const
+    {
+#if defined(DW_SIMD_SSE)
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(x0), _mm_load_ps(ox)), _mm_load_ps(inv_x));
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(x1), _mm_load_ps(ox)), _mm_load_ps(inv_x));
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(y0), _mm_load_ps(oy)), _mm_load_ps(inv_y));
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(y1), _mm_load_ps(oy)), _mm_load_ps(inv_y));
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(z0), _mm_load_ps(oz)), _mm_load_ps(inv_z));
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(z1), _mm_load_ps(oz)), _mm_load_ps(inv_z));
+        
+        __m128 t_near = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+        __m128 t_far = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_load_ps(t)));
+        
+        return _mm_movemask_ps(_mm_cmple_ps(t_near, t_far));
+#else
+        int mask = 0;
+        
+        for (int i = 0; i < 4; i++)
+        {
+            float tx0 = (x0 - ox[i]) * inv_x[i];
+            float tx1 = (x1 - ox[i]) * inv_x[i];
+            float ty0 = (y0 - oy[i]) * inv_y[i];
+            float ty1 = (y1 - oy[i]) * inv_y[i];
+            float tz0 = (z0 - oz[i]) * inv_z[i];
+            float tz1 = (z1 - oz[i]) * inv_z[i];
+            
+            float t_near = glm::max(glm::max(glm::min(tx0, tx1), glm::min(ty0, ty1)), glm::max(glm::min(tz0, tz1), 0.0f));
+            float t_far = glm::min(glm::min(glm::max(tx0, tx1), glm::max(ty0, ty1)), glm::min(glm::max(tz0, tz1), t[i]));
+            
+            if (t_near <= t_far)
+                mask |= 1 << i;
+        }
+        
+        return mask;
+#endif
+    }
+};
+
+inline float half_to_float(uint16_t half)
+{
+    int exponent = (half >> 10) & 0x1F;
+    float mantissa = (float)(half & 0x3FF);
+    float value = exponent == 0 ? ldexpf(mantissa, -24) : ldexpf(1024.0f + mantissa, exponent - 25);
+    
+    return half & 0x8000 ? -value : value;
+}
+
+// Heightmap samples are UNORM16 fractions of the terrain scale, but height textures are R16_FLOAT. Maps a
+// sample to the half float closest to sample / 65535. The mapping is monotonic, so min/max bounds carry
+// over, and half_to_float() of the result is exactly what the shader reads.
+inline uint16_t unorm16_to_half(uint16_t sample)
+{
+    static const std::vector<uint16_t> table = []()
+    {
+        std::vector<uint16_t> table(65536);
+        uint16_t half = 0;
+        
+        // Halves between 0 and 1 (0x3C00) are ordered like their bit patterns.
+        for (uint32_t i = 0; i < 65536; i++)
+        {
+            float value = i / 65535.0f;
+            
+            while (half < 0x3C00 && half_to_float(half + 1) <= value)
+                half++;
+            
+            bool next_closer = half < 0x3C00 && half_to_float(half + 1) - value < value - half_to_float(half);
+            table[i] = next_closer ? half + 1 : half;
+        }
+        
+        return table;
+    }();
+    
+    return table[sample];
+}
+
+// Min/max height pyramid over heightmap cells plus box filtered mips of the samples. A cell spans the
+// 2x2 samples at its corners, so the bounds of level 0 also bound the bilinear surface between samples,
+// and every level above halves the cell count per axis. The full resolution samples are kept for CPU
+// height queries.
+struct HeightPyramid
+{
+    struct Level
+    {
+        int                   width;
+        int                   height;
+        std::vector<uint16_t> min;
+        std::vector<uint16_t> max;
+    };
+    
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<uint16_t> m_samples;
+    std::vector<Level> m_levels;
+    std::vector<std::vector<uint16_t>> m_mips;
+    
+    // Takes ownership of the samples.
+    void build(std::vector<uint16_t>& samples, int width, int height)
+    {
+        DW_PROFILE_SCOPE("HeightPyramid::build");
+        
+        m_width = width;
+        m_height = height;
+        m_samples.swap(samples);
+        m_levels.clear();
+        m_mips.clear();
+        
+        if (width < 2 || height < 2)
+            return;
+        
+        Level level;
+        level.width = width - 1;
+        level.height = height - 1;
+        level.min.resize(level.width * level.height);
+        level.max.resize(level.width * level.height);
+        
+        for (int z = 0; z < level.height; z++)
+            reduce_cells(&m_samples[z * width], &m_samples[(z + 1) * width], level.width, &level.min[z * level.width], &level.max[z * level.width]);
+        
+        m_levels.push_back(level);
+        
+        while (m_levels.back().width > 1 || m_levels.back().height > 1)
+        {
+            const Level& prev = m_levels.back();
+            
+            level.width = (prev.width + 1) / 2;
+            level.height = (prev.height + 1) / 2;
+            level.min.resize(level.width * level.height);
+            level.max.resize(level.width * level.height);
+            
+            for (int z = 0; z < level.height; z++)
+            {
+                int z0 = 2 * z;
+                int z1 = glm::min(2 * z + 1, prev.height - 1);
+                
+                reduce_level(&prev.min[z0 * prev.width], &prev.min[z1 * prev.width], prev.width, &level.min[z * level.width], true);
+                reduce_level(&prev.max[z0 * prev.width], &prev.max[z1 * prev.width], prev.width, &level.max[z * level.width], false);
+            }
+            
+            m_levels.push_back(level);
+        }
+        
+        int mip_width = width;
+        int mip_height = height;
+        const uint16_t* src = &m_samples[0];
+        
+        while (mip_width > 1 || mip_height > 1)
+        {
+            int w = glm::max(mip_width / 2, 1);
+            int h = glm::max(mip_height / 2, 1);
+            
+            m_mips.push_back(std::vector<uint16_t>(w * h));
+            std::vector<uint16_t>& mip = m_mips.back();
+            
+            for (int z = 0; z < h; z++)
+            {
+                const uint16_t* row0 = src + glm::min(2 * z, mip_height - 1) * mip_width;
+                const uint16_t* row1 = src + glm::min(2 * z + 1, mip_height - 1) * mip_width;
+                
+                average_rows(row0, row1, mip_width, w, &mip[z * w]);
+            }
+            
+            src = &mip[0];
+            mip_width = w;
+            mip_height = h;
+        }
+    }
+    
+    // Bounds of the surface over the sample rectangle [x0, x1] x [z0, z1]. Looks at no more than 3x3
+    // cells of the first level coarse enough to cover the rectangle that way.
+    bool range(float x0, float z0, float x1, float z1, uint16_t& min, uint16_t& max) const
+    {
+        if (m_levels.empty())
+            return false;
+        
+        const Level& base = m_levels[0];
+        
+        int cx0 = glm::clamp((int)floorf(x0), 0, base.width - 1);
+        int cz0 = glm::clamp((int)floorf(z0), 0, base.height - 1);
+        int cx1 = glm::clamp((int)ceilf(x1) - 1, cx0, base.width - 1);
+        int cz1 = glm::clamp((int)ceilf(z1) - 1, cz0, base.height - 1);
+        
+        int extent = glm::max(cx1 - cx0, cz1 - cz0) + 1;
+        int l = 0;
+        
+        while ((extent >> l) > 2 && l + 1 < m_levels.size())
+            l++;
+        
+        const Level& level = m_levels[l];
+        
+        min = 0xFFFF;
+        max = 0;
+        
+        for (int z = cz0 >> l; z <= (cz1 >> l); z++)
+        {
+            for (int x = cx0 >> l; x <= (cx1 >> l); x++)
+            {
+                min = glm::min(min, level.min[z * level.width + x]);
+                max = glm::max(max, level.max[z * level.width + x]);
+            }
+        }
+        
+        return true;
+    }
+    
+    // Bilinearly filtered height in sample units at fractional sample coordinates, clamped to the map.
+    float height_at(float x, float z) const
+    {
+        if (m_samples.empty())
+            return 0.0f;
+        
+        x = glm::clamp(x, 0.0f, m_width - 1.0f);
+        z = glm::clamp(z, 0.0f, m_height - 1.0f);
+        
+        int x0 = glm::min((int)x, glm::max(m_width - 2, 0));
+        int z0 = glm::min((int)z, glm::max(m_height - 2, 0));
+        int x1 = glm::min(x0 + 1, m_width - 1);
+        int z1 = glm::min(z0 + 1, m_height - 1);
+        float fx = x - x0;
+        float fz = z - z0;
+        
+        float h0 = glm::mix((float)m_samples[z0 * m_width + x0], (float)m_samples[z0 * m_width + x1], fx);
+        float h1 = glm::mix((float)m_samples[z1 * m_width + x0], (float)m_samples[z1 * m_width + x1], fx);
+        
+        return glm::mix(h0, h1, fz);
+    }
+    
+    // Finds the closest hit of each ray with the bilinear surface, in sample space with heights in sample
+    // units. The quadtree is walked once for the whole packet, skipping nodes whose bounds no ray can
+    // reach before its closest hit so far.
+    void raycast(RayPacket& packet) const
+    {
+        if (m_levels.empty())
+            return;
+        
+        struct Node
+        {
+            int level;
+            int x;
+            int z;
+        };
+        
+        Node stack[4 * 32];
+        int top = 0;
+        
+        stack[top++] = { (int)m_levels.size() - 1, 0, 0 };
+        
+        // Children are visited near to far along the first ray, which keeps the closest hit tight for
+        // coherent packets.
+        int sx = packet.dx[0] < 0.0f ? 1 : 0;
+        int sz = packet.dz[0] < 0.0f ? 1 : 0;
+        const int order[4][2] = { { 1 - sx, 1 - sz }, { sx, 1 - sz }, { 1 - sx, sz }, { sx, sz } };
+        
+        while (top > 0)
+        {
+            Node node = stack[--top];
+            const Level& level = m_levels[node.level];
+            int i = node.z * level.width + node.x;
+            
+            float x0 = (float)(node.x << node.level);
+            float z0 = (float)(node.z << node.level);
+            float x1 = (float)glm::min((node.x + 1) << node.level, m_levels[0].width);
+            float z1 = (float)glm::min((node.z + 1) << node.level, m_levels[0].height);
+            
+            int mask = packet.intersect_box(x0, level.min[i], z0, x1, level.max[i], z1);
+            
+            if (!mask)
+                continue;
+            
+            if (node.level == 0)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    if (mask & (1 << j))
+                        intersect_cell(packet, j, node.x, node.z);
+                }
+                
+                continue;
+            }
+            
+            const Level& child_level = m_levels[node.level - 1];
+            
+            // Pushed far to near so the nearest child is popped first.
+            for (int j = 0; j < 4; j++)
+            {
+                int cx = 2 * node.x + order[j][0];
+                int cz = 2 * node.z + order[j][1];
+                
+                if (cx < child_level.width && cz < child_level.height)
+                    stack[top++] = { node.level - 1, cx, cz };
+            }
+        }
+    }
+    
+    // Along a ray the bilinear surface of a cell is quadratic in t, so the hit is the first root of
+    // ray height minus surface height inside the cell.
+    void intersect_cell(RayPacket& packet, int i, int x, int z) const
+    {
+        float tx0 = (x - packet.ox[i]) * packet.inv_x[i];
+        float tx1 = (x + 1 - packet.ox[i]) * packet.inv_x[i];
+        float tz0 = (z - packet.oz[i]) * packet.inv_z[i];
+        float tz1 = (z + 1 - packet.oz[i]) * packet.inv_z[i];
+        
+        float t_near = glm::max(glm::max(glm::min(tx0, tx1), glm::min(tz0, tz1)), 0.0f);
+        float t_far = glm::min(glm::min(glm::max(tx0, tx1), glm::max(tz0, tz1)), packet.t[i]);
+        
+        if (t_near > t_far)
+            return;
+        
+        float h00 = m_samples[z * m_width + x];
+        float h10 = m_samples[z * m_width + x + 1];
+        float h01 = m_samples[(z + 1) * m_width + x];
+        float h11 = m_samples[(z + 1) * m_width + x + 1];
+        
+        float a = h10 - h00;
+        float b = h01 - h00;
+        float c = h00 - h10 - h01 + h11;
+        
+        // Solved relative to the entry point to keep the coefficients small.
+        float du = packet.dx[i];
+        float dv = packet.dz[i];
+        float u = packet.ox[i] + du * t_near - x;
+        float v = packet.oz[i] + dv * t_near - z;
+        float y = packet.oy[i] + packet.dy[i] * t_near;
+        
+        float qa = -c * du * dv;
+        float qb = packet.dy[i] - (a * du + b * dv + c * (u * dv + v * du));
+        float qc = y - (h00 + a * u + b * v + c * u * v);
+        float length = t_far - t_near;
+        float s = -1.0f;
+        
+        if (qc <= 0.0f)
+            s = 0.0f;
+        else if (fabsf(qa) < 1e-6f)
+        {
+            if (qb < 0.0f)
+                s = -qc / qb;
+        }
+        else
+        {
+            float discriminant = qb * qb - 4.0f * qa * qc;
+            
+            if (discriminant >= 0.0f)
+            {
+                float root = sqrtf(discriminant);
+                float s0 = (-qb - root) / (2.0f * qa);
+                float s1 = (-qb + root) / (2.0f * qa);
+                
+                if (s0 > s1)
+                    std::swap(s0, s1);
+                
+                s = s0 >= 0.0f ? s0 : s1;
+            }
+        }
+        
+        if (s >= 0.0f && s <= length)
+        {
+            packet.t[i] = t_near + s;
+            packet.hit[i] = true;
+        }
+    }
+    
+    static void reduce_cells(const uint16_t* row0, const uint16_t* row1, int cells, uint16_t* min, uint16_t* max)
+    {
+        int x = 0;
+        
+#if defined(DW_SIMD_SSE2)
+        for (; x + 8 <= cells; x += 8)
+        {
+            __m128i a = bias_u16(_mm_loadu_si128((const __m128i*)(row0 + x)));
+            __m128i b = bias_u16(_mm_loadu_si128((const __m128i*)(row0 + x + 1)));
+            __m128i c = bias_u16(_mm_loadu_si128((const __m128i*)(row1 + x)));
+            __m128i d = bias_u16(_mm_loadu_si128((const __m128i*)(row1 + x + 1)));
+            
+            _mm_storeu_si128((__m128i*)(min + x), bias_u16(_mm_min_epi16(_mm_min_epi16(a, b), _mm_min_epi16(c, d))));
+            _mm_storeu_si128((__m128i*)(max + x), bias_u16(_mm_max_epi16(_mm_max_epi16(a, b), _mm_max_epi16(c, d))));
+        }
+#endif
+        
+        for (; x < cells; x++)
+        {
+            min[x] = glm::min(glm::min(row0[x], row0[x + 1]), glm::min(row1[x], row1[x + 1]));
+            max[x] = glm::max(glm::max(row0[x], row0[x + 1]), glm::max(row1[x], row1[x + 1]));
+        }
+    }
+    
+    static void reduce_level(const uint16_t* row0, const uint16_t* row1, int width, uint16_t* out, bool is_min)
+    {
+        int x = 0;
+        int out_width = (width + 1) / 2;
+        
+#if defined(DW_SIMD_SSE2)
+        for (; 2 * x + 16 <= width; x += 8)
+        {
+            __m128i a0 = bias_u16(_mm_loadu_si128((const __m128i*)(row0 + 2 * x)));
+            __m128i a1 = bias_u16(_mm_loadu_si128((const __m128i*)(row0 + 2 * x + 8)));
+            __m128i b0 = bias_u16(_mm_loadu_si128((const __m128i*)(row1 + 2 * x)));
+            __m128i b1 = bias_u16(_mm_loadu_si128((const __m128i*)(row1 + 2 * x + 8)));
+            
+            __m128i v0 = is_min ? _mm_min_epi16(a0, b0) : _mm_max_epi16(a0, b0);
+            __m128i v1 = is_min ? _mm_min_epi16(a1, b1) : _mm_max_epi16(a1, b1);
+            
+            // Combine horizontal pairs into the even lanes.
+            v0 = is_min ? _mm_min_epi16(v0, _mm_srli_epi32(v0, 16)) : _mm_max_epi16(v0, _mm_srli_epi32(v0, 16));
+            v1 = is_min ? _mm_min_epi16(v1, _mm_srli_epi32(v1, 16)) : _mm_max_epi16(v1, _mm_srli_epi32(v1, 16));
+            
+            _mm_storeu_si128((__m128i*)(out + x), bias_u16(pack_even_i16(v0, v1)));
+        }
+#endif
+        
+        for (; x < out_width; x++)
+        {
+            int x1 = glm::min(2 * x + 1, width - 1);
+            
+            if (is_min)
+                out[x] = glm::min(glm::min(row0[2 * x], row0[x1]), glm::min(row1[2 * x], row1[x1]));
+            else
+                out[x] = glm::max(glm::max(row0[2 * x], row0[x1]), glm::max(row1[2 * x], row1[x1]));
+        }
+    }
+    
+    static void average_rows(const uint16_t* row0, const uint16_t* row1, int width, int out_width, uint16_t* out)
+    {
+        int x = 0;
+        
+#if defined(DW_SIMD_SSE2)
+        for (; 2 * x + 16 <= width; x += 8)
+        {
+            __m128i v0 = _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(row0 + 2 * x)), _mm_loadu_si128((const __m128i*)(row1 + 2 * x)));
+            __m128i v1 = _mm_avg_epu16(_mm_loadu_si128((const __m128i*)(row0 + 2 * x + 8)), _mm_loadu_si128((const __m128i*)(row1 + 2 * x + 8)));
+            
+            v0 = _mm_avg_epu16(v0, _mm_srli_epi32(v0, 16));
+            v1 = _mm_avg_epu16(v1, _mm_srli_epi32(v1, 16));
+            
+            _mm_storeu_si128((__m128i*)(out + x), bias_u16(pack_even_i16(bias_u16(v0), bias_u16(v1))));
+        }
+#endif
+        
+        for (; x < out_width; x++)
+        {
+            int x1 = glm::min(2 * x + 1, width - 1);
+            uint32_t a = (row0[2 * x] + row1[2 * x] + 1) >> 1;
+            uint32_t b = (row0[x1] + row1[x1] + 1) >> 1;
+            
+            out[x] = (uint16_t)((a + b + 1) >> 1);
+        }
+    }
+};
+
+// Small thread pool for file I/O and decoding. Jobs must not touch the render device; they hand their
+// results back through objects such as HeightmapLoad that the render thread polls.
+class AsyncLoader
+{
+public:
+    AsyncLoader(int num_threads) : m_stop(false)
+    {
+        for (int i = 0; i < num_threads; i++)
+            m_threads.push_back(std::thread(&AsyncLoader::run, this));
+    }
+    
+    ~AsyncLoader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        
+        m_cv.notify_all();
+        
+        for (int i = 0; i < m_threads.size(); i++)
+            m_threads[i].join();
+    }
+    
+    void enqueue(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(job);
+        }
+        
+        m_cv.notify_one();
+    }
+    
+    // Shared by all terrains. Two threads so that several maps can load at the same time.
+    static AsyncLoader& get()
+    {
+        static AsyncLoader loader(2);
+        return loader;
+    }
+    
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+                
+                if (m_jobs.empty())
+                    return;
+                
+                job = m_jobs.front();
+                m_jobs.pop_front();
+            }
+            
+            job();
+        }
+    }
+    
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop;
+};
+
+enum LoadState
+{
+    LOAD_PENDING,
+    LOAD_READY,
+    LOAD_FAILED
+};
+
+// Result of a background heightmap read. Everything except state is owned by the worker until state
+// leaves LOAD_PENDING, and by the render thread afterwards. The worker reads into samples and then
+// builds the pyramid, which takes the samples over.
+struct HeightmapLoad
+{
+    std::atomic<int>      state;
+    std::atomic<bool>     cancelled; // Set by the render thread when nobody wants the result any more.
+    std::vector<uint16_t> samples;
+    int                   width;
+    int                   height;
+    TiledHeightmap        tiled;
+    HeightPyramid         pyramid;
+    
+    HeightmapLoad() : state(LOAD_PENDING), cancelled(false), width(0), height(0) {}
+    
+    bool done() const
+    {
+        return state.load(std::memory_order_acquire) != LOAD_PENDING;
+    }
+    
+    void finish(bool success)
+    {
+        if (success)
+            pyramid.build(samples, width, height);
+        else
+            std::vector<uint16_t>().swap(samples);
+        
+        state.store(success ? LOAD_READY : LOAD_FAILED, std::memory_order_release);
+    }
+    
+    void wait() const
+    {
+        while (!done())
+            std::this_thread::yield();
+    }
+};
+
+struct TerrainVertex
+{
+    glm::vec2 pos;
+};
+
+// patch.xy is the world space origin of the node being drawn and patch.z the world space size of one
+// patch cell, so the vertex shader computes the world position as patch.xy + pos * patch.z.
+// height_rect maps the normalized map position (world.xz + rect.zw) / (2 * rect.zw) to uvs of the height
+// texture bound for the node: uv = map_pos * height_rect.xy + height_rect.zw.
+struct TerrainUniforms
+{
+    glm::mat4 view_proj;
+    glm::vec4 rect;
+    glm::vec4 scale;
+    glm::vec4 patch;
+    glm::vec4 height_rect;
+    
+    REFLECT()
+};
+
+BEGIN_DECLARE_UNIFORMS(TerrainUniforms)
+    REFLECT_UNIFORM(view_proj)
+    REFLECT_UNIFORM(rect)
+    REFLECT_UNIFORM(scale)
+    REFLECT_UNIFORM(patch)
+    REFLECT_UNIFORM(height_rect)
+END_DECLARE_UNIFORMS()
+
+#define TERRAIN_PATCH_SIZE 32
+#define TERRAIN_NUM_STITCH_VARIANTS 16
+#define TERRAIN_MAX_RESIDENT_TILES 64
+#define TERRAIN_MAX_TILE_UPLOADS 4
+#define TERRAIN_MAX_TILE_REQUESTS 8
+#define TERRAIN_TILE_LOAD_FRAMES 60
+#define TERRAIN_PATCH_VERTICES (TERRAIN_PATCH_SIZE + 1)
+
+// Patch edges that must be stitched to a neighbour one level coarser.
+enum TerrainEdge
+{
+    TERRAIN_EDGE_NEG_Z = 1,
+    TERRAIN_EDGE_POS_X = 2,
+    TERRAIN_EDGE_POS_Z = 4,
+    TERRAIN_EDGE_NEG_X = 8
+};
+
+// Where the vertex shader gets grid positions from. TERRAIN_VERTEX_SOURCE_ID creates no patch vertex
+// buffer and compiles the shader with TERRAIN_VERTEX_ID defined. The shader then derives the position
+// from gl_VertexID as vec2(id % TERRAIN_PATCH_VERTICES, id / TERRAIN_PATCH_VERTICES), which is what
+// vertex_position() computes on the CPU.
+enum TerrainVertexSource
+{
+    TERRAIN_VERTEX_SOURCE_BUFFER,
+    TERRAIN_VERTEX_SOURCE_ID
+};
+
+struct TerrainTile
+{
+    Texture2D*                     texture;
+    uint32_t                       last_used;
+    bool                           failed;  // Not retried, nodes stay on the overview.
+    std::shared_ptr<HeightmapLoad> load;    // Only while the read is in flight or waiting for upload.
+    HeightPyramid                  pyramid; // CPU copy for height queries, kept while resident.
+};
+
+struct TerrainNode
+{
+    int      x;      // Position in units of level 0 patches.
+    int      z;
+    int      level;  // Covers (1 << level) level 0 patches per side.
+    uint32_t stitch; // TerrainEdge mask.
+};
+
+// The terrain is drawn as a quadtree of nodes that all share one patch mesh of TERRAIN_PATCH_SIZE^2 cells,
+// scaled to the node size in the vertex shader. Nodes are selected per frame by camera distance, and
+// edges facing a coarser neighbour use one of 16 index buffer variants that drop the odd edge vertices.
+// That only closes a one level difference, so selection splits nodes further until the quadtree is
+// restricted (2:1), whatever the LOD distance.
+template <typename Device>
+struct BasicTerrain
+{
+    VertexArray* m_vao[TERRAIN_NUM_STITCH_VARIANTS];
+    IndexBuffer* m_ibo[TERRAIN_NUM_STITCH_VARIANTS];
+    uint32_t m_index_counts[TERRAIN_NUM_STITCH_VARIANTS];
+    TerrainVertexSource m_vertex_source;
+    VertexBuffer* m_vbo = nullptr;
+    InputLayout* m_il = nullptr;
+    Shader* m_vs;
+    Shader* m_fs;
+    ShaderProgram* m_program;
+    std::vector<UniformBuffer*> m_node_ubos;
+    Device* m_device;
+    RasterizerState* m_rs;
+    DepthStencilState* m_ds;
+    TerrainUniforms m_uniforms;
+    std::vector<UniformUploader<TerrainUniforms>> m_node_uploaders;
+    Texture2D* m_height_map;
+	SamplerState* m_sampler;
+    std::vector<TerrainNode> m_nodes;
+    std::vector<TerrainNode> m_leaves;
+    std::vector<uint8_t> m_lod_grid;
+    int m_patches_x;
+    int m_patches_z;
+    int m_root_level;
+    float m_patch_world_size;
+    glm::vec2 m_half_extents;
+    float m_lod_distance = 2.0f;
+    dd::Frustum m_frustum;
+    glm::vec2 m_height_map_size;
+    TiledHeightmap m_tiled;
+    HeightPyramid m_pyramid;
+    std::shared_ptr<HeightmapLoad> m_load;
+    std::vector<TerrainTile> m_tiles;
+    std::vector<std::shared_ptr<HeightmapLoad>> m_cancelled_loads; // Still running, they read from m_tiled.
+    int m_num_resident_tiles = 0;
+    int m_num_tile_uploads = 0;
+    int m_num_tile_requests = 0;
+    uint32_t m_frame = 0;
+
+    // x and z are the number of cells along each axis and must be multiples of TERRAIN_PATCH_SIZE.
+    BasicTerrain(float x, float z, float distance, Device* device, TerrainVertexSource vertex_source = TERRAIN_VERTEX_SOURCE_BUFFER)
+    {
+        m_device = device;
+        m_height_map = nullptr;
+        m_vertex_source = vertex_source;
+        
+        float x_half = x/2.0f * distance;
+        float z_half = z/2.0f * distance;
+        
+        assert((int)x % TERRAIN_PATCH_SIZE == 0 && (int)z % TERRAIN_PATCH_SIZE == 0);
+        
+        m_patches_x = (int)x / TERRAIN_PATCH_SIZE;
+        m_patches_z = (int)z / TERRAIN_PATCH_SIZE;
+        m_patch_world_size = TERRAIN_PATCH_SIZE * distance;
+        m_half_extents = glm::vec2(x_half, z_half);
+        m_lod_grid.resize(m_patches_x * m_patches_z);
+        
+        m_root_level = 0;
+        
+        while ((1 << m_root_level) < glm::max(m_patches_x, m_patches_z))
+            m_root_level++;
+        
+        // Geometry only lives on the CPU until it is uploaded.
+        const int n = TERRAIN_PATCH_VERTICES;
+        
+        std::vector<uint32_t> indices(index_count(0));
+        
+        std::string vs_str;
+        Utility::ReadText("shader/terrain_vs.glsl", vs_str);
+        
+        if (m_vertex_source == TERRAIN_VERTEX_SOURCE_ID)
+            vs_str = inject_defines(vs_str, "#define TERRAIN_VERTEX_ID\n#define TERRAIN_PATCH_VERTICES " + std::to_string(n) + "\n");
+        
+        std::string fs_str;
+        Utility::ReadText("shader/terrain_fs.glsl", fs_str);
+        
+        m_vs = m_device->create_shader(vs_str.c_str(), ShaderType::VERTEX);
+        m_fs = m_device->create_shader(fs_str.c_str(), ShaderType::FRAGMENT);
+        
+        if (!m_vs || !m_fs)
+        {
+            LOG_FATAL("Failed to create Shaders");
+            return;
+        }
+        
+        Shader* shaders[] = { m_vs, m_fs };
+        m_program = m_device->create_shader_program(shaders, 2);
+        
+        BufferCreateDesc bc;
+        InputLayoutCreateDesc ilcd;
+        VertexArrayCreateDesc vcd;
+        
+        // The device has no attribute-less vertex array, so the ID path binds a single placeholder
+        // vertex through a layout without elements. No attribute is enabled and the shader reads nothing.
+        std::vector<TerrainVertex> vertices(m_vertex_source == TERRAIN_VERTEX_SOURCE_BUFFER ? n * n : 1);
+        
+        if (m_vertex_source == TERRAIN_VERTEX_SOURCE_BUFFER)
+            fill_patch_vertices(&vertices[0]);
+        else
+            vertices[0].pos = glm::vec2(0.0f);
+        
+        DW_ZERO_MEMORY(bc);
+        bc.data = &vertices[0];
+        bc.data_type = DataType::FLOAT;
+        bc.size = sizeof(TerrainVertex) * (uint32_t)vertices.size();
+        bc.usage_type = BufferUsageType::STATIC;
+        
+        m_vbo = m_device->create_vertex_buffer(bc);
+        
+        InputElement elements[] =
+        {
+            { 2, DataType::FLOAT, false, 0, "POSITION" }
+        };
+        
+        DW_ZERO_MEMORY(ilcd);
+        ilcd.elements = elements;
+        ilcd.num_elements = m_vertex_source == TERRAIN_VERTEX_SOURCE_BUFFER ? 1 : 0;
+        ilcd.vertex_size = sizeof(float) * 2;
+        
+        m_il = m_device->create_input_layout(ilcd);
+        
+        if (!m_vbo || !m_il)
+        {
+            LOG_FATAL("Failed to create Vertex Buffers/Arrays");
+            return;
+        }
+        
+        for (uint32_t stitch = 0; stitch < TERRAIN_NUM_STITCH_VARIANTS; stitch++)
+        {
+            m_index_counts[stitch] = generate_indices(stitch, &indices[0]);
+            
+            DW_ZERO_MEMORY(bc);
+            bc.data = &indices[0];
+            bc.data_type = DataType::UINT32;
+            bc.size = sizeof(uint32_t) * m_index_counts[stitch];
+            bc.usage_type = BufferUsageType::STATIC;
+            
+            m_ibo[stitch] = m_device->create_index_buffer(bc);
+            
+            DW_ZERO_MEMORY(vcd);
+            vcd.index_buffer = m_ibo[stitch];
+            vcd.vertex_buffer = m_vbo;
+            vcd.layout = m_il;
+            
+            m_vao[stitch] = m_device->create_vertex_array(vcd);
+            
+            if (!m_vao[stitch] || !m_ibo[stitch])
+            {
+                LOG_FATAL("Failed to create Vertex Buffers/Arrays");
+                return;
+            }
+        }
+
+		SamplerStateCreateDesc ssDesc;
+		DW_ZERO_MEMORY(ssDesc);
+
+		ssDesc.max_anisotropy = 0;
+		ssDesc.min_filter = TextureFilteringMode::LINEAR;
+		ssDesc.mag_filter = TextureFilteringMode::LINEAR;
+		ssDesc.wrap_mode_u = TextureWrapMode::CLAMP_TO_EDGE;
+		ssDesc.wrap_mode_v = TextureWrapMode::CLAMP_TO_EDGE;
+		ssDesc.wrap_mode_w = TextureWrapMode::CLAMP_TO_EDGE;
+
+		m_sampler = m_device->create_sampler_state(ssDesc);
+        
+        RasterizerStateCreateDesc rs_desc;
+        DW_ZERO_MEMORY(rs_desc);
+        rs_desc.cull_mode = CullMode::NONE;
+        rs_desc.fill_mode = FillMode::WIREFRAME;
+        rs_desc.front_winding_ccw = true;
+        rs_desc.multisample = true;
+        rs_desc.scissor = false;
+        
+        m_rs = m_device->create_rasterizer_state(rs_desc);
+        
+        DepthStencilStateCreateDesc ds_desc;
+        DW_ZERO_MEMORY(ds_desc);
+        ds_desc.depth_mask = true;
+        ds_desc.enable_depth_test = true;
+        ds_desc.enable_stencil_test = false;
+        ds_desc.depth_cmp_func = ComparisonFunction::LESS_EQUAL;
+        
+        m_ds = m_device->create_depth_stencil_state(ds_desc);
+        
+        m_uniforms.rect.x = x + 1;
+        m_uniforms.rect.y = z + 1;
+        m_uniforms.rect.z = x_half;
+        m_uniforms.rect.w = z_half;
+        m_uniforms.scale.x = 1.0f;
+        
+        load_async("heightmap.r16t", "heightmap.r16", 1024, 1024);
+    }
+    
+    // Every stitched edge collapses TERRAIN_PATCH_SIZE / 2 odd vertices, each of which removes exactly one
+    // triangle, so the size of every variant is known before generating it. When both positive edges are
+    // stitched the corner cell's first triangle also collapses onto the diagonal and is dropped.
+    static uint32_t index_count(uint32_t stitch)
+    {
+        int edges = (stitch & 1) + ((stitch >> 1) & 1) + ((stitch >> 2) & 1) + ((stitch >> 3) & 1);
+        int corner = (stitch & TERRAIN_EDGE_POS_X) && (stitch & TERRAIN_EDGE_POS_Z) ? 1 : 0;
+        
+        return 3 * (2 * TERRAIN_PATCH_SIZE * TERRAIN_PATCH_SIZE - edges * (TERRAIN_PATCH_SIZE / 2) - corner);
+    }
+    
+    // Writes the index list of the shared patch for the given stitch mask and returns its length. Odd
+    // vertices on a stitched edge are collapsed onto their even neighbour, which turns that edge into the
+    // coarser neighbour's edge. Triangles that become degenerate, by sharing a vertex or by collapsing to
+    // a line, are dropped.
+    uint32_t generate_indices(uint32_t stitch, uint32_t* indices)
+    {
+        uint32_t count = 0;
+        
+        // 0 1 2
+        // 3 4 5
+        // 6 7 8
+        
+        for (int i = 0; i < TERRAIN_PATCH_SIZE; i++)
+        {
+            for (int j = 0; j < TERRAIN_PATCH_SIZE; j++)
+            {
+                uint32_t v[6] = {
+                    stitched_index(i, j, stitch),
+                    stitched_index(i + 1, j, stitch),
+                    stitched_index(i, j + 1, stitch),
+                    
+                    stitched_index(i, j + 1, stitch),
+                    stitched_index(i + 1, j, stitch),
+                    stitched_index(i + 1, j + 1, stitch)
+                };
+                
+                for (int t = 0; t < 6; t += 3)
+                {
+                    glm::vec2 e0 = vertex_position(v[t + 1]) - vertex_position(v[t]);
+                    glm::vec2 e1 = vertex_position(v[t + 2]) - vertex_position(v[t]);
+                    
+                    if (e0.x * e1.y - e0.y * e1.x == 0.0f)
+                        continue;
+                    
+                    indices[count++] = v[t];
+                    indices[count++] = v[t + 1];
+                    indices[count++] = v[t + 2];
+                }
+            }
+        }
+        
+        assert(count == index_count(stitch));
+        
+        return count;
+    }
+    
+    uint32_t stitched_index(int row, int col, uint32_t stitch)
+    {
+        const int n = TERRAIN_PATCH_VERTICES;
+        
+        if (((stitch & TERRAIN_EDGE_NEG_Z) && row == 0) || ((stitch & TERRAIN_EDGE_POS_Z) && row == TERRAIN_PATCH_SIZE))
+            col &= ~1;
+        
+        if (((stitch & TERRAIN_EDGE_NEG_X) && col == 0) || ((stitch & TERRAIN_EDGE_POS_X) && col == TERRAIN_PATCH_SIZE))
+            row &= ~1;
+        
+        return row * n + col;
+    }
+    
+    // Grid position of a patch vertex, in cells. Mirrors the TERRAIN_VERTEX_ID path of the vertex shader.
+    static glm::vec2 vertex_position(uint32_t index)
+    {
+        return glm::vec2(index % TERRAIN_PATCH_VERTICES, index / TERRAIN_PATCH_VERTICES);
+    }
+    
+    // Vertex buffer contents of the buffer path: rows along z, columns along x.
+    static void fill_patch_vertices(TerrainVertex* vertices)
+    {
+        const int n = TERRAIN_PATCH_VERTICES;
+        
+        for (int i = 0; i < n; i++)
+        {
+            for (int j = 0; j < n; j++)
+                vertices[i * n + j].pos = glm::vec2(j, i);
+        }
+    }
+    
+    // Checks that the vertex ID path reproduces the vertex buffer of the buffer path, and the index math
+    // both rely on for every stitch variant: indices stay inside the patch grid, no triangle is degenerate
+    // or flipped, and stitched edges only reference even vertices.
+    bool validate_geometry()
+    {
+        std::vector<TerrainVertex> vertices(TERRAIN_PATCH_VERTICES * TERRAIN_PATCH_VERTICES);
+        fill_patch_vertices(&vertices[0]);
+        
+        for (uint32_t i = 0; i < vertices.size(); i++)
+        {
+            if (vertex_position(i) != vertices[i].pos)
+                return false;
+        }
+        
+        std::vector<uint32_t> indices(index_count(0));
+        
+        for (uint32_t stitch = 0; stitch < TERRAIN_NUM_STITCH_VARIANTS; stitch++)
+        {
+            uint32_t count = generate_indices(stitch, &indices[0]);
+            
+            for (uint32_t i = 0; i < count; i += 3)
+            {
+                glm::vec2 p[3];
+                
+                for (int k = 0; k < 3; k++)
+                {
+                    if (indices[i + k] >= TERRAIN_PATCH_VERTICES * TERRAIN_PATCH_VERTICES)
+                        return false;
+                    
+                    p[k] = vertices[indices[i + k]].pos;
+                    
+                    bool odd_x = (int)p[k].x & 1;
+                    bool odd_z = (int)p[k].y & 1;
+                    
+                    if (((stitch & TERRAIN_EDGE_NEG_Z) && p[k].y == 0 && odd_x) || ((stitch & TERRAIN_EDGE_POS_Z) && p[k].y == TERRAIN_PATCH_SIZE && odd_x) ||
+                        ((stitch & TERRAIN_EDGE_NEG_X) && p[k].x == 0 && odd_z) || ((stitch & TERRAIN_EDGE_POS_X) && p[k].x == TERRAIN_PATCH_SIZE && odd_z))
+                        return false;
+                }
+                
+                glm::vec2 e0 = p[1] - p[0];
+                glm::vec2 e1 = p[2] - p[0];
+                
+                // Every triangle of the unstitched grid winds the same way, (row, col) -> (row + 1, col) -> (row, col + 1).
+                if (e0.x * e1.y - e0.y * e1.x >= 0.0f)
+                    return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Inserts defines after the #version line, which has to stay first.
+    static std::string inject_defines(const std::string& source, const std::string& defines)
+    {
+        if (source.compare(0, 8, "#version") != 0)
+            return defines + source;
+        
+        size_t line_end = source.find('\n');
+        
+        if (line_end == std::string::npos)
+            return source + "\n" + defines;
+        
+        return source.substr(0, line_end + 1) + defines + source.substr(line_end + 1);
+    }
+    
+    void gui()
+    {
+        ImGui::SliderFloat("Terrain Scale", &m_uniforms.scale.x, 1.0f, 300.0f);
+        ImGui::SliderFloat("Terrain LOD Distance", &m_lod_distance, 1.0f, 8.0f);
+        ImGui::Text("Terrain Nodes: %d", (int)m_nodes.size());
+        ImGui::Text("Resident Tiles: %d", m_num_resident_tiles);
+		ImGui::Image((ImTextureID)m_height_map->id, ImVec2(1025, 1025));
+    }
+    
+    void node_bounds(int x, int z, int level, glm::vec3& min, glm::vec3& max)
+    {
+        int size = 1 << level;
+        float world_size = size * m_patch_world_size;
+        
+        min = glm::vec3(-m_half_extents.x + x * m_patch_world_size, 0.0f, -m_half_extents.y + z * m_patch_world_size);
+        max = min + glm::vec3(world_size, m_uniforms.scale.x, world_size);
+        
+        node_height_range(x, z, size, min.y, max.y);
+    }
+    
+    // Collects the quadtree leaves for this frame by camera distance. Every leaf, visible or not, is
+    // recorded in the LOD grid so that balance() and the stitch masks see all neighbours.
+    void select(const glm::vec3& camera_pos, int x, int z, int level)
+    {
+        if (x >= m_patches_x || z >= m_patches_z)
+            return;
+        
+        int size = 1 << level;
+        float world_size = size * m_patch_world_size;
+        
+        glm::vec3 min, max;
+        node_bounds(x, z, level, min, max);
+        
+        glm::vec3 closest = glm::clamp(camera_pos, min, max);
+        bool straddles = x + size > m_patches_x || z + size > m_patches_z;
+        
+        if (level > 0 && (straddles || glm::length(closest - camera_pos) < m_lod_distance * world_size))
+        {
+            int half = size / 2;
+            
+            select(camera_pos, x, z, level - 1);
+            select(camera_pos, x + half, z, level - 1);
+            select(camera_pos, x, z + half, level - 1);
+            select(camera_pos, x + half, z + half, level - 1);
+            return;
+        }
+        
+        add_leaf(x, z, level);
+    }
+    
+    void add_leaf(int x, int z, int level)
+    {
+        int size = 1 << level;
+        
+        for (int i = z; i < z + size; i++)
+        {
+            for (int j = x; j < x + size; j++)
+                m_lod_grid[i * m_patches_x + j] = level;
+        }
+        
+        TerrainNode node = { x, z, level, 0 };
+        m_leaves.push_back(node);
+    }
+    
+    // Finest level among the patches bordering the node's four edges.
+    int finest_neighbour(const TerrainNode& node)
+    {
+        int size = 1 << node.level;
+        int level = node.level;
+        
+        for (int k = 0; k < size; k++)
+        {
+            level = glm::min(level, neighbour_level(node.x + k, node.z - 1, node.level));
+            level = glm::min(level, neighbour_level(node.x + k, node.z + size, node.level));
+            level = glm::min(level, neighbour_level(node.x - 1, node.z + k, node.level));
+            level = glm::min(level, neighbour_level(node.x + size, node.z + k, node.level));
+        }
+        
+        return level;
+    }
+    
+    // Splits leaves that border a neighbour more than one level finer until none is left. The distance
+    // test alone does not guarantee this for small LOD distances or steep height ranges. Splitting only
+    // makes levels finer, so the loop terminates, and leaves appended by a split are checked in the same
+    // pass. Leaves above level 0 never straddle the map edge, so all four children exist.
+    void balance()
+    {
+        bool changed = true;
+        
+        while (changed)
+        {
+            changed = false;
+            
+            for (size_t i = 0; i < m_leaves.size();)
+            {
+                TerrainNode node = m_leaves[i];
+                
+                if (node.level < 2 || finest_neighbour(node) >= node.level - 1)
+                {
+                    i++;
+                    continue;
+                }
+                
+                int half = 1 << (node.level - 1);
+                
+                // The last leaf moves into the parent's slot and is checked next.
+                m_leaves[i] = m_leaves.back();
+                m_leaves.pop_back();
+                
+                add_leaf(node.x, node.z, node.level - 1);
+                add_leaf(node.x + half, node.z, node.level - 1);
+                add_leaf(node.x, node.z + half, node.level - 1);
+                add_leaf(node.x + half, node.z + half, node.level - 1);
+                
+                changed = true;
+            }
+        }
+    }
+    
+    int neighbour_level(int x, int z, int level)
+    {
+        if (x < 0 || z < 0 || x >= m_patches_x || z >= m_patches_z)
+            return level;
+        
+        return m_lod_grid[z * m_patches_x + x];
+    }
+    
+    void render(glm::mat4 view_proj, const glm::vec3& camera_pos, uint32_t width, uint32_t height)
+    {
+        DW_PROFILE_SCOPE("Terrain::render");
+        
+        m_uniforms.view_proj = view_proj;
+        
+        poll_load();
+        
+        m_frustum.extract(view_proj);
+        m_nodes.clear();
+        m_leaves.clear();
+        select(camera_pos, 0, 0, m_root_level);
+        balance();
+        
+        for (int i = 0; i < m_leaves.size(); i++)
+        {
+            glm::vec3 min, max;
+            node_bounds(m_leaves[i].x, m_leaves[i].z, m_leaves[i].level, min, max);
+            
+            if (m_frustum.intersects_aabb(min, max))
+                m_nodes.push_back(m_leaves[i]);
+        }
+        
+        for (int i = 0; i < m_nodes.size(); i++)
+        {
+            TerrainNode& node = m_nodes[i];
+            int size = 1 << node.level;
+            
+            if (neighbour_level(node.x, node.z - 1, node.level) > node.level)
+                node.stitch |= TERRAIN_EDGE_NEG_Z;
+            if (neighbour_level(node.x + size, node.z, node.level) > node.level)
+                node.stitch |= TERRAIN_EDGE_POS_X;
+            if (neighbour_level(node.x, node.z + size, node.level) > node.level)
+                node.stitch |= TERRAIN_EDGE_POS_Z;
+            if (neighbour_level(node.x - 1, node.z, node.level) > node.level)
+                node.stitch |= TERRAIN_EDGE_NEG_X;
+        }
+        
+        m_device->bind_rasterizer_state(m_rs);
+        m_device->bind_depth_stencil_state(m_ds);
+        m_device->bind_framebuffer(nullptr);
+        m_device->set_viewport(width, height, 0, 0);
+        m_device->bind_shader_program(m_program);
+		m_device->bind_sampler_state(m_sampler, ShaderType::VERTEX, 0);
+        m_device->set_primitive_type(PrimitiveType::TRIANGLES);
+        
+        begin_tile_frame();
+        
+        for (int i = 0; i < m_nodes.size(); i++)
+        {
+            const TerrainNode& node = m_nodes[i];
+            
+            m_uniforms.patch.x = -m_half_extents.x + node.x * m_patch_world_size;
+            m_uniforms.patch.y = -m_half_extents.y + node.z * m_patch_world_size;
+            m_uniforms.patch.z = (m_patch_world_size / TERRAIN_PATCH_SIZE) * (1 << node.level);
+            m_uniforms.patch.w = node.level;
+            
+            Texture2D* texture = node_texture(node);
+            UniformBuffer* ubo = node_uniform_buffer(i);
+            
+            m_node_uploaders[i].set(m_uniforms);
+            m_node_uploaders[i].upload(m_device, ubo);
+            
+            m_device->bind_uniform_buffer(ubo, ShaderType::VERTEX, 0);
+            m_device->bind_texture(texture, ShaderType::VERTEX, 0);
+            m_device->bind_vertex_array(m_vao[node.stitch]);
+            m_device->draw_indexed(m_index_counts[node.stitch]);
+        }
+        
+        evict_tiles();
+    }
+    
+    // Uniform buffer of the i-th node drawn in a frame. Every node has its own, so no buffer is mapped
+    // again between draws that read it, and a slot whose uniforms match last frame's is not mapped at
+    // all. The device cannot bind a range of one buffer, which rules out offsets into a shared one.
+    UniformBuffer* node_uniform_buffer(int i)
+    {
+        while (m_node_ubos.size() <= i)
+        {
+            BufferCreateDesc desc;
+            DW_ZERO_MEMORY(desc);
+            desc.data = nullptr;
+            desc.data_type = DataType::FLOAT;
+            desc.size = sizeof(TerrainUniforms);
+            desc.usage_type = BufferUsageType::DYNAMIC;
+            
+            m_node_ubos.push_back(m_device->create_uniform_buffer(desc));
+            m_node_uploaders.push_back(UniformUploader<TerrainUniforms>());
+        }
+        
+        return m_node_ubos[i];
+    }
+    
+    // World space height of the surface at (x, z), bilinearly filtered. Tiled maps use the resident tile
+    // under the point and fall back to the overview.
+    float height_at(float x, float z)
+    {
+        if (m_tiled.m_header)
+        {
+            const HeightmapHeader& header = *m_tiled.m_header;
+            float s = (x + m_half_extents.x) / (2.0f * m_half_extents.x) * (header.width - 1.0f);
+            float t = (z + m_half_extents.y) / (2.0f * m_half_extents.y) * (header.height - 1.0f);
+            int tx = glm::clamp((int)(s / header.tile_size), 0, (int)header.tiles_x - 1);
+            int tz = glm::clamp((int)(t / header.tile_size), 0, (int)header.tiles_z - 1);
+            
+            const TerrainTile& tile = m_tiles[tz * header.tiles_x + tx];
+            
+            if (tile.texture)
+                return sample_height(tile.pyramid.height_at(s - tx * (float)header.tile_size, t - tz * (float)header.tile_size));
+        }
+        
+        glm::vec3 p = to_sample_space(glm::vec3(x, 0.0f, z), true);
+        
+        return sample_height(m_pyramid.height_at(p.x, p.z));
+    }
+    
+    // Closest intersection of each ray with the terrain, as a distance along the ray in units of its
+    // direction, or -1 when it misses within max_distance. Rays are traced four at a time against the
+    // whole-map pyramid, which is the overview for tiled maps.
+    void raycast(const glm::vec3* origins, const glm::vec3* directions, int count, float* distances, float max_distance = FLT_MAX)
+    {
+        RayPacket packet;
+        
+        for (int i = 0; i < count; i += 4)
+        {
+            int n = glm::min(count - i, 4);
+            
+            for (int j = 0; j < 4; j++)
+            {
+                if (j < n)
+                    packet.set(j, to_sample_space(origins[i + j], true), to_sample_space(directions[i + j], false), max_distance);
+                else
+                    packet.set(j, glm::vec3(0.0f), glm::vec3(0.0f, -1.0f, 0.0f), -1.0f);
+            }
+            
+            m_pyramid.raycast(packet);
+            
+            for (int j = 0; j < n; j++)
+                distances[i + j] = packet.hit[j] ? packet.t[j] : -1.0f;
+        }
+    }
+    
+    // Maps world space onto the samples of m_pyramid with heights in sample units. The mapping is affine,
+    // so distances along a ray are the same in both spaces.
+    glm::vec3 to_sample_space(const glm::vec3& v, bool point)
+    {
+        glm::vec3 scale(glm::max(m_pyramid.m_width - 1, 1) / (2.0f * m_half_extents.x),
+                        65535.0f / m_uniforms.scale.x,
+                        glm::max(m_pyramid.m_height - 1, 1) / (2.0f * m_half_extents.y));
+        
+        if (point)
+            return (v + glm::vec3(m_half_extents.x, 0.0f, m_half_extents.y)) * scale;
+        
+        return v * scale;
+    }
+    
+    // Heights are stored as UNORM16 fractions of the terrain scale. Height textures hold the same
+    // fractions as half floats, see create_height_texture().
+    float sample_height(float sample)
+    {
+        return sample / 65535.0f * m_uniforms.scale.x;
+    }
+    
+    // Range of heightmap samples covered by the node, in the sample space of the full resolution map.
+    void node_samples(int x, int z, int size, float& s0, float& t0, float& s1, float& t1)
+    {
+        float width = m_tiled.m_header ? m_tiled.m_header->width : m_pyramid.m_width;
+        float height = m_tiled.m_header ? m_tiled.m_header->height : m_pyramid.m_height;
+        
+        s0 = (float)x / m_patches_x * (width - 1.0f);
+        s1 = (float)(x + size) / m_patches_x * (width - 1.0f);
+        t0 = (float)z / m_patches_z * (height - 1.0f);
+        t1 = (float)(z + size) / m_patches_z * (height - 1.0f);
+    }
+    
+    // Tightens the vertical bounds of a node using the tile's pyramid when it is resident, the tile table
+    // for tiled maps and the whole-map pyramid otherwise. Leaves them untouched while nothing is loaded.
+    void node_height_range(int x, int z, int size, float& min_y, float& max_y)
+    {
+        float s0, t0, s1, t1;
+        uint16_t min = 0xFFFF;
+        uint16_t max = 0;
+        
+        node_samples(x, z, size, s0, t0, s1, t1);
+        
+        if (m_tiled.m_header)
+        {
+            const HeightmapHeader& header = *m_tiled.m_header;
+            int tx0 = (int)(s0 / header.tile_size);
+            int tz0 = (int)(t0 / header.tile_size);
+            int tx1 = glm::min((int)((s1 - 0.001f) / header.tile_size), (int)header.tiles_x - 1);
+            int tz1 = glm::min((int)((t1 - 0.001f) / header.tile_size), (int)header.tiles_z - 1);
+            
+            const TerrainTile& tile = m_tiles[tz0 * header.tiles_x + tx0];
+            
+            if (tx0 == tx1 && tz0 == tz1 && tile.texture)
+            {
+                float ox = tx0 * (float)header.tile_size;
+                float oz = tz0 * (float)header.tile_size;
+                
+                tile.pyramid.range(s0 - ox, t0 - oz, s1 - ox, t1 - oz, min, max);
+            }
+            else
+            {
+                for (int tz = tz0; tz <= tz1; tz++)
+                {
+                    for (int tx = tx0; tx <= tx1; tx++)
+                    {
+                        min = glm::min(min, m_tiled.m_tiles[tz * header.tiles_x + tx].min_height);
+                        max = glm::max(max, m_tiled.m_tiles[tz * header.tiles_x + tx].max_height);
+                    }
+                }
+            }
+        }
+        else if (!m_pyramid.range(s0, t0, s1, t1, min, max))
+            return;
+        
+        // Bound the heights the shader reads, which are the samples rounded to half floats.
+        min_y = half_to_float(unorm16_to_half(min)) * m_uniforms.scale.x;
+        max_y = half_to_float(unorm16_to_half(max)) * m_uniforms.scale.x;
+    }
+    
+    // Returns the height texture to use for a node and sets height_rect to match. Nodes that fit inside a
+    // single tile use that tile once it is resident, everything else samples the whole-map texture.
+    Texture2D* node_texture(const TerrainNode& node)
+    {
+        glm::vec2 size = m_height_map_size;
+        
+        m_uniforms.height_rect = glm::vec4((size.x - 1.0f) / size.x, (size.y - 1.0f) / size.y, 0.5f / size.x, 0.5f / size.y);
+        
+        if (!m_tiled.m_header)
+            return m_height_map;
+        
+        const HeightmapHeader& header = *m_tiled.m_header;
+        float s0, t0, s1, t1;
+        
+        node_samples(node.x, node.z, 1 << node.level, s0, t0, s1, t1);
+        
+        int tx = (int)(s0 / header.tile_size);
+        int tz = (int)(t0 / header.tile_size);
+        
+        if (tx != (int)((s1 - 0.001f) / header.tile_size) || tz != (int)((t1 - 0.001f) / header.tile_size))
+            return m_height_map;
+        
+        Texture2D* texture = request_tile(tx, tz);
+        
+        if (!texture)
+            return m_height_map;
+        
+        float samples = m_tiled.tile_samples();
+        
+        m_uniforms.height_rect = glm::vec4((header.width - 1) / samples,
+                                           (header.height - 1) / samples,
+                                           (0.5f - tx * (float)header.tile_size) / samples,
+                                           (0.5f - tz * (float)header.tile_size) / samples);
+        
+        return texture;
+    }
+    
+    // Resets the per-frame request and upload budgets. Tiles requested from now on count as used in the
+    // new frame, and evict_tiles() keeps them.
+    void begin_tile_frame()
+    {
+        m_frame++;
+        m_num_tile_uploads = 0;
+        m_num_tile_requests = 0;
+    }
+    
+    // Makes a tile resident. The first request starts a background read of the tile's pages from the
+    // mapped file, so page faults never stall the render thread; later requests upload the data once it
+    // has arrived. Both are limited per frame. Returns null until the tile is resident.
+    Texture2D* request_tile(int x, int z)
+    {
+        TerrainTile& tile = m_tiles[z * m_tiled.m_header->tiles_x + x];
+        
+        tile.last_used = m_frame;
+        
+        if (tile.texture || tile.failed)
+            return tile.texture;
+        
+        if (!tile.load)
+        {
+            if (m_num_tile_requests == TERRAIN_MAX_TILE_REQUESTS)
+                return nullptr;
+            
+            m_num_tile_requests++;
+            
+            std::shared_ptr<HeightmapLoad> load = std::make_shared<HeightmapLoad>();
+            const TiledHeightmap* tiled = &m_tiled;
+            
+            load->width = m_tiled.tile_samples();
+            load->height = m_tiled.tile_samples();
+            
+            tile.load = load;
+            
+            AsyncLoader::get().enqueue([load, tiled, x, z]() {
+                if (load->cancelled.load(std::memory_order_relaxed))
+                {
+                    load->finish(false);
+                    return;
+                }
+                
+                DW_PROFILE_SCOPE("Terrain tile read");
+                load->samples.resize(load->width * load->height);
+                load->finish(tiled->read_tile(x, z, &load->samples[0]));
+            });
+            
+            return nullptr;
+        }
+        
+        if (!tile.load->done())
+            return nullptr;
+        
+        if (tile.load->state == LOAD_FAILED)
+        {
+            tile.failed = true;
+            tile.load.reset();
+            return nullptr;
+        }
+        
+        if (m_num_tile_uploads == TERRAIN_MAX_TILE_UPLOADS)
+            return nullptr;
+        
+        // The texture has its own copy of the mips, the CPU only keeps the samples and min/max levels.
+        tile.texture = create_height_texture(tile.load->pyramid);
+        tile.pyramid = std::move(tile.load->pyramid);
+        std::vector<std::vector<uint16_t>>().swap(tile.pyramid.m_mips);
+        tile.load.reset();
+        
+        m_tiled.release_tile(x, z);
+        m_num_tile_uploads++;
+        m_num_resident_tiles++;
+        
+        return tile.texture;
+    }
+    
+    // Drops loads for tiles that have not been requested for TERRAIN_TILE_LOAD_FRAMES, so reads that
+    // finish after the camera moved on do not hold on to their samples. Queued reads are cancelled and
+    // skip the file entirely. Then evicts least recently used tiles that were not drawn this frame until
+    // the working set fits.
+    void evict_tiles()
+    {
+        for (int i = 0; i < m_tiles.size(); i++)
+        {
+            TerrainTile& tile = m_tiles[i];
+            
+            if (tile.load && m_frame - tile.last_used > TERRAIN_TILE_LOAD_FRAMES)
+            {
+                tile.load->cancelled.store(true, std::memory_order_relaxed);
+                m_cancelled_loads.push_back(tile.load);
+                tile.load.reset();
+            }
+        }
+        
+        for (int i = 0; i < m_cancelled_loads.size();)
+        {
+            if (m_cancelled_loads[i]->done())
+            {
+                m_cancelled_loads[i] = m_cancelled_loads.back();
+                m_cancelled_loads.pop_back();
+            }
+            else
+                i++;
+        }
+        
+        while (m_num_resident_tiles > TERRAIN_MAX_RESIDENT_TILES)
+        {
+            int oldest = -1;
+            
+            for (int i = 0; i < m_tiles.size(); i++)
+            {
+                if (m_tiles[i].texture && m_tiles[i].last_used != m_frame && (oldest == -1 || m_tiles[i].last_used < m_tiles[oldest].last_used))
+                    oldest = i;
+            }
+            
+            if (oldest == -1)
+                return;
+            
+            m_device->destroy(m_tiles[oldest].texture);
+            m_tiles[oldest].texture = nullptr;
+            m_tiles[oldest].pyramid = HeightPyramid();
+            m_num_resident_tiles--;
+        }
+    }
+    
+    void shutdown()
+    {
+        // Workers may still be reading from the mapping.
+        if (m_load)
+        {
+            m_load->wait();
+            m_load->tiled.close();
+            m_load.reset();
+        }
+        
+        for (int i = 0; i < m_tiles.size(); i++)
+        {
+            if (m_tiles[i].load)
+                m_tiles[i].load->wait();
+            
+            m_device->destroy(m_tiles[i].texture);
+        }
+        
+        for (int i = 0; i < m_cancelled_loads.size(); i++)
+            m_cancelled_loads[i]->wait();
+        
+        m_tiles.clear();
+        m_cancelled_loads.clear();
+        m_tiled.close();
+        
+        m_device->destroy(m_height_map);
+		m_device->destroy(m_sampler);
+        for (int i = 0; i < m_node_ubos.size(); i++)
+            m_device->destroy(m_node_ubos[i]);
+        
+        m_node_ubos.clear();
+        m_node_uploaders.clear();
+        m_device->destroy(m_program);
+        m_device->destroy(m_vs);
+        m_device->destroy(m_fs);
+        
+        for (int i = 0; i < TERRAIN_NUM_STITCH_VARIANTS; i++)
+        {
+            m_device->destroy(m_ibo[i]);
+            m_device->destroy(m_vao[i]);
+        }
+        
+        if (m_vbo)
+        {
+            m_device->destroy(m_vbo);
+            m_device->destroy(m_il);
+        }
+        m_device->destroy(m_ds);
+        m_device->destroy(m_rs);
+    }
+    
+    // Reads a raw 16 bit heightmap. Does not touch the device, so it is safe to call from any thread.
+    static bool read_raw(const char* path, int width, int height, std::vector<uint16_t>& samples)
+    {
+        int error;
+        FILE* filePtr;
+        unsigned long long imageSize, count;
+        
+        // Open the 16 bit raw height map file for reading in binary.
+        filePtr = fopen(path, "rb");
+        if(!filePtr)
+        {
+            return false;
+        }
+        
+        // Calculate the size of the raw image data.
+        imageSize = width * height;
+        
+        // Allocate memory for the raw image data.
+        samples.resize(imageSize);
+        
+        // Read in the raw image data.
+        count = fread(&samples[0], sizeof(unsigned short), imageSize, filePtr);
+        
+        // Close the file.
+        error = fclose(filePtr);
+        
+        return count == imageSize && error == 0;
+    }
+    
+    // Creates a height texture with the pyramid's box filtered mips. The UNORM16 samples and mips are
+    // converted to half floats of the same value, so the shader reads heights in [0, 1] like the CPU.
+    Texture2D* create_height_texture(const HeightPyramid& pyramid)
+    {
+        std::vector<uint16_t> halves(pyramid.m_samples.size());
+        
+        for (size_t i = 0; i < halves.size(); i++)
+            halves[i] = unorm16_to_half(pyramid.m_samples[i]);
+        
+        Texture2DCreateDesc desc;
+        DW_ZERO_MEMORY(desc);
+        
+        desc.data = (void*)&halves[0];
+        desc.format = TextureFormat::R16_FLOAT;
+        desc.height = pyramid.m_height;
+        desc.width = pyramid.m_width;
+        desc.mipmap_levels = 1 + pyramid.m_mips.size();
+        
+        Texture2D* texture = m_device->create_texture_2d(desc);
+        
+        for (int i = 0; i < pyramid.m_mips.size(); i++)
+        {
+            const std::vector<uint16_t>& mip = pyramid.m_mips[i];
+            
+            for (size_t j = 0; j < mip.size(); j++)
+                halves[j] = unorm16_to_half(mip[j]);
+            
+            m_device->set_texture_data(texture, i + 1, 0, (void*)&halves[0]);
+        }
+        
+        return texture;
+    }
+    
+    // Takes over the pyramid, whose samples stay available for CPU queries.
+    void upload_height_map(HeightPyramid& pyramid)
+    {
+        if (m_height_map)
+            m_device->destroy(m_height_map);
+        
+        m_height_map = create_height_texture(pyramid);
+        m_height_map_size = glm::vec2(pyramid.m_width, pyramid.m_height);
+        std::swap(m_pyramid, pyramid);
+    }
+    
+    bool load(int width, int height)
+    {
+        DW_PROFILE_SCOPE("Terrain::load");
+        
+        std::vector<uint16_t> samples;
+        HeightPyramid pyramid;
+        
+        if (!read_raw("heightmap.r16", width, height, samples))
+            return false;
+        
+        pyramid.build(samples, width, height);
+        upload_height_map(pyramid);
+        
+        return true;
+    }
+    
+    // Maps a tiled heightmap written by write_tiled_heightmap(). Only the overview is uploaded here, tiles
+    // are streamed in by render() as nodes close enough to need them are drawn.
+    bool load_tiled(const char* path)
+    {
+        DW_PROFILE_SCOPE("Terrain::load_tiled");
+        
+        if (!m_tiled.open(path))
+            return false;
+        
+        const HeightmapHeader& header = *m_tiled.m_header;
+        const uint16_t* overview = m_tiled.overview();
+        
+        std::vector<uint16_t> samples(overview, overview + header.overview_width * header.overview_height);
+        HeightPyramid pyramid;
+        
+        pyramid.build(samples, header.overview_width, header.overview_height);
+        upload_height_map(pyramid);
+        
+        TerrainTile tile = { nullptr, 0 };
+        m_tiles.resize(header.tiles_x * header.tiles_z, tile);
+        
+        return true;
+    }
+    
+    // Opens the tiled heightmap, or reads the raw one if there is none, on a loader thread. The terrain
+    // stays flat on a 1x1 placeholder until render() picks up the result and uploads it.
+    void load_async(const char* tiled_path, const char* raw_path, int width, int height)
+    {
+        std::vector<uint16_t> flat(1, 0);
+        HeightPyramid placeholder;
+        
+        placeholder.build(flat, 1, 1);
+        upload_height_map(placeholder);
+        
+        std::shared_ptr<HeightmapLoad> load = std::make_shared<HeightmapLoad>();
+        std::string tiled(tiled_path);
+        std::string raw(raw_path);
+        
+        load->width = width;
+        load->height = height;
+        m_load = load;
+        
+        AsyncLoader::get().enqueue([load, tiled, raw]() {
+            DW_PROFILE_SCOPE("Terrain::load_async");
+            
+            if (load->tiled.open(tiled.c_str()))
+            {
+                // Touch the overview here so the upload does not fault its pages in on the render thread.
+                const HeightmapHeader& header = *load->tiled.m_header;
+                const uint16_t* overview = load->tiled.overview();
+                
+                load->width = header.overview_width;
+                load->height = header.overview_height;
+                load->samples.assign(overview, overview + load->width * load->height);
+                load->finish(true);
+            }
+            else
+                load->finish(read_raw(raw.c_str(), load->width, load->height, load->samples));
+        });
+    }
+    
+    void poll_load()
+    {
+        if (!m_load || !m_load->done())
+            return;
+        
+        if (m_load->state == LOAD_READY)
+        {
+            upload_height_map(m_load->pyramid);
+            
+            if (m_load->tiled.m_header)
+            {
+                m_tiled = m_load->tiled;
+                
+                TerrainTile tile = { nullptr, 0 };
+                m_tiles.resize(m_tiled.m_header->tiles_x * m_tiled.m_header->tiles_z, tile);
+            }
+        }
+        
+        m_load.reset();
+    }
+};
+
+typedef BasicTerrain<RenderDevice> Terrain;
+
+struct TypeCounter
+{
+    static int counter;
+    
+    template<typename T>
+    static int get()
+    {
+        static int id = counter++;
+        return id;
+    }
+};
+
+int TypeCounter::counter = 0;
+
+enum SomeEnum
+{
+    VAL_1,
+    VAL_2
+};
+
+enum SomeOtherEnum
+{
+    TEST_1,
+    TEST_2
+};
+
+DECLARE_ENUM_TYPE_DESC(SomeEnum)
+
+BEGIN_ENUM_TYPE_DESC(SomeEnum)
+    REFLECT_ENUM_CONST(VAL_1)
+    REFLECT_ENUM_CONST(VAL_2)
+END_ENUM_TYPE_DESC()
+
+//template <>
+//TypeDescriptor* get_primitive_descriptor<SomeEnum>()
+//{
+//    static TypeDescriptor_SomeEnum typeDesc;
+//    return &typeDesc;
+//}
+
+struct Test
+{
+    int a;
+    float b;
+    bool vsync;
+    SomeEnum test_enum;
+    
+    REFLECT()
+};
+
+BEGIN_DECLARE_REFLECT(Test)
+    REFLECT_MEMBER(a, MemberHot())
+    REFLECT_MEMBER(b, MemberRange(0.0f, 1000.0f), MemberQuantize(16))
+    REFLECT_MEMBER(vsync)
+    REFLECT_MEMBER(test_enum, MemberCold())
+END_DECLARE_REFLECT()
+
+struct TransformComponent
+{
+    struct AoS
+    {
+        glm::vec3& pos;
+        glm::vec3& rot;
+        glm::vec3& scale;
+        
+        AoS(glm::vec3& _pos, glm::vec3& _rot, glm::vec3& _scale) : pos(_pos), rot(_rot), scale(_scale)
+        {
+            
+        }
+    };
+    
+    struct SoA
+    {
+        int count;
+        glm::vec3* positions;
+        glm::vec3* rotations;
+        glm::vec3* scales;
+        
+        AoS get_soa(int idx)
+        {
+            return { positions[idx], rotations[idx], scales[idx] };
+        }
+    };
+};
+
+typedef uint32_t Entity;
+
+#define INVALID_ENTITY 0xFFFFFFFF
+#define COMPONENT_PAGE_SIZE 4096
+
+// Type-erased view of a pool, so the store can drop an entity from every pool and reflection driven
+// code can reach components without knowing their types.
+struct ComponentPoolBase
+{
+    virtual ~ComponentPoolBase() {}
+    virtual bool remove(Entity entity) = 0;
+    virtual void* get_raw(Entity entity) = 0;
+    virtual TypeDescriptor* type() const = 0;
+};
+
+// Sparse set of the components of one type. The sparse pages map an entity to its slot in the packed
+// arrays, which keeps add, remove and lookup O(1) and the components contiguous for iteration. Removal
+// moves the last component into the hole, so order is not stable. Pages are only allocated for entity
+// ranges that hold a component of this type.
+template <typename T>
+struct ComponentPool : public ComponentPoolBase
+{
+    static_assert(TypeResolver::is_reflected<T>::value, "Components must be reflected");
+    
+    std::vector<std::unique_ptr<uint32_t[]>> m_pages;
+    std::vector<Entity> m_entities;
+    std::vector<T> m_components;
+    
+    uint32_t& slot(Entity entity)
+    {
+        uint32_t page = entity / COMPONENT_PAGE_SIZE;
+        
+        if (page >= m_pages.size())
+            m_pages.resize(page + 1);
+        
+        if (!m_pages[page])
+        {
+            m_pages[page].reset(new uint32_t[COMPONENT_PAGE_SIZE]);
+            std::fill(m_pages[page].get(), m_pages[page].get() + COMPONENT_PAGE_SIZE, INVALID_ENTITY);
+        }
+        
+        return m_pages[page][entity % COMPONENT_PAGE_SIZE];
+    }
+    
+    uint32_t index(Entity entity) const
+    {
+        uint32_t page = entity / COMPONENT_PAGE_SIZE;
+        
+        if (page >= m_pages.size() || !m_pages[page])
+            return INVALID_ENTITY;
+        
+        return m_pages[page][entity % COMPONENT_PAGE_SIZE];
+    }
+    
+    // Replaces the component if the entity already has one.
+    T& add(Entity entity, const T& component)
+    {
+        uint32_t& i = slot(entity);
+        
+        if (i != INVALID_ENTITY)
+        {
+            m_components[i] = component;
+            return m_components[i];
+        }
+        
+        i = (uint32_t)m_components.size();
+        m_entities.push_back(entity);
+        m_components.push_back(component);
+        
+        return m_components.back();
+    }
+    
+    bool remove(Entity entity) override
+    {
+        uint32_t i = index(entity);
+        
+        if (i == INVALID_ENTITY)
+            return false;
+        
+        Entity last = m_entities.back();
+        
+        if (last != entity)
+        {
+            m_components[i] = std::move(m_components.back());
+            m_entities[i] = last;
+            slot(last) = i;
+        }
+        
+        slot(entity) = INVALID_ENTITY;
+        
+        m_components.pop_back();
+        m_entities.pop_back();
+        
+        return true;
+    }
+    
+    T* get(Entity entity)
+    {
+        uint32_t i = index(entity);
+        return i == INVALID_ENTITY ? nullptr : &m_components[i];
+    }
+    
+    void* get_raw(Entity entity) override
+    {
+        return get(entity);
+    }
+    
+    TypeDescriptor* type() const override
+    {
+        return TypeResolver::get<T>();
+    }
+    
+    size_t size() const
+    {
+        return m_components.size();
+    }
+};
+
+// Entities and their components, with one pool per component type indexed by TypeCounter id.
+class ComponentStore
+{
+public:
+    Entity create()
+    {
+        if (!m_free.empty())
+        {
+            Entity entity = m_free.back();
+            m_free.pop_back();
+            m_alive[entity] = true;
+            return entity;
+        }
+        
+        m_alive.push_back(true);
+        
+        return m_num_entities++;
+    }
+    
+    bool alive(Entity entity) const
+    {
+        return entity < m_num_entities && m_alive[entity];
+    }
+    
+    // Removes every component of the entity and recycles its id. Returns false for ids that were never
+    // created or are already destroyed, which would otherwise be handed out twice by create().
+    bool destroy(Entity entity)
+    {
+        if (!alive(entity))
+            return false;
+        
+        for (int i = 0; i < m_pools.size(); i++)
+        {
+            if (m_pools[i])
+                m_pools[i]->remove(entity);
+        }
+        
+        m_alive[entity] = false;
+        m_free.push_back(entity);
+        
+        return true;
+    }
+    
+    template <typename T>
+    ComponentPool<T>& pool()
+    {
+        int id = TypeCounter::get<T>();
+        
+        if (id >= m_pools.size())
+            m_pools.resize(id + 1);
+        
+        if (!m_pools[id])
+            m_pools[id].reset(new ComponentPool<T>());
+        
+        return *static_cast<ComponentPool<T>*>(m_pools[id].get());
+    }
+    
+    // Pool for a TypeCounter id, or null if no component of that type was ever added.
+    ComponentPoolBase* pool(int id)
+    {
+        return id < m_pools.size() ? m_pools[id].get() : nullptr;
+    }
+    
+    template <typename T>
+    T& add(Entity entity, const T& component = T())
+    {
+        assert(alive(entity));
+        return pool<T>().add(entity, component);
+    }
+    
+    template <typename T>
+    bool remove(Entity entity)
+    {
+        return pool<T>().remove(entity);
+    }
+    
+    template <typename T>
+    T* get(Entity entity)
+    {
+        return pool<T>().get(entity);
+    }
+    
+    // Calls f(entity, component) for every component of type T, in packed order.
+    template <typename T, typename F>
+    void each(F f)
+    {
+        ComponentPool<T>& p = pool<T>();
+        
+        for (size_t i = 0; i < p.m_components.size(); i++)
+            f(p.m_entities[i], p.m_components[i]);
+    }
+    
+private:
+    std::vector<std::unique_ptr<ComponentPoolBase>> m_pools;
+    std::vector<Entity> m_free;
+    std::vector<bool> m_alive;
+    Entity m_num_entities = 0;
+};
+
+#define UNDO_CHUNK_SIZE 65536
+#define UNDO_DEFAULT_MAX_STEPS 4096
+#define UNDO_OWNED_CHUNK UINT32_MAX
+
+// Undo history for edits made in place on reflected objects. begin_edit() keeps a scratch copy of the
+// object and commit_edit() compares it leaf by leaf through the flat member table, so only the members
+// that actually changed are stored, each as its old value followed by its new value. Values are bump
+// allocated in fixed size chunks in history order, which lets dropped steps hand whole chunks back to a
+// pool for reuse. Entries hold raw addresses, so clear() must be called before edited objects go away.
+class UndoJournal
+{
+public:
+    UndoJournal(size_t max_steps = UNDO_DEFAULT_MAX_STEPS) : m_max_steps(max_steps)
+    {
+        
+    }
+    
+    ~UndoJournal()
+    {
+        clear();
+        
+        for (size_t i = 0; i < m_pool.size(); i++)
+            delete[] m_pool[i];
+    }
+    
+    void begin_edit(void* obj, TypeDescriptor* type)
+    {
+        m_edit_object = (uint8_t*)obj;
+        m_edit_type = type;
+        m_scratch.assign(m_edit_object, m_edit_object + type->m_size);
+    }
+    
+    // Records the members changed since begin_edit() as one step and drops anything that could be redone.
+    // When merge is set and the previous commit changed exactly the same members, the edit extends that
+    // step instead, so dragging a slider across many frames undoes in one go. Returns false if nothing
+    // changed, which also ends the merge run.
+    bool commit_edit(bool merge = true)
+    {
+        assert(m_edit_object);
+        
+        uint8_t* object = m_edit_object;
+        m_edit_object = nullptr;
+        m_changed.clear();
+        
+        if (TypeDescriptor_Struct* desc = m_edit_type->as_struct())
+        {
+            const std::vector<TypeDescriptor_Struct::FlatMember>& members = desc->flat_members();
+            
+            for (size_t i = 0; i < members.size(); i++)
+            {
+                size_t offset = members[i].m_offset;
+                size_t size = members[i].m_type->m_size;
+                
+                if (memcmp(object + offset, &m_scratch[offset], size) != 0)
+                    m_changed.push_back(std::make_pair(offset, size));
+            }
         }
+        else if (memcmp(object, &m_scratch[0], m_edit_type->m_size) != 0)
+            m_changed.push_back(std::make_pair((size_t)0, m_edit_type->m_size));
         
-        Shader* shaders[] = { m_vs, m_fs };
-        m_program = m_device->create_shader_program(shaders, 2);
-        
-        BufferCreateDesc bc;
-        InputLayoutCreateDesc ilcd;
-        VertexArrayCreateDesc vcd;
-        
-        DW_ZERO_MEMORY(bc);
-        bc.data = &m_vertices[0];
-        bc.data_type = DataType::FLOAT;
-        bc.size = sizeof(TerrainVertex) * (x + 1) * (z + 1);
-        bc.usage_type = BufferUsageType::STATIC;
+        if (m_changed.empty())
+        {
+            m_merge_open = false;
+            return false;
+        }
         
-        m_vbo = m_device->create_vertex_buffer(bc);
+        if (merge && m_merge_open && can_merge(object))
+        {
+            // Old values stay those from before the first merged edit, only the new ones move on.
+            const Step& step = m_steps[m_current - 1];
+            
+            for (size_t i = 0; i < step.num_changes; i++)
+            {
+                Change& change = get_change(step.first_change + i);
+                memcpy(change.data + change.size, change.address, change.size);
+            }
+            
+            return true;
+        }
         
-        DW_ZERO_MEMORY(bc);
-        bc.data = &m_indices[0];
-        bc.data_type = DataType::UINT32;
-        bc.size = sizeof(uint32_t) * m_indices.size();
-        bc.usage_type = BufferUsageType::STATIC;
+        truncate_redo();
         
-        m_ibo = m_device->create_index_buffer(bc);
+        Step step;
+        step.first_change = m_change_base + m_changes.size();
+        step.num_changes = m_changed.size();
         
-        InputElement elements[] =
+        for (size_t i = 0; i < m_changed.size(); i++)
         {
-            { 2, DataType::FLOAT, false, 0, "POSITION" }
-        };
+            Change change;
+            change.address = object + m_changed[i].first;
+            change.size = (uint32_t)m_changed[i].second;
+            allocate(change);
+            
+            memcpy(change.data, &m_scratch[m_changed[i].first], change.size);
+            memcpy(change.data + change.size, change.address, change.size);
+            
+            m_changes.push_back(change);
+        }
         
-        DW_ZERO_MEMORY(ilcd);
-        ilcd.elements = elements;
-        ilcd.num_elements = 1;
-        ilcd.vertex_size = sizeof(float) * 2;
+        m_steps.push_back(step);
+        m_current++;
+        m_merge_open = true;
         
-        m_il = m_device->create_input_layout(ilcd);
+        if (m_steps.size() > m_max_steps)
+            drop_oldest();
         
-        DW_ZERO_MEMORY(vcd);
-        vcd.index_buffer = m_ibo;
-        vcd.vertex_buffer = m_vbo;
-        vcd.layout = m_il;
+        return true;
+    }
+    
+    bool undo()
+    {
+        if (!can_undo())
+            return false;
         
-        m_vao = m_device->create_vertex_array(vcd);
+        const Step& step = m_steps[--m_current];
         
-        if (!m_vao || !m_ibo || !m_vbo)
+        for (size_t i = step.num_changes; i > 0; i--)
         {
-            LOG_FATAL("Failed to create Vertex Buffers/Arrays");
-            return;
+            const Change& change = get_change(step.first_change + i - 1);
+            memcpy(change.address, change.data, change.size);
         }
-
-		SamplerStateCreateDesc ssDesc;
-		DW_ZERO_MEMORY(ssDesc);
-
-		ssDesc.max_anisotropy = 0;
-		ssDesc.min_filter = TextureFilteringMode::LINEAR;
-		ssDesc.mag_filter = TextureFilteringMode::LINEAR;
-		ssDesc.wrap_mode_u = TextureWrapMode::CLAMP_TO_EDGE;
-		ssDesc.wrap_mode_v = TextureWrapMode::CLAMP_TO_EDGE;
-		ssDesc.wrap_mode_w = TextureWrapMode::CLAMP_TO_EDGE;
-
-		m_sampler = m_device->create_sampler_state(ssDesc);
-        
-        RasterizerStateCreateDesc rs_desc;
-        DW_ZERO_MEMORY(rs_desc);
-        rs_desc.cull_mode = CullMode::NONE;
-        rs_desc.fill_mode = FillMode::WIREFRAME;
-        rs_desc.front_winding_ccw = true;
-        rs_desc.multisample = true;
-        rs_desc.scissor = false;
-        
-        m_rs = m_device->create_rasterizer_state(rs_desc);
         
-        DepthStencilStateCreateDesc ds_desc;
-        DW_ZERO_MEMORY(ds_desc);
-        ds_desc.depth_mask = true;
-        ds_desc.enable_depth_test = true;
-        ds_desc.enable_stencil_test = false;
-        ds_desc.depth_cmp_func = ComparisonFunction::LESS_EQUAL;
+        m_merge_open = false;
         
-        m_ds = m_device->create_depth_stencil_state(ds_desc);
+        return true;
+    }
+    
+    bool redo()
+    {
+        if (!can_redo())
+            return false;
         
-        BufferCreateDesc uboDesc;
-        DW_ZERO_MEMORY(uboDesc);
-        uboDesc.data = nullptr;
-        uboDesc.data_type = DataType::FLOAT;
-        uboDesc.size = sizeof(TerrainUniforms);
-        uboDesc.usage_type = BufferUsageType::DYNAMIC;
+        const Step& step = m_steps[m_current++];
         
-        m_ubo = m_device->create_uniform_buffer(uboDesc);
+        for (size_t i = 0; i < step.num_changes; i++)
+        {
+            const Change& change = get_change(step.first_change + i);
+            memcpy(change.address, change.data + change.size, change.size);
+        }
         
-        m_uniforms.rect.x = x + 1;
-        m_uniforms.rect.y = z + 1;
-        m_uniforms.rect.z = x_half;
-        m_uniforms.rect.w = z_half;
-        m_uniforms.scale.x = 1.0f;
+        m_merge_open = false;
         
-        load(1024, 1024);
+        return true;
     }
     
-    void render(glm::mat4 view_proj, uint32_t width, uint32_t height)
+    bool can_undo() const
     {
-        ImGui::SliderFloat("Terrain Scale", &m_uniforms.scale.x, 1.0f, 300.0f);
-		ImGui::Image((ImTextureID)m_height_map->id, ImVec2(1025, 1025));
-        
-        m_uniforms.view_proj = view_proj;
+        return m_current > 0;
+    }
+    
+    bool can_redo() const
+    {
+        return m_current < m_steps.size();
+    }
+    
+    size_t num_steps() const
+    {
+        return m_steps.size();
+    }
+    
+    // Bytes held by live chunks, oversized values and step records, not counting pooled chunks.
+    size_t memory_used() const
+    {
+        return m_chunks.size() * UNDO_CHUNK_SIZE + m_owned_bytes + m_changes.size() * sizeof(Change) + m_steps.size() * sizeof(Step);
+    }
+    
+    void clear()
+    {
+        release_owned(0, m_changes.size());
         
-        void* ptr = m_device->map_buffer(m_ubo, BufferMapType::WRITE);
-        memcpy(ptr, &m_uniforms, sizeof(TerrainUniforms));
-        m_device->unmap_buffer(m_ubo);
+        for (size_t i = 0; i < m_chunks.size(); i++)
+            m_pool.push_back(m_chunks[i]);
         
-        m_device->bind_rasterizer_state(m_rs);
-        m_device->bind_depth_stencil_state(m_ds);
-        m_device->bind_framebuffer(nullptr);
-        m_device->set_viewport(width, height, 0, 0);
-        m_device->bind_shader_program(m_program);
-		m_device->bind_sampler_state(m_sampler, ShaderType::VERTEX, 0);
-        m_device->bind_uniform_buffer(m_ubo, ShaderType::VERTEX, 0);
-        m_device->bind_texture(m_height_map, ShaderType::VERTEX, 0);
-        m_device->bind_vertex_array(m_vao);
-        m_device->set_primitive_type(PrimitiveType::TRIANGLES);
-        m_device->draw_indexed(m_indices.size());
+        m_chunks.clear();
+        m_changes.clear();
+        m_steps.clear();
+        m_current = 0;
+        m_change_base = 0;
+        m_first_chunk = 0;
+        m_chunk_used = UNDO_CHUNK_SIZE;
+        m_merge_open = false;
     }
     
-    void shutdown()
+private:
+    struct Change
     {
-		m_device->destroy(m_sampler);
-        m_device->destroy(m_ubo);
-        m_device->destroy(m_program);
-        m_device->destroy(m_vs);
-        m_device->destroy(m_fs);
-        m_device->destroy(m_ibo);
-        m_device->destroy(m_vbo);
-        m_device->destroy(m_vao);
-        m_device->destroy(m_ds);
-        m_device->destroy(m_rs);
+        uint8_t* address;
+        uint8_t* data;  // Old value followed by new value.
+        uint32_t size;
+        uint32_t chunk; // Sequence number of the chunk holding data, or UNDO_OWNED_CHUNK if allocated alone.
+    };
+    
+    // Changes are stored in history order, so a step only needs its first index. Indices count every
+    // change ever recorded, so dropping old steps does not invalidate them.
+    struct Step
+    {
+        size_t first_change;
+        size_t num_changes;
+    };
+    
+    Change& get_change(size_t index)
+    {
+        return m_changes[index - m_change_base];
     }
     
-    bool load(int width, int height)
+    bool can_merge(uint8_t* object)
     {
-        int error;
-        FILE* filePtr;
-        unsigned long long imageSize, count;
-        unsigned short* rawImage;
+        if (m_current == 0 || m_current != m_steps.size())
+            return false;
         
-        // Open the 16 bit raw height map file for reading in binary.
-        filePtr = fopen("heightmap.r16", "rb");
+        const Step& step = m_steps[m_current - 1];
         
-        // Calculate the size of the raw image data.
-        imageSize = width * height;
+        if (step.num_changes != m_changed.size())
+            return false;
         
-        // Allocate memory for the raw image data.
-        rawImage = new unsigned short[imageSize];
-        if(!rawImage)
+        for (size_t i = 0; i < step.num_changes; i++)
         {
-            return false;
+            const Change& change = get_change(step.first_change + i);
+            
+            if (change.address != object + m_changed[i].first || change.size != m_changed[i].second)
+                return false;
         }
         
-        // Read in the raw image data.
-        count = fread(rawImage, sizeof(unsigned short), imageSize, filePtr);
-        if(count != imageSize)
+        return true;
+    }
+    
+    void allocate(Change& change)
+    {
+        size_t size = (size_t)change.size * 2;
+        
+        // Values too big for a chunk get their own buffer, freed when the change is dropped.
+        if (size > UNDO_CHUNK_SIZE)
         {
-            return false;
+            change.data = new uint8_t[size];
+            change.chunk = UNDO_OWNED_CHUNK;
+            m_owned_bytes += size;
+            return;
         }
-
-		//for (int i = 0; i < 100; i++)
-		//{
-		//	uint16_t data = rawImage[i];
-		//	float fdata = (float)data;
-		//	std::cout << data << std::endl;
-		//	std::cout << fdata << std::endl;
-		//}
         
-        // Close the file.
-        error = fclose(filePtr);
-        if(error != 0)
+        if (m_chunk_used + size > UNDO_CHUNK_SIZE)
         {
-            return false;
+            uint8_t* chunk;
+            
+            if (m_pool.empty())
+                chunk = new uint8_t[UNDO_CHUNK_SIZE];
+            else
+            {
+                chunk = m_pool.back();
+                m_pool.pop_back();
+            }
+            
+            m_chunks.push_back(chunk);
+            m_chunk_used = 0;
         }
         
-        Texture2DCreateDesc desc;
-        
-        desc.data = rawImage;
-        desc.format = TextureFormat::R16_FLOAT;
-        desc.height = height;
-        desc.width = width;
-        desc.mipmap_levels = 1;
-        
-        m_height_map = m_device->create_texture_2d(desc);
-
-        // Release the bitmap image data.
-        delete [] rawImage;
-        rawImage = 0;
-        
-        return true;
+        change.data = m_chunks.back() + m_chunk_used;
+        change.chunk = (uint32_t)(m_first_chunk + m_chunks.size() - 1);
+        m_chunk_used += size;
     }
-};
-
-struct TypeCounter
-{
-    static int counter;
     
-    template<typename T>
-    static int get()
+    void release_owned(size_t begin, size_t end)
     {
-        static int id = counter++;
-        return id;
+        for (size_t i = begin; i < end; i++)
+        {
+            if (m_changes[i].chunk == UNDO_OWNED_CHUNK)
+            {
+                delete[] m_changes[i].data;
+                m_owned_bytes -= (size_t)m_changes[i].size * 2;
+            }
+        }
     }
-};
-
-int TypeCounter::counter = 0;
-
-enum SomeEnum
-{
-    VAL_1,
-    VAL_2
-};
-
-enum SomeOtherEnum
-{
-    TEST_1,
-    TEST_2
-};
-
-DECLARE_ENUM_TYPE_DESC(SomeEnum)
-
-BEGIN_ENUM_TYPE_DESC(SomeEnum)
-    REFLECT_ENUM_CONST(VAL_1)
-    REFLECT_ENUM_CONST(VAL_2)
-END_ENUM_TYPE_DESC()
-
-//template <>
-//TypeDescriptor* get_primitive_descriptor<SomeEnum>()
-//{
-//    static TypeDescriptor_SomeEnum typeDesc;
-//    return &typeDesc;
-//}
-
-struct Test
-{
-    int a;
-    float b;
-    bool vsync;
-    SomeEnum test_enum;
     
-    REFLECT()
-};
-
-BEGIN_DECLARE_REFLECT(Test)
-    REFLECT_MEMBER(a)
-    REFLECT_MEMBER(b)
-    REFLECT_MEMBER(vsync)
-    REFLECT_MEMBER(test_enum)
-END_DECLARE_REFLECT()
-
-struct TransformComponent
-{
-    struct AoS
+    // Index of the first change at or after begin whose data lives in a chunk.
+    size_t first_chunked(size_t begin) const
     {
-        glm::vec3& pos;
-        glm::vec3& rot;
-        glm::vec3& scale;
+        while (begin < m_changes.size() && m_changes[begin].chunk == UNDO_OWNED_CHUNK)
+            begin++;
         
-        AoS(glm::vec3& _pos, glm::vec3& _rot, glm::vec3& _scale) : pos(_pos), rot(_rot), scale(_scale)
+        return begin;
+    }
+    
+    // Allocation is sequential, so the first chunked redo change marks where the allocator rewinds to.
+    void truncate_redo()
+    {
+        if (m_current == m_steps.size())
+            return;
+        
+        size_t begin = m_steps[m_current].first_change - m_change_base;
+        size_t first_index = first_chunked(begin);
+        
+        if (first_index < m_changes.size())
         {
+            const Change& first = m_changes[first_index];
+            size_t last_chunk = first.chunk - m_first_chunk;
+            
+            while (m_chunks.size() > last_chunk + 1)
+            {
+                m_pool.push_back(m_chunks.back());
+                m_chunks.pop_back();
+            }
             
+            m_chunk_used = first.data - m_chunks.back();
         }
-    };
+        
+        release_owned(begin, m_changes.size());
+        m_changes.erase(m_changes.begin() + begin, m_changes.end());
+        m_steps.erase(m_steps.begin() + m_current, m_steps.end());
+    }
     
-    struct SoA
+    void drop_oldest()
     {
-        int count;
-        glm::vec3* positions;
-        glm::vec3* rotations;
-        glm::vec3* scales;
+        size_t count = m_steps.front().num_changes;
         
-        AoS get_soa(int idx)
+        m_steps.pop_front();
+        release_owned(0, count);
+        m_changes.erase(m_changes.begin(), m_changes.begin() + count);
+        m_change_base += count;
+        m_current--;
+        
+        if (m_chunks.empty())
+            return;
+        
+        // Chunks older than the one holding the oldest remaining value are no longer referenced.
+        size_t first_index = first_chunked(0);
+        uint32_t oldest = first_index == m_changes.size() ? m_first_chunk + (uint32_t)m_chunks.size() - 1 : m_changes[first_index].chunk;
+        
+        while (m_first_chunk < oldest)
         {
-            return { positions[idx], rotations[idx], scales[idx] };
+            m_pool.push_back(m_chunks.front());
+            m_chunks.pop_front();
+            m_first_chunk++;
         }
-    };
+    }
+    
+    size_t m_max_steps;
+    std::deque<uint8_t*> m_chunks;
+    std::vector<uint8_t*> m_pool;
+    size_t m_chunk_used = UNDO_CHUNK_SIZE;
+    size_t m_owned_bytes = 0;
+    uint32_t m_first_chunk = 0;
+    std::deque<Change> m_changes;
+    size_t m_change_base = 0;
+    std::deque<Step> m_steps;
+    size_t m_current = 0;
+    bool m_merge_open = false;
+    uint8_t* m_edit_object = nullptr;
+    TypeDescriptor* m_edit_type = nullptr;
+    std::vector<uint8_t> m_scratch;
+    std::vector<std::pair<size_t, size_t>> m_changed;
 };
 
 class DebugDrawDemo : public dw::Application
@@ -1095,7 +6928,10 @@ private:
     float m_heading_speed = 0.0f;
     float m_sideways_speed = 0.0f;
     bool m_mouse_look = false;
-    dd::Renderer m_debug_renderer;
+    StateCachingDevice<RenderDevice> m_state_cache { &m_device };
+    dd::BasicRenderer<StateCachingDevice<RenderDevice>> m_debug_renderer;
+    uint32_t m_state_changes_issued = 0;
+    uint32_t m_state_changes_skipped = 0;
     glm::vec3 m_min_extents;
     glm::vec3 m_max_extents;
     glm::vec3 m_pos;
@@ -1103,13 +6939,21 @@ private:
     float m_rotation;
     float m_grid_spacing;
     float m_grid_y;
+    uint32_t m_grid = 0;
     bool m_debug_mode = false;
+    bool m_culling = false;
+    bool m_adaptive_tessellation = false;
+    int m_depth_mode = dd::DEPTH_MODE_TESTED;
+    float m_alpha = 1.0f;
     glm::mat4 m_model;
     Test test_struct;
+    UndoJournal m_journal;
     
 public:
     bool init() override
     {
+        DW_PROFILE_SCOPE("DebugDrawDemo::init");
+        
         m_camera = new Camera(45.0f,
                               0.1f,
                               10000.0f,
@@ -1144,7 +6988,7 @@ public:
         std::cout << TypeCounter::get<decltype(a)>() << std::endl;
         std::cout << TypeCounter::get<decltype(b)>() << std::endl;
 
-        return m_debug_renderer.init(&m_device);
+        return m_debug_renderer.init(&m_state_cache);
     }
     
     template <typename T>
@@ -1152,52 +6996,128 @@ public:
     {
         TypeDescriptor* desc = TypeResolver::get<T>();
         ImGui::Begin("Properties");
+        
+        if (ImGui::Button("Undo"))
+            m_journal.undo();
+        
+        ImGui::SameLine();
+        
+        if (ImGui::Button("Redo"))
+            m_journal.redo();
+        
+        ImGui::SameLine();
+        ImGui::Text("%zu steps, %zu bytes", m_journal.num_steps(), m_journal.memory_used());
+        
+        m_journal.begin_edit(&obj, desc);
         desc->gui(&obj, "Test Struct");
+        m_journal.commit_edit();
+        
         ImGui::End();
     }
     
     void update(double delta) override
     {
-        updateCamera();
+        DW_PROFILE_SCOPE("DebugDrawDemo::update");
+        
+        {
+            DW_PROFILE_SCOPE("Camera");
+            updateCamera();
+        }
         
-        m_device.bind_framebuffer(nullptr);
-        m_device.set_viewport(m_width, m_height, 0, 0);
+        // ImGui rendered through the device behind the cache's back last frame.
+        m_state_changes_issued = m_state_cache.m_num_issued;
+        m_state_changes_skipped = m_state_cache.m_num_skipped;
+        m_state_cache.invalidate();
+        m_state_cache.reset_stats();
         
-        float clear[] = { 0.3f, 0.3f, 0.3f, 1.0f };
-        m_device.clear_framebuffer(ClearTarget::ALL, clear);
+        m_state_cache.bind_framebuffer(nullptr);
+        m_state_cache.set_viewport(m_width, m_height, 0, 0);
         
-        ImGui::Begin("Debug Draw");
+        float clear[] = { 0.3f, 0.3f, 0.3f, 1.0f };
+        m_state_cache.clear_framebuffer(ClearTarget::ALL, clear);
         
-        ImGui::InputFloat3("Min Extents", &m_min_extents[0]);
-        ImGui::InputFloat3("Max Extents", &m_max_extents[0]);
-        ImGui::InputFloat3("Position", &m_pos[0]);
-        ImGui::ColorEdit3("Color", &m_color[0]);
-        ImGui::InputFloat("Rotation", &m_rotation);
-        ImGui::InputFloat("Grid Spacing", &m_grid_spacing);
-        ImGui::InputFloat("Grid Y-Level", &m_grid_y);
+        bool grid_changed = false;
         
-        if (ImGui::Button("Toggle Debug Camera"))
         {
-            m_debug_mode = !m_debug_mode;
+            DW_PROFILE_SCOPE("ImGui");
+            
+            ImGui::Begin("Debug Draw");
+            
+            ImGui::InputFloat3("Min Extents", &m_min_extents[0]);
+            ImGui::InputFloat3("Max Extents", &m_max_extents[0]);
+            ImGui::InputFloat3("Position", &m_pos[0]);
+            ImGui::ColorEdit3("Color", &m_color[0]);
+            ImGui::SliderFloat("Alpha", &m_alpha, 0.0f, 1.0f);
+            
+            const char* depth_modes[] = { "Depth Tested", "X-Ray", "Overlay" };
+            
+            if (ImGui::BeginCombo("Depth Mode", depth_modes[m_depth_mode]))
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    if (ImGui::Selectable(depth_modes[i], m_depth_mode == i))
+                        m_depth_mode = i;
+                }
+                ImGui::EndCombo();
+            }
+            
+            ImGui::InputFloat("Rotation", &m_rotation);
+            grid_changed |= ImGui::InputFloat("Grid Spacing", &m_grid_spacing);
+            grid_changed |= ImGui::InputFloat("Grid Y-Level", &m_grid_y);
+            
+            if (ImGui::Button("Toggle Debug Camera"))
+            {
+                m_debug_mode = !m_debug_mode;
+            }
+            
+            ImGui::Checkbox("Frustum Culling", &m_culling);
+            ImGui::Checkbox("Adaptive Tessellation", &m_adaptive_tessellation);
+            ImGui::Text("State Changes: %u issued, %u skipped", m_state_changes_issued, m_state_changes_skipped);
+            
+            ImGui::End();
+            ImGui::ShowDemoWindow();
+            render_properties(test_struct);
+            Profiler::get().gui("trace.json");
         }
         
-        ImGui::End();
-        ImGui::ShowDemoWindow();
-        render_properties(test_struct);
-        
-        m_debug_renderer.capsule(20.0f, 5.0f, glm::vec3(-20.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0));
-//        m_debug_renderer.grid(101.0f, 101.0f, m_grid_y, m_grid_spacing, glm::vec3(1.0f));
-        //m_debug_renderer.aabb(m_min_extents, m_max_extents, m_pos, m_color);
-        m_debug_renderer.sphere(5.0f, glm::vec3(0.0f, 0.0f, 20.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-        m_model = glm::rotate(glm::mat4(1.0f), glm::radians(m_rotation), glm::vec3(0.0f, 1.0f, 0.0f));
-        m_debug_renderer.obb(m_min_extents, m_max_extents, m_model, m_color);
-        
-        if (m_debug_mode)
-            m_debug_renderer.frustum(m_camera->m_projection, m_camera->m_view, glm::vec3(0.0f, 1.0f, 0.0f));
+        {
+            DW_PROFILE_SCOPE("Shape generation");
+            
+            if (m_culling)
+                m_debug_renderer.enable_culling(m_camera->m_view_projection);
+            else
+                m_debug_renderer.disable_culling();
+            
+            if (m_adaptive_tessellation)
+                m_debug_renderer.enable_lod(m_camera->m_position, glm::radians(45.0f), m_height);
+            else
+                m_debug_renderer.disable_lod();
+            
+            // The grid is static, so it is only re-recorded when its parameters change.
+            if (grid_changed || m_grid == 0)
+            {
+                m_debug_renderer.remove_retained(m_grid);
+                m_debug_renderer.begin_static()->grid(101.0f, 101.0f, m_grid_y, m_grid_spacing, glm::vec3(1.0f));
+                m_grid = m_debug_renderer.end_retained();
+            }
+            
+            m_debug_renderer.capsule(20.0f, 5.0f, glm::vec3(-20.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0));
+            //m_debug_renderer.aabb(m_min_extents, m_max_extents, m_pos, m_color);
+            m_debug_renderer.sphere(5.0f, glm::vec3(0.0f, 0.0f, 20.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+            m_model = glm::rotate(glm::mat4(1.0f), glm::radians(m_rotation), glm::vec3(0.0f, 1.0f, 0.0f));
+            m_debug_renderer.set_depth_mode((dd::DepthMode)m_depth_mode);
+            m_debug_renderer.set_alpha(m_alpha);
+            m_debug_renderer.obb(m_min_extents, m_max_extents, m_model, m_color);
+            m_debug_renderer.set_depth_mode(dd::DEPTH_MODE_TESTED);
+            m_debug_renderer.set_alpha(1.0f);
+            
+            if (m_debug_mode)
+                m_debug_renderer.frustum(m_camera->m_projection, m_camera->m_view, glm::vec3(0.0f, 1.0f, 0.0f));
+        }
         
-        m_debug_renderer.render(nullptr, m_width, m_height, m_debug_mode ? m_debug_camera->m_view_projection : m_camera->m_view_projection);
+        m_debug_renderer.render(nullptr, m_width, m_height, m_debug_mode ? m_debug_camera->m_view_projection : m_camera->m_view_projection, m_delta / 1000.0);
         
-        //m_terrain->render(m_debug_mode ? m_debug_camera->m_view_projection : m_camera->m_view_projection, m_width, m_height);
+        //m_terrain->render(m_debug_mode ? m_debug_camera->m_view_projection : m_camera->m_view_projection, m_camera->m_position, m_width, m_height);
     }
     
     void shutdown() override
@@ -1268,4 +7188,609 @@ public:
     }
 };
 
+#if defined(DW_HEADLESS_BENCHMARK)
+
+#define BENCHMARK_HEIGHTMAP_PATH "benchmark_heightmap.tmp"
+#define BENCHMARK_CORRUPT_HEIGHTMAP_PATH "benchmark_heightmap_corrupt.tmp"
+
+typedef BasicTerrain<StateCachingDevice<RecordingRenderDevice>> BenchmarkTerrain;
+
+// Writes a synthetic map with the given compression, streams every tile in through the terrain and
+// compares the decoded samples and the tile table's bounds with the source. Then checks that truncated
+// and corrupt copies of the file are rejected.
+static bool check_tiled_heightmap(StateCachingDevice<RecordingRenderDevice>* device, int compression)
+{
+    const int kWidth = 300;
+    const int kHeight = 200;
+    const int kTileSize = 32;
+    const int kTilesX = (kWidth + kTileSize - 1) / kTileSize;
+    const int kTilesZ = (kHeight + kTileSize - 1) / kTileSize;
+    std::vector<uint16_t> samples(kWidth * kHeight);
+    
+    // Smooth hills with noise and some steps large enough to need 16 bit deltas.
+    for (int z = 0; z < kHeight; z++)
+    {
+        for (int x = 0; x < kWidth; x++)
+        {
+            int height = 30000 + (int)(15000.0f * sinf(x * 0.05f) * cosf(z * 0.07f)) + (x * 7919 + z * 104729) % 257;
+            samples[z * kWidth + x] = (uint16_t)((x / 37 + z / 23) % 5 == 0 ? height ^ 0x8000 : height);
+        }
+    }
+    
+    if (!write_tiled_heightmap(BENCHMARK_HEIGHTMAP_PATH, &samples[0], kWidth, kHeight, kTileSize, compression))
+        return false;
+    
+    BenchmarkTerrain terrain(1024.0f, 1024.0f, 1.0f, device);
+    bool ok = terrain.load_tiled(BENCHMARK_HEIGHTMAP_PATH);
+    
+    // Tiles are read on loader threads and uploaded a few per frame. Requesting all of them every frame
+    // also keeps evict_tiles() from dropping any, although there are more than TERRAIN_MAX_RESIDENT_TILES.
+    for (int frame = 0; ok && terrain.m_num_resident_tiles < kTilesX * kTilesZ; frame++)
+    {
+        terrain.begin_tile_frame();
+        
+        for (int i = 0; i < kTilesX * kTilesZ; i++)
+        {
+            terrain.request_tile(i % kTilesX, i / kTilesX);
+            ok = ok && !terrain.m_tiles[i].failed;
+        }
+        
+        terrain.evict_tiles();
+        ok = ok && frame < 5000;
+        
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    
+    for (int i = 0; ok && i < kTilesX * kTilesZ; i++)
+    {
+        const std::vector<uint16_t>& decoded = terrain.m_tiles[i].pyramid.m_samples;
+        const HeightmapTileEntry& entry = terrain.m_tiled.m_tiles[i];
+        uint16_t min = 0xFFFF;
+        uint16_t max = 0;
+        
+        ok = decoded.size() == (kTileSize + 1) * (kTileSize + 1);
+        
+        for (int z = 0; ok && z <= kTileSize; z++)
+        {
+            for (int x = 0; x <= kTileSize; x++)
+            {
+                int sx = glm::min((i % kTilesX) * kTileSize + x, kWidth - 1);
+                int sz = glm::min((i / kTilesX) * kTileSize + z, kHeight - 1);
+                uint16_t sample = samples[sz * kWidth + sx];
+                
+                ok = ok && decoded[z * (kTileSize + 1) + x] == sample;
+                min = glm::min(min, sample);
+                max = glm::max(max, sample);
+            }
+        }
+        
+        ok = ok && entry.min_height == min && entry.max_height == max;
+    }
+    
+    // Once only one tile is still wanted, eviction brings the working set back to the limit.
+    terrain.begin_tile_frame();
+    terrain.request_tile(0, 0);
+    terrain.evict_tiles();
+    
+    ok = ok && terrain.m_num_resident_tiles == TERRAIN_MAX_RESIDENT_TILES && terrain.m_tiles[0].texture;
+    terrain.shutdown();
+    
+    MappedFile file;
+    std::vector<uint8_t> bytes;
+    
+    if (file.open(BENCHMARK_HEIGHTMAP_PATH))
+        bytes.assign(file.m_data, file.m_data + file.m_size);
+    
+    file.close();
+    remove(BENCHMARK_HEIGHTMAP_PATH);
+    
+    if (!ok || bytes.empty())
+        return false;
+    
+    auto opens = [](const std::vector<uint8_t>& data, size_t size)
+    {
+        FILE* out = fopen(BENCHMARK_CORRUPT_HEIGHTMAP_PATH, "wb");
+        bool written = out && fwrite(&data[0], 1, size, out) == size;
+        
+        if (out)
+            written = fclose(out) == 0 && written;
+        
+        TiledHeightmap map;
+        bool opened = written && map.open(BENCHMARK_CORRUPT_HEIGHTMAP_PATH);
+        
+        map.close();
+        remove(BENCHMARK_CORRUPT_HEIGHTMAP_PATH);
+        
+        return opened;
+    };
+    
+    std::vector<uint8_t> bad_magic = bytes;
+    std::vector<uint8_t> bad_offset = bytes;
+    std::vector<uint8_t> bad_size = bytes;
+    HeightmapTileEntry* offset_entries = (HeightmapTileEntry*)&bad_offset[sizeof(HeightmapHeader)];
+    HeightmapTileEntry* size_entries = (HeightmapTileEntry*)&bad_size[sizeof(HeightmapHeader)];
+    
+    ((HeightmapHeader*)&bad_magic[0])->magic ^= 1;
+    offset_entries[kTilesX * kTilesZ - 1].offset = bytes.size();
+    size_entries[0].size += compression == HEIGHTMAP_COMPRESSION_NONE ? 2 : bytes.size();
+    
+    // The untouched copy has to open, otherwise the rejections below prove nothing.
+    ok = opens(bytes, bytes.size()) && !opens(bytes, bytes.size() - 1) && !opens(bad_magic, bad_magic.size()) &&
+         !opens(bad_offset, bad_offset.size()) && !opens(bad_size, bad_size.size());
+    
+    // Delta compressed tiles are only checked for their extent up front. A bad block mode fails the read.
+    if (ok && compression == HEIGHTMAP_COMPRESSION_DELTA)
+    {
+        TiledHeightmap map;
+        std::vector<uint8_t> bad_mode = bytes;
+        std::vector<uint16_t> tile(samples.size());
+        
+        bad_mode[((const HeightmapTileEntry*)&bytes[sizeof(HeightmapHeader)])->offset] = 0xFF;
+        
+        FILE* out = fopen(BENCHMARK_CORRUPT_HEIGHTMAP_PATH, "wb");
+        ok = out && fwrite(&bad_mode[0], 1, bad_mode.size(), out) == bad_mode.size();
+        ok = out && fclose(out) == 0 && ok;
+        ok = ok && map.open(BENCHMARK_CORRUPT_HEIGHTMAP_PATH) && !map.read_tile(0, 0, &tile[0]);
+        
+        map.close();
+        remove(BENCHMARK_CORRUPT_HEIGHTMAP_PATH);
+    }
+    
+    return ok;
+}
+
+// Stands in for a large value without members, which the undo journal records as one change.
+struct TypeDescriptor_Blob : TypeDescriptor
+{
+    TypeDescriptor_Blob(size_t size) : TypeDescriptor{"blob", size}
+    {
+        
+    }
+    
+    virtual void gui(void* obj, const char* name) override
+    {
+        
+    }
+};
+
+// Exercises merging, redo truncation, trimming past the step limit and values too big for a chunk.
+static bool check_undo_journal()
+{
+    Test test;
+    DW_ZERO_MEMORY(test);
+    
+    // A drag across frames is one step, an idle frame ends it and another member starts a new one. The
+    // limit is raised so the history below spans several chunks without trimming.
+    UndoJournal journal(100000);
+    
+    for (int frame = 1; frame <= 10; frame++)
+    {
+        journal.begin_edit(&test, &Test::Reflection);
+        test.b = (float)frame;
+        journal.commit_edit();
+    }
+    
+    journal.begin_edit(&test, &Test::Reflection);
+    bool ok = !journal.commit_edit() && journal.num_steps() == 1;
+    
+    journal.begin_edit(&test, &Test::Reflection);
+    test.a = 5;
+    ok = ok && journal.commit_edit() && journal.num_steps() == 2;
+    
+    ok = ok && journal.undo() && test.a == 0 && test.b == 10.0f;
+    ok = ok && journal.undo() && test.a == 0 && test.b == 0.0f && !journal.undo();
+    ok = ok && journal.redo() && test.b == 10.0f && journal.redo() && test.a == 5 && !journal.redo();
+    
+    // Undoing everything and recording as many steps again reuses the same chunk space.
+    for (int i = 0; i < 10000; i++)
+    {
+        journal.begin_edit(&test, &Test::Reflection);
+        test.a = i + 100;
+        journal.commit_edit(false);
+    }
+    
+    size_t memory = journal.memory_used();
+    
+    while (journal.undo());
+    
+    ok = ok && test.a == 0 && test.b == 0.0f;
+    
+    journal.begin_edit(&test, &Test::Reflection);
+    test.vsync = true;
+    ok = ok && journal.commit_edit() && !journal.can_redo() && journal.num_steps() == 1;
+    
+    for (int i = 0; i < 10001; i++)
+    {
+        journal.begin_edit(&test, &Test::Reflection);
+        test.a = i + 100;
+        journal.commit_edit(false);
+    }
+    
+    ok = ok && journal.memory_used() == memory && journal.undo() && test.a == 10099;
+    
+    // Past the limit the oldest steps go, and with them the chunks only they used.
+    UndoJournal limited(16);
+    
+    for (int i = 0; i < 100000; i++)
+    {
+        limited.begin_edit(&test, &Test::Reflection);
+        test.a = i;
+        limited.commit_edit(false);
+    }
+    
+    ok = ok && limited.num_steps() == 16 && limited.memory_used() <= 2 * UNDO_CHUNK_SIZE + 4096;
+    
+    for (int i = 0; i < 16; i++)
+        ok = ok && limited.undo();
+    
+    ok = ok && !limited.undo() && test.a == 100000 - 17;
+    
+    // Values larger than a chunk get a buffer of their own, freed with the step that holds them.
+    TypeDescriptor_Blob blob_type(UNDO_CHUNK_SIZE + 1000);
+    std::vector<uint8_t> blob(blob_type.m_size, 0);
+    UndoJournal blobs(2);
+    
+    for (int i = 1; i <= 3; i++)
+    {
+        blobs.begin_edit(&blob[0], &blob_type);
+        blob[blob.size() - i] = (uint8_t)i;
+        ok = ok && blobs.commit_edit(false);
+    }
+    
+    size_t blob_memory = blobs.memory_used();
+    
+    ok = ok && blobs.num_steps() == 2 && blob_memory >= 4 * blob_type.m_size && blob_memory < 5 * blob_type.m_size;
+    ok = ok && blobs.undo() && blob[blob.size() - 3] == 0 && blob[blob.size() - 2] == 2;
+    ok = ok && blobs.undo() && blob[blob.size() - 2] == 0 && blob[blob.size() - 1] == 1 && !blobs.undo();
+    ok = ok && blobs.redo() && blob[blob.size() - 2] == 2;
+    
+    blobs.begin_edit(&test, &Test::Reflection);
+    test.a = -1;
+    ok = ok && blobs.commit_edit() && blobs.memory_used() < blob_memory - blob_type.m_size;
+    ok = ok && blobs.undo() && test.a == 100000 - 17 && blobs.undo() && blob[blob.size() - 2] == 0;
+    
+    blobs.clear();
+    
+    return ok && blobs.memory_used() == 0;
+}
+
+// Runs debug-draw shape generation, batching and upload against RecordingRenderDevice and reports the
+// average CPU cost per frame. Needs no window or GPU, so it can run on build servers.
+int main()
+{
+    const int kFrames = 1000;
+    const int kSpheres = 1000;
+    
+    RecordingRenderDevice device;
+    StateCachingDevice<RecordingRenderDevice> cache(&device);
+    dd::BasicRenderer<StateCachingDevice<RecordingRenderDevice>> renderer;
+    
+    if (!renderer.init(&cache))
+        return 1;
+    
+    glm::mat4 view_proj = glm::mat4(1.0f);
+    glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(60.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    
+    size_t num_draw_calls = 0;
+    size_t bytes_uploaded = 0;
+    size_t num_issued = 0;
+    size_t num_skipped = 0;
+    
+    auto start = std::chrono::high_resolution_clock::now();
+    
+    for (int frame = 0; frame < kFrames; frame++)
+    {
+        device.reset();
+        cache.invalidate();
+        cache.reset_stats();
+        
+        renderer.capsule(20.0f, 5.0f, glm::vec3(-20.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0));
+        renderer.set_depth_mode(dd::DEPTH_MODE_XRAY);
+        renderer.obb(glm::vec3(-10.0f), glm::vec3(10.0f), model, glm::vec3(1.0f, 0.0f, 0.0f));
+        renderer.set_depth_mode(dd::DEPTH_MODE_TESTED);
+        renderer.grid(101.0f, 101.0f, 0.0f, 1.0f, glm::vec3(1.0f));
+        
+        for (int i = 0; i < kSpheres; i++)
+        {
+            // Every fourth sphere is translucent, so buckets interleave with the opaque ones on submission.
+            renderer.set_alpha(i % 4 == 0 ? 0.5f : 1.0f);
+            renderer.sphere(1.0f, glm::vec3(i % 32, 0.0f, i / 32), glm::vec3(0.0f, 0.0f, 1.0f));
+        }
+        
+        renderer.set_alpha(1.0f);
+        renderer.set_depth_mode(dd::DEPTH_MODE_OVERLAY);
+        renderer.frustum(glm::perspective(glm::radians(45.0f), 1.0f, 1.0f, 100.0f), glm::mat4(1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        
+        renderer.render(nullptr, 1280, 720, view_proj, 1.0f / 60.0f);
+        
+        num_draw_calls += device.m_draw_calls.size();
+        bytes_uploaded += device.m_bytes_uploaded + renderer.bytes_uploaded();
+        num_issued += cache.m_num_issued;
+        num_skipped += cache.m_num_skipped;
+    }
+    
+    auto end = std::chrono::high_resolution_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    
+    printf("Frames:          %d\n", kFrames);
+    printf("CPU time/frame:  %.4f ms\n", ms / kFrames);
+    printf("Draw calls/frame: %zu\n", num_draw_calls / kFrames);
+    printf("Uploaded/frame:  %zu bytes\n", bytes_uploaded / kFrames);
+    printf("State changes/frame: %zu issued, %zu skipped\n", num_issued / kFrames, num_skipped / kFrames);
+    
+    // An x-ray shape is drawn twice, the second time blended behind the scene with the faded uniforms.
+    device.reset();
+    renderer.set_depth_mode(dd::DEPTH_MODE_XRAY);
+    renderer.obb(glm::vec3(-10.0f), glm::vec3(10.0f), model, glm::vec3(1.0f, 0.0f, 0.0f));
+    renderer.render(nullptr, 1280, 720, view_proj, 1.0f / 60.0f);
+    
+    if (device.m_draw_calls.size() != 2)
+    {
+        printf("X-ray shape issued %zu draw calls instead of 2\n", device.m_draw_calls.size());
+        return 1;
+    }
+    
+    const RecordingRenderDevice::DrawCall& visible = device.m_draw_calls[0];
+    const RecordingRenderDevice::DrawCall& hidden = device.m_draw_calls[1];
+    const dd::CameraUniforms* visible_uniforms = (const dd::CameraUniforms*)&((RecordingRenderDevice::Resource*)visible.uniform_buffer)->data[0];
+    const dd::CameraUniforms* hidden_uniforms = (const dd::CameraUniforms*)&((RecordingRenderDevice::Resource*)hidden.uniform_buffer)->data[0];
+    
+    if (hidden.depth_stencil_state == visible.depth_stencil_state || hidden.blend_state == visible.blend_state ||
+        visible_uniforms->tint.w != 1.0f || hidden_uniforms->tint.w != XRAY_HIDDEN_ALPHA)
+    {
+        printf("X-ray hidden pass does not differ from the visible pass\n");
+        return 1;
+    }
+    
+    // The full vertex format drops alpha, so a translucent shape shares the opaque bucket and its draw call.
+    dd::BasicRenderer<StateCachingDevice<RecordingRenderDevice>> full_renderer;
+    
+    if (!full_renderer.init(&cache, dd::VERTEX_FORMAT_FULL))
+        return 1;
+    
+    device.reset();
+    full_renderer.line(glm::vec3(0.0f), glm::vec3(1.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    full_renderer.set_alpha(0.5f);
+    full_renderer.line(glm::vec3(2.0f), glm::vec3(3.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    full_renderer.render(nullptr, 1280, 720, view_proj, 1.0f / 60.0f);
+    full_renderer.shutdown();
+    
+    if (device.m_draw_calls.size() != 1)
+    {
+        printf("Full vertex format drew translucent shapes blended\n");
+        return 1;
+    }
+    
+    BenchmarkTerrain buffer_terrain(1024.0f, 1024.0f, 1.0f, &cache, TERRAIN_VERTEX_SOURCE_BUFFER);
+    BenchmarkTerrain terrain(1024.0f, 1024.0f, 1.0f, &cache, TERRAIN_VERTEX_SOURCE_ID);
+    
+    if (!terrain.validate_geometry())
+    {
+        printf("Terrain index validation failed\n");
+        return 1;
+    }
+    
+    glm::mat4 proj = glm::perspective(glm::radians(45.0f), 1280.0f / 720.0f, 0.1f, 10000.0f);
+    size_t terrain_draw_calls[2];
+    BenchmarkTerrain* terrains[] = { &buffer_terrain, &terrain };
+    const char* terrain_names[] = { "buffer", "ID" };
+    
+    for (int t = 0; t < 2; t++)
+    {
+        num_draw_calls = 0;
+        num_issued = 0;
+        num_skipped = 0;
+        start = std::chrono::high_resolution_clock::now();
+        
+        for (int frame = 0; frame < kFrames; frame++)
+        {
+            device.reset();
+            cache.invalidate();
+            cache.reset_stats();
+            glm::vec3 camera_pos(frame % 512, 50.0f, 0.0f);
+            terrains[t]->render(proj * glm::lookAt(camera_pos, camera_pos + glm::vec3(0.0f, -0.5f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f)), camera_pos, 1280, 720);
+            num_draw_calls += device.m_draw_calls.size();
+            num_issued += cache.m_num_issued;
+            num_skipped += cache.m_num_skipped;
+        }
+        
+        end = std::chrono::high_resolution_clock::now();
+        ms = std::chrono::duration<double, std::milli>(end - start).count();
+        terrain_draw_calls[t] = num_draw_calls;
+        
+        printf("Terrain (%s) CPU time/frame:   %.4f ms\n", terrain_names[t], ms / kFrames);
+        printf("Terrain (%s) draw calls/frame: %zu\n", terrain_names[t], num_draw_calls / kFrames);
+        printf("Terrain (%s) state changes/frame: %zu issued, %zu skipped\n", terrain_names[t], num_issued / kFrames, num_skipped / kFrames);
+    }
+    
+    buffer_terrain.shutdown();
+    
+    if (terrain_draw_calls[0] != terrain_draw_calls[1])
+    {
+        printf("Terrain vertex sources disagree\n");
+        return 1;
+    }
+
+    const int kRays = 4096;
+    std::vector<uint16_t> samples(1025 * 1025);
+    HeightPyramid pyramid;
+    
+    for (int i = 0; i < samples.size(); i++)
+        samples[i] = (uint16_t)(32768.0f + 16384.0f * sinf((i % 1025) * 0.05f) * cosf((i / 1025) * 0.03f));
+    
+    pyramid.build(samples, 1025, 1025);
+    terrain.m_uniforms.scale.x = 100.0f;
+    terrain.upload_height_map(pyramid);
+    
+    std::vector<glm::vec3> origins(kRays);
+    std::vector<glm::vec3> directions(kRays);
+    std::vector<float> distances(kRays);
+    
+    for (int i = 0; i < kRays; i++)
+    {
+        origins[i] = glm::vec3((i % 64) * 16.0f - 512.0f, 120.0f, (i / 64) * 16.0f - 512.0f);
+        directions[i] = glm::normalize(glm::vec3(1.0f, -0.2f, 0.5f));
+    }
+    
+    start = std::chrono::high_resolution_clock::now();
+    terrain.raycast(&origins[0], &directions[0], kRays, &distances[0]);
+    end = std::chrono::high_resolution_clock::now();
+    
+    printf("Terrain raycasts:         %d in %.4f ms\n", kRays, std::chrono::duration<double, std::milli>(end - start).count());
+    
+    if (!check_tiled_heightmap(&cache, HEIGHTMAP_COMPRESSION_NONE) || !check_tiled_heightmap(&cache, HEIGHTMAP_COMPRESSION_DELTA))
+    {
+        printf("Tiled heightmap round trip failed\n");
+        return 1;
+    }
+    
+    terrain.shutdown();
+    renderer.shutdown();
+    
+    if (!check_undo_journal())
+    {
+        printf("Undo journal check failed\n");
+        return 1;
+    }
+    
+    const int kEntities = 250000;
+    ComponentStore store;
+    
+    for (int i = 0; i < kEntities; i++)
+    {
+        Entity entity = store.create();
+        store.add<Test>(entity).a = i;
+    }
+    
+    for (Entity entity = 0; entity < kEntities; entity += 3)
+        store.destroy(entity);
+    
+    int64_t sum = 0;
+    start = std::chrono::high_resolution_clock::now();
+    
+    store.each<Test>([&sum](Entity entity, Test& test) { sum += test.a; });
+    
+    end = std::chrono::high_resolution_clock::now();
+    
+    printf("Component iteration:      %zu in %.4f ms (%lld)\n", store.pool<Test>().size(), std::chrono::duration<double, std::milli>(end - start).count(), (long long)sum);
+    
+    start = std::chrono::high_resolution_clock::now();
+    
+    store.each<Test>([](Entity entity, Test& test) { PropertyAccessor::compile<Test>("b").set(&test, 1.0f); });
+    
+    end = std::chrono::high_resolution_clock::now();
+    double by_name_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    
+    PropertyAccessor accessor = PropertyAccessor::compile<Test>("b");
+    start = std::chrono::high_resolution_clock::now();
+    
+    store.each<Test>([&accessor](Entity entity, Test& test) { accessor.set(&test, 2.0f); });
+    
+    end = std::chrono::high_resolution_clock::now();
+    
+    printf("Property writes:          %.4f ms by name, %.4f ms compiled\n", by_name_ms, std::chrono::duration<double, std::milli>(end - start).count());
+    
+    uint64_t hash = REFLECT_HASH_SEED;
+    start = std::chrono::high_resolution_clock::now();
+    
+    store.each<Test>([&hash](Entity entity, Test& test) { hash = Test::Reflection.hash(&test, hash, MEMBER_TRANSIENT | MEMBER_COLD); });
+    
+    end = std::chrono::high_resolution_clock::now();
+    
+    printf("Component hash (hot):     %.4f ms (%016llx)\n", std::chrono::duration<double, std::milli>(end - start).count(), (unsigned long long)hash);
+    
+    std::vector<uint8_t> bytes;
+    BitWriter writer;
+    start = std::chrono::high_resolution_clock::now();
+    
+    store.each<Test>([&bytes, &writer](Entity entity, Test& test)
+    {
+        Test::Reflection.serialize(&test, bytes);
+        Test::Reflection.write_bits(&test, writer);
+    });
+    
+    writer.flush();
+    end = std::chrono::high_resolution_clock::now();
+    
+    printf("Component encoding:       %zu bytes serialized, %zu bit-packed in %.4f ms\n", bytes.size(), writer.m_data.size(), std::chrono::duration<double, std::milli>(end - start).count());
+    
+    // b is quantized to 16 bits over [0, 1000], everything else must come back exactly.
+    BitReader reader(writer.m_data.empty() ? nullptr : &writer.m_data[0], writer.m_data.size());
+    float max_error = 0.0f;
+    bool round_trip = true;
+    
+    store.each<Test>([&reader, &max_error, &round_trip](Entity entity, Test& test)
+    {
+        Test decoded;
+        Test::Reflection.read_bits(&decoded, reader);
+        
+        max_error = glm::max(max_error, fabsf(decoded.b - test.b));
+        round_trip &= decoded.a == test.a && decoded.vsync == test.vsync && decoded.test_enum == test.test_enum;
+    });
+    
+    if (!round_trip || !reader.ok() || max_error > 0.5f * 1000.0f / 65535.0f)
+    {
+        printf("Component bit-packing round trip failed (max error %f)\n", max_error);
+        return 1;
+    }
+    
+    store.each<Test>([](Entity entity, Test& test)
+    {
+        test.b = (float)(entity % 100);
+        test.vsync = entity % 4 == 0;
+    });
+    
+    const std::vector<Test>& tests = store.pool<Test>().m_components;
+    std::vector<float> b_column(tests.size());
+    std::vector<uint8_t> vsync_column(tests.size());
+    
+    for (size_t i = 0; i < tests.size(); i++)
+    {
+        b_column[i] = tests[i].b;
+        vsync_column[i] = tests[i].vsync;
+    }
+    
+    size_t loop_matches = 0;
+    start = std::chrono::high_resolution_clock::now();
+    
+    for (size_t i = 0; i < tests.size(); i++)
+        loop_matches += tests[i].b > 10.0f && tests[i].vsync;
+    
+    end = std::chrono::high_resolution_clock::now();
+    double loop_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    
+    FilterQuery query = FilterQuery::compile<Test>("b > 10.0 && vsync");
+    std::vector<uint64_t> selection;
+    start = std::chrono::high_resolution_clock::now();
+    
+    query.evaluate(&tests[0], sizeof(Test), tests.size(), selection);
+    
+    end = std::chrono::high_resolution_clock::now();
+    double aos_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    size_t aos_matches = count_selected(selection);
+    
+    const void* columns[] = { &b_column[0], &vsync_column[0] };
+    start = std::chrono::high_resolution_clock::now();
+    
+    query.evaluate_columns(columns, tests.size(), selection);
+    
+    end = std::chrono::high_resolution_clock::now();
+    
+    size_t soa_matches = count_selected(selection);
+    
+    printf("Filter query:             %zu/%zu/%zu matches, %.4f ms loop, %.4f ms AoS, %.4f ms SoA\n", loop_matches, aos_matches, soa_matches, loop_ms, aos_ms, std::chrono::duration<double, std::milli>(end - start).count());
+    
+    if (aos_matches != loop_matches || soa_matches != loop_matches)
+    {
+        printf("Filter query results differ from the reference loop\n");
+        return 1;
+    }
+    
+    return 0;
+}
+
+#else
+
 DW_DECLARE_MAIN(DebugDrawDemo)
+
+#endif